@@ -5,15 +5,131 @@
 #include <sys/mman.h> 
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "allocation.h"
+#include "stats.h"
 
 #define NUM_BLOCKS 50
 
+/* The number of blocks on the simulated disk. The examples use
+ * NUM_BLOCKS; benchmarks simulate larger disks.
+ */
+static int num_blocks = NUM_BLOCKS;
+
 /* The name of the file that contains our block allocation table
  * that simulates the used disk.
  * We make the variable static to hide it from other C files.
  */
 static char* file_name = NULL;
 
+/* The table file is mapped shared, so every process that uses the same
+ * disk works on the same bytes. A block is taken or given back by
+ * compare-and-swap of its byte, which is what keeps two processes, or
+ * two threads, from taking the same block; the allocators only choose
+ * the candidate, so allocating and freeing take no lock.
+ * The mapping is made on first use.
+ */
+static char* shared = NULL;
+static int shared_blocks = 0;
+
+/* Serializes making and dropping the mapping. */
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The block after the one allocated last, where next-fit starts looking.
+ * Only a hint, so the threads that allocate at once may overwrite each
+ * other's.
+ */
+static _Atomic int next_fit_start = 0;
+
+/* An entry of the table, read while other threads and processes swap
+ * entries.
+ */
+static inline char entry( const char* table, int i )
+{
+    return __atomic_load_n( &table[i], __ATOMIC_RELAXED );
+}
+
+static int pick_first_fit( const char* table, int num_blocks, int goal )
+{
+    (void)goal;
+    for( int i=0; i<num_blocks; i++ )
+    {
+        if( entry( table, i ) == 0 )
+            return i;
+    }
+    return -1;
+}
+
+/* The first free block at or after start, wrapping around at the end. */
+static int first_free_from( const char* table, int num_blocks, int start )
+{
+    for( int n=0; n<num_blocks; n++ )
+    {
+        int i = ( start + n ) % num_blocks;
+        if( entry( table, i ) == 0 )
+            return i;
+    }
+    return -1;
+}
+
+static int pick_next_fit( const char* table, int num_blocks, int goal )
+{
+    (void)goal;
+    int start = __atomic_load_n( &next_fit_start, __ATOMIC_RELAXED );
+    return first_free_from( table, num_blocks, start < num_blocks ? start : 0 );
+}
+
+/* The first block of the shortest run of free blocks, so that the long
+ * runs are kept for later.
+ */
+static int pick_best_fit( const char* table, int num_blocks, int goal )
+{
+    (void)goal;
+    int best = -1;
+    int best_len = 0;
+    for( int i=0; i<num_blocks; )
+    {
+        if( entry( table, i ) != 0 )
+        {
+            i++;
+            continue;
+        }
+        int start = i;
+        while( i < num_blocks && entry( table, i ) == 0 )
+            i++;
+        if( best < 0 || i - start < best_len )
+        {
+            best = start;
+            best_len = i - start;
+            if( best_len == 1 )
+                break;
+        }
+    }
+    return best;
+}
+
+static int pick_goal( const char* table, int num_blocks, int goal )
+{
+    if( goal < 0 || goal >= num_blocks )
+        return pick_next_fit( table, num_blocks, goal );
+    return first_free_from( table, num_blocks, goal );
+}
+
+const struct block_allocator block_allocators[] =
+{
+    { "first-fit", pick_first_fit },
+    { "next-fit", pick_next_fit },
+    { "best-fit", pick_best_fit },
+    { "goal", pick_goal },
+    { NULL, NULL }
+};
+
+/* Read and set atomically, as allocations do not lock. */
+static const struct block_allocator* allocator = &block_allocators[0];
+
 void set_block_allocation_table_name( char* str )
 {
     if( file_name != NULL )
@@ -27,168 +143,296 @@ void set_block_allocation_table_name( char* str )
     file_name = strdup( str );
 }
 
+/* Called with table_lock held. */
+static void unmap_shared( )
+{
+    if( shared != NULL )
+    {
+        munmap( shared, shared_blocks );
+        __atomic_store_n( &shared, NULL, __ATOMIC_RELEASE );
+    }
+}
+
 void release_block_allocation_table_name( )
 {
+    pthread_mutex_lock( &table_lock );
+    unmap_shared( );
+    pthread_mutex_unlock( &table_lock );
     if( file_name )
     {
         free( file_name );
     }
 }
 
-static char* read_table( )
+/* Maps the table. With create the file is created, or its size fixed,
+ * for format_disk(). Called with table_lock held.
+ */
+static char* map_shared( int create )
 {
     if( file_name == NULL )
     {
         fprintf( stderr, "Failed to set the name of the block allocation table file.\n" );
         exit( -1 );
     }
-
-    char* table = malloc( NUM_BLOCKS );
-    if( table == NULL )
+    if( shared != NULL )
     {
-        fprintf( stderr, "Failed to allocate %d bytes\n", NUM_BLOCKS );
-        return NULL;
+        return shared;
     }
 
-    FILE* f = fopen( file_name, "r" );
-    if( !f )
+    int fd = open( file_name, create ? O_RDWR | O_CREAT : O_RDWR, 0666 );
+    if( fd < 0 )
     {
         fprintf( stderr, "Failed to open file %s for reading\n", file_name );
         perror("reason:");
         return NULL;
     }
-
-    int num_read = fread( table, 1, NUM_BLOCKS, f );
-    if( num_read != NUM_BLOCKS )
+    struct stat st;
+    if( fstat( fd, &st ) != 0
+        || ( create && st.st_size != num_blocks && ftruncate( fd, num_blocks ) != 0 )
+        || ( !create && st.st_size < num_blocks ) )
     {
-        fprintf( stderr, "Failed to load %d block entries from disk\n", NUM_BLOCKS );
+        fprintf( stderr, "Failed to load %d block entries from disk\n", num_blocks );
+        close( fd );
+        return NULL;
+    }
+    void* addr = mmap( NULL, num_blocks, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( addr == MAP_FAILED )
+    {
+        fprintf( stderr, "Failed to map file %s\n", file_name );
         perror("reason:");
-        fclose(f);
         return NULL;
     }
-    fclose( f );
-
-    return table;
+    shared_blocks = num_blocks;
+    __atomic_store_n( &shared, (char*)addr, __ATOMIC_RELEASE );
+    return shared;
 }
 
-static int write_table( char* table )
+/* Returns the mapped table, mapping it first if need be; only the
+ * first call takes table_lock.
+ */
+static char* shared_table( int create )
 {
-    if( file_name == NULL )
+    char* table = __atomic_load_n( &shared, __ATOMIC_ACQUIRE );
+    if( table != NULL )
     {
-        fprintf( stderr, "Failed to set the name of the block allocation table file.\n" );
-        exit( -1 );
+        return table;
     }
+    pthread_mutex_lock( &table_lock );
+    table = map_shared( create );
+    pthread_mutex_unlock( &table_lock );
+    return table;
+}
 
-    FILE* f = fopen( file_name, "w" );
-    if( !f )
+/* Returns a copy of the table. */
+static char* read_table( )
+{
+    char* table = shared_table( 0 );
+    if( table == NULL )
     {
-        fprintf( stderr, "Failed to open file %s for writing\n", file_name );
-        perror("reason:");
-        return -1;
+        return NULL;
     }
-    int num = fwrite( table, 1, NUM_BLOCKS, f );
-    if( num != NUM_BLOCKS )
+    char* copy = malloc( num_blocks );
+    if( copy == NULL )
     {
-        fprintf( stderr, "Failed to write %d bytes to %s\n", NUM_BLOCKS, file_name);
-        fprintf( stderr, "fwrite returned %d\n", num );
-        perror("reason:");
-        return -1;
+        fprintf( stderr, "Failed to allocate %d bytes\n", num_blocks );
+        return NULL;
     }
-    fclose( f );
-    return 0;
+    memcpy( copy, table, num_blocks );
+    fs_count( FS_BAT_READS, 1 );
+    fs_count( FS_BAT_BYTES_READ, num_blocks );
+    return copy;
 }
 
-int format_disk()
+/* Replaces the whole table. */
+static int write_table( const char* table )
 {
-    if( file_name == NULL )
+    char* dest = shared_table( 0 );
+    if( dest == NULL )
     {
-        fprintf( stderr, "Failed to set the name of the block allocation table file.\n" );
-        exit( -1 );
+        return -1;
     }
+    memcpy( dest, table, num_blocks );
+    fs_count( FS_BAT_WRITES, 1 );
+    fs_count( FS_BAT_BYTES_WRITTEN, num_blocks );
+    return 0;
+}
 
-    int error = unlink( file_name );
-
-    if( error == 0 || errno == ENOENT )
+static int format_table()
+{
+    next_fit_start = 0;
+    char* table = shared_table( 1 );
+    if( table == NULL )
     {
-        /* We want to set all NUM_BLOCK chars to 0, convenient to use
-         * calloc.
-         */
-        char* table = calloc( NUM_BLOCKS, 1 );
-        if( table == NULL )
-        {
-            fprintf( stderr, "Failed to allocate %d bytes\n", NUM_BLOCKS );
-            return -1;
-        }
-
-        int retval = write_table( table );
-        free( table );
-        return retval;
+        return -1;
     }
+    memset( table, 0, num_blocks );
+    fs_count( FS_BAT_WRITES, 1 );
+    fs_count( FS_BAT_BYTES_WRITTEN, num_blocks );
+    return 0;
+}
 
-    fprintf( stderr, "Failed to remove existing file %s, code %d\n", file_name, errno );
-    perror("reason:");
-    return -1;
+int format_disk()
+{
+    uint64_t start = fs_now_ns( );
+    int retval = format_table( );
+    fs_op_done( FS_OP_FORMAT_DISK, start, -1 );
+    return retval;
 }
 
 int allocate_block( )
 {
-    char* table = read_table( );
+    return allocate_block_near( -1 );
+}
+
+static int take_block( int goal )
+{
+    char* table = shared_table( 0 );
     if( table == NULL )
     {
         return -1;
     }
 
-    for( int i=0; i<NUM_BLOCKS; i++ )
+    /* Another thread or process may take the block between the pick and
+     * the swap; then pick again. Every retry means someone got a block.
+     */
+    const struct block_allocator* a = __atomic_load_n( &allocator, __ATOMIC_ACQUIRE );
+    for( ;; )
     {
-        if( table[i] == 0 )
+        int i = a->pick( table, num_blocks, goal );
+        if( i < 0 || i >= num_blocks )
+        {
+            return -1;
+        }
+        char expected = 0;
+        if( __atomic_compare_exchange_n( &table[i], &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
         {
             /* Found an unused block */
-            table[i] = 1;
-            write_table( table );
-
-            free( table );
+            __atomic_store_n( &next_fit_start, i + 1, __ATOMIC_RELAXED );
+            fs_count( FS_BLOCKS_ALLOCATED, 1 );
             return i;
         }
     }
+}
 
-    free( table );
-    return -1;
+int allocate_block_near( int goal )
+{
+    uint64_t start = fs_now_ns( );
+    int block = take_block( goal );
+    fs_op_done( FS_OP_ALLOCATE_BLOCK, start, block );
+    return block;
 }
 
-int free_block(int block)
+void set_block_allocator( const struct block_allocator* a )
 {
-    if( block < 0 || block >= NUM_BLOCKS )
+    __atomic_store_n( &allocator, a != NULL ? a : &block_allocators[0], __ATOMIC_RELEASE );
+    next_fit_start = 0;
+}
+
+const struct block_allocator* find_block_allocator( const char* name )
+{
+    for( int i=0; block_allocators[i].name != NULL; i++ )
+    {
+        if( strcmp( block_allocators[i].name, name ) == 0 )
+            return &block_allocators[i];
+    }
+    return NULL;
+}
+
+static int give_back_block(int block)
+{
+    if( block < 0 || block >= num_blocks )
     {
         fprintf( stderr, "Block number %d is not valid\n", block );
         return -1;
     }
 
-    char* table = read_table();
+    char* table = shared_table( 0 );
     if( table == NULL )
     {
         return -1;
     }
 
-    if( table[block] != 1 )
+    char expected = 1;
+    if( !__atomic_compare_exchange_n( &table[block], &expected, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
     {
         fprintf( stderr, "Block %d was not allocated\n", block );
-        free( table );
         return -1;
     }
+    fs_count( FS_BLOCKS_FREED, 1 );
 
-    table[block] = 0;
+    return 0;
+}
 
-    write_table( table );
-    free( table );
+int free_block(int block)
+{
+    uint64_t start = fs_now_ns( );
+    int retval = give_back_block( block );
+    fs_op_done( FS_OP_FREE_BLOCK, start, block );
+    return retval;
+}
 
-    return 0;
+int sync_blocks( const size_t* blocks, int num )
+{
+    char* table = shared_table( 0 );
+    if( table == NULL )
+    {
+        return -1;
+    }
+    if( num <= 0 )
+    {
+        return 0;
+    }
+    size_t lo = blocks[0];
+    size_t hi = blocks[0];
+    for( int i = 1; i < num; i++ )
+    {
+        if( blocks[i] < lo ) lo = blocks[i];
+        if( blocks[i] > hi ) hi = blocks[i];
+    }
+    if( hi >= (size_t)shared_blocks )
+    {
+        fprintf( stderr, "Block number %zu is not valid\n", hi );
+        return -1;
+    }
+    // msync wants a page-aligned start; the table is small, so one call covers the range
+    size_t page = sysconf( _SC_PAGESIZE );
+    size_t start = lo - lo % page;
+    return msync( table + start, hi + 1 - start, MS_SYNC );
+}
+
+void set_disk_num_blocks( int blocks )
+{
+    pthread_mutex_lock( &table_lock );
+    unmap_shared( );
+    num_blocks = blocks;
+    pthread_mutex_unlock( &table_lock );
+}
+
+int disk_num_blocks( )
+{
+    return num_blocks;
+}
+
+char* read_block_allocation_table( )
+{
+    return read_table( );
+}
+
+int write_block_allocation_table( const char* table )
+{
+    return write_table( table );
 }
 
 void debug_disk( )
 {
     char* table = read_table( );
+    if( table == NULL )
+    {
+        return;
+    }
     printf("Disk:\n");
-    for( int i=0; i<NUM_BLOCKS; i++ )
+    for( int i=0; i<num_blocks; i++ )
         printf("%d", table[i] );
     printf("\n");
     free(table);
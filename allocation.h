@@ -1,6 +1,15 @@
 #ifndef ALLOCATION_H
 #define ALLOCATION_H
 
+#include <stddef.h>
+
+/* All functions in this file may be called from several threads
+ * at the same time, and from several processes that use the same
+ * block allocation table file: the file is mapped shared, and a block
+ * is taken and given back with an atomic compare-and-swap of its entry,
+ * so no process loses another's allocations.
+ */
+
 /* Set the name of block allocation table file.
  * This is necessary to have several examples in the same
  * directory.
@@ -13,7 +22,7 @@ void set_block_allocation_table_name( char* str );
 void release_block_allocation_table_name( );
 
 /* Set all the blocks in our simulated disk into an unused
- * state.
+ * state. The file is created if it does not exist.
  * This function returns 0 in case of success and -1 if the
  * file simulating the blocks cannot be written.
  */
@@ -25,12 +34,81 @@ int format_disk();
  */
 int allocate_block();
 
+/* Like allocate_block(), but tells the allocator that goal is the block
+ * the caller would like best, usually the one after the previous block
+ * of the same file, or -1 for no preference. Whether it is used depends
+ * on the allocator.
+ */
+int allocate_block_near( int goal );
+
+/* A strategy for choosing the block that allocate_block() hands out.
+ * pick gets the block allocation table, one char per block, 1 for a
+ * used block and 0 for a free one, and the goal given to
+ * allocate_block_near(). It returns a free block, or -1 if there is
+ * none. It is called without a lock while other threads and processes
+ * take and give back blocks, so it reads the table with relaxed atomic
+ * loads, and any state it keeps must be atomic; a block that is gone by
+ * the time it is taken makes allocate_block() call pick again.
+ */
+struct block_allocator
+{
+    const char* name;
+    int (*pick)( const char* table, int num_blocks, int goal );
+};
+
+/* The built-in allocators, ended by an entry whose name is NULL.
+ * first-fit  the lowest free block; the default
+ * next-fit   the first free block after the one allocated last
+ * best-fit   the first block of the shortest run of free blocks
+ * goal       the goal, or the first free block after it; next-fit
+ *            without a goal
+ */
+extern const struct block_allocator block_allocators[];
+
+/* Makes allocate_block() use allocator, or first-fit for NULL. */
+void set_block_allocator( const struct block_allocator* allocator );
+
+/* Returns the built-in allocator called name, or NULL. */
+const struct block_allocator* find_block_allocator( const char* name );
+
 /* Free the block with the given ID.
  * This functions returns 0 if the block was freed
  * or -1 if the block with this ID was not allocated.
  */
 int free_block(int block);
 
+/* Writes the entries of the num blocks to the table file on disk
+ * before it returns, so that they survive a crash of the machine.
+ * Allocating and freeing only change the shared mapping, which the
+ * kernel writes back when it likes.
+ * This function returns 0 in case of success and -1 if the
+ * entries cannot be written.
+ */
+int sync_blocks( const size_t* blocks, int num );
+
+/* Set the number of blocks of the simulated disk, 50 unless this is
+ * called. It must match the block allocation table file, so call it
+ * before format_disk() or before using a table of that size.
+ */
+void set_disk_num_blocks( int num_blocks );
+
+/* Returns the number of blocks on the simulated disk. */
+int disk_num_blocks( );
+
+/* Returns a copy of the block allocation table, one char per block,
+ * 1 for a used block and 0 for a free one. The caller frees it.
+ * Returns NULL if the table cannot be read.
+ */
+char* read_block_allocation_table( );
+
+/* Replaces the whole block allocation table by table, which holds
+ * disk_num_blocks() entries. Used to repair the table, while no other
+ * process uses the disk.
+ * This functions returns 0 in case of success and -1 if the
+ * file cannot be written.
+ */
+int write_block_allocation_table( const char* table );
+
 /* This debug function prints the table to stdout. */
 void debug_disk();
 
@@ -0,0 +1,374 @@
+#include "protocol.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static const char* op_names[FS_NUM_REQUEST_OPS] =
+{
+    NULL, "create", "mkdir", "delete", "rmdir", "lookup", "stat", "list", "save", "stop"
+};
+
+static const char* status_names[FS_NUM_STATUS] =
+{
+    "ok", "not found", "exists", "not a directory", "is a directory", "not empty",
+    "no space", "bad request", "failed"
+};
+
+/* What a request is expected to do, from "= ok" or "= fail" at the end
+ * of its line, as in the scripts of replay_fs.
+ */
+#define EXPECT_NOTHING 0
+#define EXPECT_OK      1
+#define EXPECT_FAIL    2
+
+/* A request that was sent and not answered yet. */
+struct pending
+{
+    int op;
+    int expect;
+    long line;
+    char* path;
+    uint64_t start;
+};
+
+static int parse_op( const char* word )
+{
+    for( int op = 1; op < FS_NUM_REQUEST_OPS; op++ )
+    {
+        if( strcmp( word, op_names[op] ) == 0 )
+            return op;
+    }
+    return -1;
+}
+
+/* Parses a line into req and p. Returns 1 for a request, 0 for an empty
+ * line and -1 for a line that is not a request.
+ */
+static int parse_line( char* line, struct fs_request* req, struct pending* p )
+{
+    char* hash = strchr( line, '#' );
+    if( hash != NULL )
+        *hash = 0;
+
+    char* saveptr = NULL;
+    char* words[5];
+    int n = 0;
+    for( char* w = strtok_r( line, " \t\r\n", &saveptr ); w != NULL; w = strtok_r( NULL, " \t\r\n", &saveptr ) )
+    {
+        if( n == 5 )
+            return -1;
+        words[n++] = w;
+    }
+    if( n == 0 )
+        return 0;
+
+    p->expect = EXPECT_NOTHING;
+    if( n >= 3 && strcmp( words[n - 2], "=" ) == 0 )
+    {
+        if( strcmp( words[n - 1], "ok" ) == 0 )
+            p->expect = EXPECT_OK;
+        else if( strcmp( words[n - 1], "fail" ) == 0 )
+            p->expect = EXPECT_FAIL;
+        else
+            return -1;
+        n -= 2;
+    }
+
+    memset( req, 0, sizeof(*req) );
+    p->op = parse_op( words[0] );
+    p->path = n > 1 ? words[1] : "";
+    switch( p->op )
+    {
+    case FS_REQ_CREATE:
+        if( n != 3 )
+            return -1;
+        req->arg = atoi( words[2] );
+        break;
+    case FS_REQ_SAVE:
+    case FS_REQ_STOP:
+        if( n != 1 )
+            return -1;
+        break;
+    case -1:
+        return -1;
+    default:
+        if( n != 2 )
+            return -1;
+    }
+    if( strlen( p->path ) >= FS_PATH_MAX )
+        return -1;
+    req->op = p->op;
+    req->path_len = strlen( p->path );
+    return 1;
+}
+
+static int read_all( int fd, void* buf, size_t len )
+{
+    char* p = buf;
+    while( len > 0 )
+    {
+        ssize_t n = read( fd, p, len );
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n <= 0 )
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_all( int fd, const void* buf, size_t len )
+{
+    const char* p = buf;
+    while( len > 0 )
+    {
+        ssize_t n = send( fd, p, len, MSG_NOSIGNAL );
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n <= 0 )
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Prints the answer to p, with its payload. */
+static void print_answer( const struct pending* p, const struct fs_response* res, const char* payload )
+{
+    printf( "%s %s - %s", op_names[p->op], p->path, status_names[res->status] );
+    if( res->status != FS_STATUS_OK )
+    {
+        printf( "\n" );
+        return;
+    }
+    if( p->op == FS_REQ_LOOKUP && res->length >= sizeof(struct fs_entry) )
+    {
+        struct fs_entry e;
+        memcpy( &e, payload, sizeof(e) );
+        printf( ", %s %d\n", e.is_directory ? "directory" : "file", e.id );
+    }
+    else if( p->op == FS_REQ_STAT && res->length >= sizeof(struct fs_stat) )
+    {
+        struct fs_stat st;
+        memcpy( &st, payload, sizeof(st) );
+        if( st.is_directory )
+            printf( ", directory %d, %d entries, %lld files and %lld directories of %lld bytes in %lld blocks below\n",
+                    st.id, st.num_children, (long long)st.tree_files, (long long)st.tree_dirs,
+                    (long long)st.tree_bytes, (long long)st.tree_blocks );
+        else
+            printf( ", file %d, %d bytes in %d blocks\n", st.id, st.filesize, st.num_blocks );
+    }
+    else if( p->op == FS_REQ_LIST )
+    {
+        printf( "\n" );
+        struct fs_entry e;
+        for( size_t pos = 0; pos + sizeof(e) <= res->length; pos += sizeof(e) + e.name_len )
+        {
+            memcpy( &e, payload + pos, sizeof(e) );
+            if( pos + sizeof(e) + e.name_len > res->length )
+                break;
+            printf( "    %.*s%s %d\n", (int)e.name_len, payload + pos + sizeof(e), e.is_directory ? "/" : "", e.id );
+        }
+    }
+    else
+    {
+        printf( "\n" );
+    }
+}
+
+static void usage( const char* prog )
+{
+    fprintf( stderr, "This programs sends requests to serve_fs and prints the answers.\n"
+                     "The requests are read from standard input, one per line:\n"
+                     "    create PATH SIZE\n"
+                     "    mkdir PATH\n"
+                     "    delete PATH\n"
+                     "    rmdir PATH\n"
+                     "    lookup PATH\n"
+                     "    stat PATH\n"
+                     "    list PATH\n"
+                     "    save                save the tree now\n"
+                     "    stop                save the tree and stop the server\n"
+                     "A line may end in \"= ok\" or \"= fail\" to say what the request\n"
+                     "must do. Everything after # is a comment. Up to DEPTH requests are\n"
+                     "sent before the answers are read.\n"
+                     "It exits with 0 if every request did what was expected and 1 if\n"
+                     "one did not.\n"
+                     "\n"
+                     "Usage: %s [-q] [-t] [-p DEPTH] SOCKET\n"
+                     "       where\n"
+                     "       -q        prints nothing but failed expectations\n"
+                     "       -t        prints the number of requests and latency\n"
+                     "                 percentiles at the end\n"
+                     "       -p DEPTH  is the number of requests in flight, 64 if not given\n"
+                     "       SOCKET    is the socket serve_fs listens on\n"
+                     , prog );
+    exit( -1 );
+}
+
+int main( int argc, char* argv[] )
+{
+    int quiet = 0;
+    int timing = 0;
+    int depth = 64;
+    int opt;
+    while( ( opt = getopt( argc, argv, "qtp:" ) ) != -1 )
+    {
+        switch( opt )
+        {
+        case 'q': quiet = 1; break;
+        case 't': timing = 1; break;
+        case 'p': depth = atoi( optarg ); break;
+        default: usage( argv[0] );
+        }
+    }
+    if( argc - optind != 1 || depth < 1 )
+    {
+        usage( argv[0] );
+    }
+
+    struct sockaddr_un addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    if( strlen( argv[optind] ) >= sizeof(addr.sun_path) )
+    {
+        fprintf( stderr, "Socket name %s is too long\n", argv[optind] );
+        exit( -1 );
+    }
+    strcpy( addr.sun_path, argv[optind] );
+    int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if( fd < 0 || connect( fd, (struct sockaddr*)&addr, sizeof(addr) ) != 0 )
+    {
+        fprintf( stderr, "Failed to connect to %s\n", argv[optind] );
+        perror( "reason:" );
+        exit( -1 );
+    }
+
+    struct pending* pending = calloc( depth, sizeof(struct pending) );
+    char* batch = malloc( (size_t)depth * ( sizeof(struct fs_request) + FS_PATH_MAX ) );
+    char* payload = NULL;
+    size_t payload_cap = 0;
+    if( pending == NULL || batch == NULL )
+    {
+        fprintf( stderr, "Failed to allocate memory for %d requests\n", depth );
+        exit( -1 );
+    }
+
+    struct fs_histogram h;
+    memset( &h, 0, sizeof(h) );
+    char* line = NULL;
+    size_t cap = 0;
+    long line_no = 0;
+    long num_requests = 0;
+    long mismatches = 0;
+    int done = 0;
+    uint64_t first = fs_now_ns( );
+    while( !done )
+    {
+        // send up to depth requests at once, then read their answers
+        size_t len = 0;
+        int n = 0;
+        while( n < depth )
+        {
+            if( getline( &line, &cap, stdin ) < 0 )
+            {
+                done = 1;
+                break;
+            }
+            line_no++;
+            struct fs_request req;
+            struct pending* p = &pending[n];
+            int r = parse_line( line, &req, p );
+            if( r < 0 )
+            {
+                fprintf( stderr, "line %ld: not a request\n", line_no );
+                mismatches++;
+                continue;
+            }
+            if( r == 0 )
+                continue;
+            req.tag = n;
+            p->line = line_no;
+            p->path = strdup( p->path );
+            memcpy( batch + len, &req, sizeof(req) );
+            memcpy( batch + len + sizeof(req), p->path, req.path_len );
+            len += sizeof(req) + req.path_len;
+            n++;
+            if( req.op == FS_REQ_STOP )
+            {
+                done = 1;
+                break;
+            }
+        }
+        uint64_t sent = fs_now_ns( );
+        if( n > 0 && write_all( fd, batch, len ) != 0 )
+        {
+            fprintf( stderr, "Failed to send requests to %s\n", argv[optind] );
+            exit( -1 );
+        }
+
+        for( int i = 0; i < n; i++ )
+        {
+            struct fs_response res;
+            if( read_all( fd, &res, sizeof(res) ) != 0 )
+            {
+                fprintf( stderr, "The server closed the connection\n" );
+                exit( -1 );
+            }
+            if( res.length > payload_cap )
+            {
+                payload_cap = res.length;
+                payload = realloc( payload, payload_cap );
+            }
+            if( ( res.length > 0 && ( payload == NULL || read_all( fd, payload, res.length ) != 0 ) )
+                || res.tag != (uint32_t)i || res.status < 0 || res.status >= FS_NUM_STATUS )
+            {
+                fprintf( stderr, "The server sent a broken answer\n" );
+                exit( -1 );
+            }
+            uint64_t ns = fs_now_ns( ) - sent;
+            h.buckets[fs_hist_bucket( ns )]++;
+            h.count++;
+            num_requests++;
+
+            struct pending* p = &pending[i];
+            int ok = res.status == FS_STATUS_OK;
+            if( p->expect != EXPECT_NOTHING && ( p->expect == EXPECT_OK ) != ok )
+            {
+                mismatches++;
+                printf( "line %ld: %s %s - %s, expected it to %s\n", p->line, op_names[p->op], p->path,
+                        status_names[res.status], ok ? "fail" : "succeed" );
+            }
+            else if( !quiet )
+            {
+                print_answer( p, &res, payload );
+            }
+            free( p->path );
+        }
+    }
+    double seconds = ( fs_now_ns( ) - first ) / 1e9;
+
+    if( timing )
+    {
+        printf( "%ld requests in %.3f s, %.0f per second\n", num_requests, seconds,
+                seconds > 0 ? num_requests / seconds : 0.0 );
+        printf( "latency p50_us %.3f p99_us %.3f max_us %.3f\n", fs_histogram_quantile( &h, 0.5 ) / 1e3,
+                fs_histogram_quantile( &h, 0.99 ) / 1e3, fs_histogram_quantile( &h, 1.0 ) / 1e3 );
+    }
+
+    close( fd );
+    free( line );
+    free( payload );
+    free( batch );
+    free( pending );
+    return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,644 @@
+#include "async.h"
+#include "data.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define MAX_THREADS 16
+
+struct fs_io
+{
+    enum fs_io_kind kind;
+    unsigned depth;
+    int in_flight;
+
+    // requests not handed to the backend yet: those beyond the depth of
+    // the ring, and the rest of short transfers
+    struct fs_io_request *waiting;
+    struct fs_io_request **waiting_tail;
+
+    // io_uring
+    int ring_fd;
+    unsigned started; // in the ring
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit; // in the ring and not told to the kernel yet
+
+    // threads
+    pthread_t threads[MAX_THREADS];
+    int num_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t finished;
+    struct fs_io_request *todo;
+    struct fs_io_request **todo_tail;
+    struct fs_io_request *done;
+    struct fs_io_request **done_tail;
+    int stopping;
+};
+
+static void append(struct fs_io_request ***tail, struct fs_io_request *request)
+{
+    request->next = NULL;
+    **tail = request;
+    *tail = &request->next;
+}
+
+/* Counts a finished request and runs its callback. */
+static void complete(struct fs_io *io, struct fs_io_request *request)
+{
+    io->in_flight--;
+    if (request->result >= 0)
+    {
+        fs_count(request->write ? FS_DATA_WRITES : FS_DATA_READS, 1);
+        fs_count(request->write ? FS_DATA_BYTES_WRITTEN : FS_DATA_BYTES_READ, request->result);
+    }
+    if (request->done != NULL)
+    {
+        request->done(request, request->result);
+    }
+}
+
+/* Adds n bytes, or an error, to what request has moved. Returns 1 if
+ * the request is finished and 0 if the rest of it is still to do.
+ */
+static int moved(struct fs_io_request *request, ssize_t n)
+{
+    if (n == -EINTR || n == -EAGAIN)
+    {
+        return 0;
+    }
+    if (n < 0)
+    {
+        request->result = n;
+        return 1;
+    }
+    if (n == 0 && !request->write)
+    {
+        // past the end of a data file that a smaller disk made
+        memset((char *)request->buf + request->moved, 0, request->len - request->moved);
+        n = request->len - request->moved;
+    }
+    request->moved += n;
+    if (n > 0 && request->moved < request->len)
+    {
+        return 0;
+    }
+    request->result = request->moved;
+    return 1;
+}
+
+/* Returns 1 if the kernel of ring_fd has IORING_OP_READ and
+ * IORING_OP_WRITE, which came after io_uring itself.
+ */
+static int ring_has_read_write(int ring_fd)
+{
+    int num_ops = (IORING_OP_READ > IORING_OP_WRITE ? IORING_OP_READ : IORING_OP_WRITE) + 1;
+    struct io_uring_probe *probe = calloc(1, sizeof(*probe) + num_ops * sizeof(struct io_uring_probe_op));
+    if (probe == NULL)
+    {
+        return 0;
+    }
+    int ok = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, num_ops) == 0
+             && probe->last_op >= num_ops - 1
+             && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+             && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+static int ring_setup(struct fs_io *io)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    io->ring_fd = syscall(__NR_io_uring_setup, io->depth, &p);
+    if (io->ring_fd < 0)
+    {
+        return -1;
+    }
+    /* Completions could be lost before NODROP (5.5), and IORING_OP_READ
+     * and WRITE came with RW_CUR_POS and the probe (5.6); a kernel that
+     * has those features but was built or filtered without the opcodes
+     * is caught by the probe.
+     */
+    if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_RW_CUR_POS)
+        || !ring_has_read_write(io->ring_fd))
+    {
+        close(io->ring_fd);
+        return -1;
+    }
+    io->depth = p.sq_entries;
+    io->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (io->cq_ring_size > io->sq_ring_size)
+        {
+            io->sq_ring_size = io->cq_ring_size;
+        }
+        io->cq_ring_size = 0;
+    }
+    io->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       io->ring_fd, IORING_OFF_SQ_RING);
+    io->cq_ring = io->sq_ring;
+    if (io->sq_ring != MAP_FAILED && io->cq_ring_size > 0)
+    {
+        io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           io->ring_fd, IORING_OFF_CQ_RING);
+    }
+    io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    io->ring_fd, IORING_OFF_SQES);
+    if (io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED)
+    {
+        if (io->sqes != MAP_FAILED)
+        {
+            munmap(io->sqes, io->sqes_size);
+        }
+        if (io->cq_ring != MAP_FAILED && io->cq_ring != io->sq_ring)
+        {
+            munmap(io->cq_ring, io->cq_ring_size);
+        }
+        if (io->sq_ring != MAP_FAILED)
+        {
+            munmap(io->sq_ring, io->sq_ring_size);
+        }
+        close(io->ring_fd);
+        return -1;
+    }
+
+    char *sq = io->sq_ring;
+    char *cq = io->cq_ring;
+    io->sq_head = (unsigned *)(sq + p.sq_off.head);
+    io->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    io->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    io->sq_array = (unsigned *)(sq + p.sq_off.array);
+    io->cq_head = (unsigned *)(cq + p.cq_off.head);
+    io->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    io->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+/* Moves waiting requests into free slots of the ring and tells the
+ * kernel about them with one system call.
+ */
+static void ring_start(struct fs_io *io)
+{
+    unsigned tail = *io->sq_tail;
+    while (io->waiting != NULL && io->started < io->depth)
+    {
+        struct fs_io_request *request = io->waiting;
+        io->waiting = request->next;
+        if (io->waiting == NULL)
+        {
+            io->waiting_tail = &io->waiting;
+        }
+
+        unsigned index = tail & io->sq_mask;
+        struct io_uring_sqe *sqe = &io->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = request->fd;
+        sqe->off = request->offset + request->moved;
+        sqe->addr = (uintptr_t)((char *)request->buf + request->moved);
+        sqe->len = request->len - request->moved;
+        sqe->user_data = (uintptr_t)request;
+        io->sq_array[index] = index;
+        tail++;
+        io->started++;
+        io->to_submit++;
+    }
+    __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+
+    while (io->to_submit > 0)
+    {
+        int n = syscall(__NR_io_uring_enter, io->ring_fd, io->to_submit, 0, 0, NULL, 0);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+        {
+            // the kernel takes the rest once completions are reaped
+            break;
+        }
+        if (n < 0)
+        {
+            perror("io_uring_enter");
+            break;
+        }
+        io->to_submit -= n;
+    }
+}
+
+/* Runs the callbacks of the requests in the completion ring, putting
+ * short ones back into waiting. Returns how many callbacks ran.
+ */
+static int ring_reap(struct fs_io *io)
+{
+    int ran = 0;
+    unsigned head = *io->cq_head;
+    while (head != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &io->cqes[head & io->cq_mask];
+        struct fs_io_request *request = (struct fs_io_request *)(uintptr_t)cqe->user_data;
+        ssize_t n = cqe->res;
+        head++;
+        // give the slot back before the callback, which may submit more
+        __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+        io->started--;
+        if (moved(request, n))
+        {
+            complete(io, request);
+            ran++;
+        }
+        else
+        {
+            append(&io->waiting_tail, request);
+        }
+    }
+    return ran;
+}
+
+static int ring_wait(struct fs_io *io, int min)
+{
+    int ran = 0;
+    for (;;)
+    {
+        ring_start(io);
+        ran += ring_reap(io);
+        if (ran >= min || io->in_flight == 0)
+        {
+            return ran;
+        }
+        if (io->waiting != NULL && io->started < io->depth)
+        {
+            continue;
+        }
+        int n = syscall(__NR_io_uring_enter, io->ring_fd, io->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n > 0)
+        {
+            io->to_submit -= n;
+        }
+        else if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            perror("io_uring_enter");
+            return ran;
+        }
+    }
+}
+
+static void *worker(void *arg)
+{
+    struct fs_io *io = arg;
+    pthread_mutex_lock(&io->lock);
+    for (;;)
+    {
+        while (io->todo == NULL && !io->stopping)
+        {
+            pthread_cond_wait(&io->work, &io->lock);
+        }
+        if (io->todo == NULL)
+        {
+            break;
+        }
+        struct fs_io_request *request = io->todo;
+        io->todo = request->next;
+        if (io->todo == NULL)
+        {
+            io->todo_tail = &io->todo;
+        }
+        pthread_mutex_unlock(&io->lock);
+
+        ssize_t n;
+        do
+        {
+            char *buf = (char *)request->buf + request->moved;
+            size_t len = request->len - request->moved;
+            off_t at = request->offset + request->moved;
+            n = request->write ? pwrite(request->fd, buf, len, at) : pread(request->fd, buf, len, at);
+        } while (!moved(request, n < 0 ? -errno : n));
+
+        pthread_mutex_lock(&io->lock);
+        append(&io->done_tail, request);
+        pthread_cond_signal(&io->finished);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+static int threads_setup(struct fs_io *io)
+{
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->work, NULL);
+    pthread_cond_init(&io->finished, NULL);
+    io->todo_tail = &io->todo;
+    io->done_tail = &io->done;
+    int wanted = io->depth < MAX_THREADS ? (int)io->depth : MAX_THREADS;
+    while (io->num_threads < wanted)
+    {
+        if (pthread_create(&io->threads[io->num_threads], NULL, worker, io) != 0)
+        {
+            break;
+        }
+        io->num_threads++;
+    }
+    if (io->num_threads == 0)
+    {
+        pthread_mutex_destroy(&io->lock);
+        pthread_cond_destroy(&io->work);
+        pthread_cond_destroy(&io->finished);
+        return -1;
+    }
+    return 0;
+}
+
+static int threads_wait(struct fs_io *io, int min)
+{
+    int ran = 0;
+    while (ran < min && io->in_flight > 0)
+    {
+        pthread_mutex_lock(&io->lock);
+        while (io->done == NULL)
+        {
+            pthread_cond_wait(&io->finished, &io->lock);
+        }
+        struct fs_io_request *done = io->done;
+        io->done = NULL;
+        io->done_tail = &io->done;
+        pthread_mutex_unlock(&io->lock);
+
+        while (done != NULL)
+        {
+            struct fs_io_request *next = done->next;
+            complete(io, done);
+            ran++;
+            done = next;
+        }
+    }
+    return ran;
+}
+
+struct fs_io *fs_io_new(enum fs_io_kind kind, unsigned depth)
+{
+    const char *forced = getenv("FS_IO");
+    if (kind == FS_IO_ANY && forced != NULL && strcmp(forced, "threads") == 0)
+    {
+        kind = FS_IO_THREADS;
+    }
+    struct fs_io *io = calloc(1, sizeof(struct fs_io));
+    if (io == NULL || depth == 0)
+    {
+        free(io);
+        return NULL;
+    }
+    io->depth = depth;
+    io->waiting_tail = &io->waiting;
+
+    if (kind != FS_IO_THREADS && ring_setup(io) == 0)
+    {
+        io->kind = FS_IO_URING;
+        return io;
+    }
+    io->depth = depth;
+    if (kind != FS_IO_URING && threads_setup(io) == 0)
+    {
+        io->kind = FS_IO_THREADS;
+        return io;
+    }
+    free(io);
+    return NULL;
+}
+
+void fs_io_free(struct fs_io *io)
+{
+    if (io == NULL)
+    {
+        return;
+    }
+    fs_io_wait(io, INT_MAX);
+    if (io->kind == FS_IO_URING)
+    {
+        munmap(io->sqes, io->sqes_size);
+        if (io->cq_ring != io->sq_ring)
+        {
+            munmap(io->cq_ring, io->cq_ring_size);
+        }
+        munmap(io->sq_ring, io->sq_ring_size);
+        close(io->ring_fd);
+    }
+    else
+    {
+        pthread_mutex_lock(&io->lock);
+        io->stopping = 1;
+        pthread_cond_broadcast(&io->work);
+        pthread_mutex_unlock(&io->lock);
+        for (int t = 0; t < io->num_threads; t++)
+        {
+            pthread_join(io->threads[t], NULL);
+        }
+        pthread_mutex_destroy(&io->lock);
+        pthread_cond_destroy(&io->work);
+        pthread_cond_destroy(&io->finished);
+    }
+    free(io);
+}
+
+enum fs_io_kind fs_io_kind(struct fs_io *io)
+{
+    return io->kind;
+}
+
+int fs_io_submit(struct fs_io *io, struct fs_io_request **requests, int n)
+{
+    int fd = fs_data_fd();
+    if (fd < 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        requests[i]->fd = fd;
+        requests[i]->moved = 0;
+        requests[i]->result = 0;
+    }
+    io->in_flight += n;
+
+    if (io->kind == FS_IO_URING)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            append(&io->waiting_tail, requests[i]);
+        }
+        ring_start(io);
+        return 0;
+    }
+
+    pthread_mutex_lock(&io->lock);
+    for (int i = 0; i < n; i++)
+    {
+        append(&io->todo_tail, requests[i]);
+    }
+    if (n == 1)
+    {
+        pthread_cond_signal(&io->work);
+    }
+    else if (n > 1)
+    {
+        pthread_cond_broadcast(&io->work);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return 0;
+}
+
+int fs_io_wait(struct fs_io *io, int min)
+{
+    return io->kind == FS_IO_URING ? ring_wait(io, min) : threads_wait(io, min);
+}
+
+int fs_io_in_flight(struct fs_io *io)
+{
+    return io->in_flight;
+}
+
+/* What the requests of one fs_io_read_file() or fs_io_write_file() add
+ * up to.
+ */
+struct file_transfer
+{
+    size_t bytes;
+    int failed;
+};
+
+static void file_request_done(struct fs_io_request *request, ssize_t result)
+{
+    struct file_transfer *t = request->arg;
+    if (result < 0)
+    {
+        t->failed = 1;
+    }
+    else
+    {
+        t->bytes += result;
+    }
+}
+
+/* Splits len bytes of file from offset into a request per run of
+ * consecutive blocks, submits them all and waits for them.
+ */
+static ssize_t transfer_file(struct fs_io *io, struct inode *file, size_t offset, char *buf, size_t len, int write)
+{
+    if (fs_data_fd() < 0 || file == NULL || file->is_directory)
+    {
+        return -1;
+    }
+    if (offset >= (size_t)file->filesize)
+    {
+        return 0;
+    }
+    if (len > file->filesize - offset)
+    {
+        len = file->filesize - offset;
+    }
+    if (write && fs_data_own_blocks(file) != 0)
+    {
+        return -1;
+    }
+
+    struct file_transfer t = {0, 0};
+    struct fs_io_request *requests = NULL;
+    struct fs_io_request **pointers = NULL;
+    int n = 0;
+    int cap = 0;
+    size_t done = 0;
+    while (done < len)
+    {
+        off_t at;
+        size_t run = fs_data_run(file, offset + done, len - done, &at);
+        if (run == 0)
+        {
+            t.failed = 1;
+            break;
+        }
+        if (n == cap)
+        {
+            cap = cap == 0 ? 16 : cap * 2;
+            struct fs_io_request *more = realloc(requests, cap * sizeof(struct fs_io_request));
+            if (more == NULL)
+            {
+                t.failed = 1;
+                break;
+            }
+            requests = more;
+        }
+        struct fs_io_request *request = &requests[n++];
+        memset(request, 0, sizeof(*request));
+        request->write = write;
+        request->offset = at;
+        request->buf = buf + done;
+        request->len = run;
+        request->done = file_request_done;
+        request->arg = &t;
+        done += run;
+    }
+
+    if (!t.failed)
+    {
+        pointers = malloc(n * sizeof(struct fs_io_request *));
+        t.failed = pointers == NULL;
+    }
+    if (!t.failed)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            pointers[i] = &requests[i];
+        }
+        t.failed = fs_io_submit(io, pointers, n) != 0;
+        while (fs_io_in_flight(io) > 0)
+        {
+            fs_io_wait(io, fs_io_in_flight(io));
+        }
+    }
+    free(pointers);
+    free(requests);
+    if (t.failed)
+    {
+        return -1;
+    }
+    return t.bytes;
+}
+
+ssize_t fs_io_read_file(struct fs_io *io, struct inode *file, size_t offset, void *buf, size_t len)
+{
+    uint64_t start = fs_now_ns();
+    ssize_t n = transfer_file(io, file, offset, buf, len, 0);
+    fs_op_done(FS_OP_READ, start, file != NULL ? file->id : -1);
+    return n;
+}
+
+ssize_t fs_io_write_file(struct fs_io *io, struct inode *file, size_t offset, const void *buf, size_t len)
+{
+    uint64_t start = fs_now_ns();
+    ssize_t n = transfer_file(io, file, offset, (char *)buf, len, 1);
+    fs_op_done(FS_OP_WRITE, start, file != NULL ? file->id : -1);
+    return n;
+}
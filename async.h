@@ -0,0 +1,91 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include "inode.h"
+
+#include <sys/types.h>
+
+/* Asynchronous reads and writes of the data file of data.h. Requests are
+ * queued on an engine in batches and run while the caller goes on; the
+ * engine uses io_uring where the kernel offers it and a pool of threads
+ * that call pread() and pwrite() where it does not, so a file whose
+ * blocks are scattered over the disk is read with all of its runs in
+ * flight at once instead of one after the other.
+ *
+ * An engine belongs to one thread: requests are submitted and reaped by
+ * the thread that made it, and the callbacks run in that thread, from
+ * fs_io_wait(), one at a time.
+ */
+struct fs_io;
+
+struct fs_io_request;
+
+/* Called when request is done. result is the number of bytes moved,
+ * len unless a write ran out of disk, or -errno. Reads past the end of
+ * the data file give zeros, as with fs_read().
+ */
+typedef void (*fs_io_callback)(struct fs_io_request *request, ssize_t result);
+
+struct fs_io_request
+{
+	int write;          // 1 to write buf, 0 to read into it
+	off_t offset;       // in the data file
+	void *buf;
+	size_t len;
+	fs_io_callback done; // may be NULL
+	void *arg;          // for the callback
+
+	// private to the engine
+	int fd;
+	size_t moved;
+	ssize_t result;
+	struct fs_io_request *next;
+};
+
+/* The backends. FS_IO_ANY takes io_uring if it can be set up and the
+ * threads if not; the environment variable FS_IO=threads does the same
+ * as FS_IO_THREADS.
+ */
+enum fs_io_kind
+{
+	FS_IO_ANY,
+	FS_IO_URING,
+	FS_IO_THREADS
+};
+
+/* Makes an engine of the given kind with room for depth requests in
+ * flight; more are queued until some are done. Returns NULL if the kind
+ * cannot be had or memory runs out.
+ */
+struct fs_io *fs_io_new(enum fs_io_kind kind, unsigned depth);
+
+/* Waits for every request in flight and frees the engine. */
+void fs_io_free(struct fs_io *io);
+
+/* FS_IO_URING or FS_IO_THREADS. */
+enum fs_io_kind fs_io_kind(struct fs_io *io);
+
+/* Queues n requests, which must stay untouched until their callback has
+ * run, and starts them with as few system calls as the backend allows.
+ * Returns 0, or -1 if no data file is open.
+ */
+int fs_io_submit(struct fs_io *io, struct fs_io_request **requests, int n);
+
+/* Runs the callbacks of finished requests, waiting until at least min
+ * of them have finished or nothing is left in flight. Returns how many
+ * callbacks ran.
+ */
+int fs_io_wait(struct fs_io *io, int min);
+
+/* The number of requests submitted and not finished yet. */
+int fs_io_in_flight(struct fs_io *io);
+
+/* Like fs_read() and fs_write() of data.h, but with a request per run of
+ * consecutive blocks, all submitted together. Waits for every request
+ * in flight on io, not only for its own.
+ */
+ssize_t fs_io_read_file(struct fs_io *io, struct inode *file, size_t offset, void *buf, size_t len);
+
+ssize_t fs_io_write_file(struct fs_io *io, struct inode *file, size_t offset, const void *buf, size_t len);
+
+#endif
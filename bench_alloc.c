@@ -0,0 +1,466 @@
+#include "allocation.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* A file of the workload is only its list of blocks. The benchmark
+ * calls the allocator directly, so that nothing else is timed.
+ */
+struct age_file
+{
+    int num_blocks;
+    int* blocks;
+};
+
+struct age_config
+{
+    int disk_blocks;
+    double create;     // the chance that an operation creates a file
+    double zipf;       // exponent of the file sizes, 0 for lognormal sizes
+    double median;     // median of the lognormal sizes, in blocks
+    double sigma;      // of the logarithm of the lognormal sizes
+    int max_blocks;    // the largest file size, in blocks
+    long interval;     // operations between two samples
+    uint64_t seed;
+    const char* prefix;
+};
+
+/* The latencies of allocate_block_near() or free_block(), one per call. */
+struct call_stats
+{
+    double* latencies; // in seconds
+    long count;
+    long cap;
+};
+
+/* The state of the disk after some operations. */
+struct age_sample
+{
+    long ops;
+    long files;
+    long used;
+    double extents_per_file;
+    long free_extents;
+    long largest_free;
+};
+
+static double now( )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void record( struct call_stats* s, double seconds )
+{
+    if( s->count == s->cap )
+    {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->latencies = realloc( s->latencies, s->cap * sizeof(double) );
+        if( s->latencies == NULL )
+        {
+            fprintf( stderr, "Failed to allocate memory for the latencies\n" );
+            exit( -1 );
+        }
+    }
+    s->latencies[s->count++] = seconds;
+}
+
+/* xorshift64*, so that a seed gives the same workload on every machine
+ * and for every allocator.
+ */
+static uint64_t next_random( uint64_t* state )
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static double random_unit( uint64_t* state )
+{
+    return ( next_random( state ) >> 11 ) * ( 1.0 / 9007199254740992.0 );
+}
+
+/* Zipf sizes: size k of 1 to max_blocks has weight 1/k^s. */
+static double* zipf_table( double s, int max_blocks )
+{
+    double* cdf = malloc( max_blocks * sizeof(double) );
+    if( cdf == NULL )
+    {
+        return NULL;
+    }
+    double sum = 0;
+    for( int k = 1; k <= max_blocks; k++ )
+    {
+        sum += 1.0 / pow( k, s );
+        cdf[k - 1] = sum;
+    }
+    for( int k = 0; k < max_blocks; k++ )
+    {
+        cdf[k] /= sum;
+    }
+    return cdf;
+}
+
+/* Without -z, sizes are lognormal, which is how file sizes are usually
+ * found to be spread: most files are small, but most blocks belong to
+ * a few large ones. Two uniform numbers are always drawn, so the
+ * workload does not depend on the distribution of the sizes.
+ */
+static int file_blocks( const struct age_config* config, const double* cdf, uint64_t* rng )
+{
+    double u1 = random_unit( rng );
+    double u2 = random_unit( rng );
+    int size;
+    if( cdf != NULL )
+    {
+        int lo = 0, hi = config->max_blocks - 1;
+        while( lo < hi )
+        {
+            int mid = ( lo + hi ) / 2;
+            if( cdf[mid] < u1 )
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        size = lo + 1;
+    }
+    else
+    {
+        // Box-Muller
+        double normal = sqrt( -2.0 * log( 1.0 - u1 ) ) * cos( 2.0 * M_PI * u2 );
+        size = (int)ceil( config->median * exp( config->sigma * normal ) );
+    }
+    return size < 1 ? 1 : size > config->max_blocks ? config->max_blocks : size;
+}
+
+static long count_extents( const struct age_file* file )
+{
+    long extents = file->num_blocks > 0;
+    for( int i = 1; i < file->num_blocks; i++ )
+    {
+        extents += file->blocks[i] != file->blocks[i - 1] + 1;
+    }
+    return extents;
+}
+
+/* used mirrors the block allocation table, so that sampling does not
+ * have to read it.
+ */
+static void take_sample( struct age_sample* sample, long ops, const struct age_file* files, long num_files,
+                         const char* used, int num_blocks )
+{
+    sample->ops = ops;
+    sample->files = num_files;
+    long extents = 0;
+    for( long f = 0; f < num_files; f++ )
+    {
+        extents += count_extents( &files[f] );
+    }
+    sample->extents_per_file = num_files > 0 ? (double)extents / num_files : 0;
+
+    sample->used = 0;
+    sample->free_extents = 0;
+    sample->largest_free = 0;
+    long run = 0;
+    for( int i = 0; i < num_blocks; i++ )
+    {
+        if( used[i] )
+        {
+            sample->used++;
+            run = 0;
+            continue;
+        }
+        if( run++ == 0 )
+        {
+            sample->free_extents++;
+        }
+        if( run > sample->largest_free )
+        {
+            sample->largest_free = run;
+        }
+    }
+}
+
+static void drop_file( struct age_file* file, char* used, struct call_stats* frees )
+{
+    for( int i = 0; i < file->num_blocks; i++ )
+    {
+        double start = now( );
+        int retval = free_block( file->blocks[i] );
+        record( frees, now( ) - start );
+        if( retval != 0 )
+        {
+            fprintf( stderr, "Failed to free block %d\n", file->blocks[i] );
+            exit( -1 );
+        }
+        used[file->blocks[i]] = 0;
+    }
+    free( file->blocks );
+}
+
+static int compare_doubles( const void* a, const void* b )
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_calls( const char* name, struct call_stats* s, const char* end )
+{
+    double total = 0;
+    for( long i = 0; i < s->count; i++ )
+    {
+        total += s->latencies[i];
+    }
+    qsort( s->latencies, s->count, sizeof(double), compare_doubles );
+    printf( "  \"%s\": { \"count\": %ld", name, s->count );
+    if( s->count > 0 )
+    {
+        printf( ", \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f",
+                total, total > 0 ? s->count / total : 0.0,
+                s->latencies[(long)ceil( 0.50 * s->count ) - 1] * 1e6,
+                s->latencies[(long)ceil( 0.99 * s->count ) - 1] * 1e6,
+                s->latencies[s->count - 1] * 1e6 );
+    }
+    printf( " }%s\n", end );
+    free( s->latencies );
+}
+
+static void print_sample( const struct age_sample* s, int num_blocks, const char* end )
+{
+    long free_blocks = num_blocks - s->used;
+    printf( "    { \"ops\": %ld, \"files\": %ld, \"utilization\": %.4f, \"extents_per_file\": %.3f, "
+            "\"free_extents\": %ld, \"largest_free_extent\": %ld, \"free_fragmentation\": %.4f }%s\n",
+            s->ops, s->files, (double)s->used / num_blocks, s->extents_per_file,
+            s->free_extents, s->largest_free,
+            free_blocks > 0 ? 1.0 - (double)s->largest_free / free_blocks : 0.0, end );
+}
+
+/* Ages an empty disk with allocator: every operation creates a file
+ * with the chance config->create and deletes a random file otherwise,
+ * until a create finds the disk full. Prints the result as JSON.
+ */
+static void age_disk( const struct age_config* config, const struct block_allocator* allocator, const double* cdf )
+{
+    set_block_allocator( allocator );
+    if( format_disk( ) != 0 )
+    {
+        exit( -1 );
+    }
+
+    int num_blocks = config->disk_blocks;
+    char* used = calloc( num_blocks, 1 );
+    struct age_file* files = malloc( num_blocks * sizeof(struct age_file) );
+    long max_samples = 16;
+    struct age_sample* samples = malloc( max_samples * sizeof(struct age_sample) );
+    if( used == NULL || files == NULL || samples == NULL )
+    {
+        fprintf( stderr, "Failed to allocate memory for a disk of %d blocks\n", num_blocks );
+        exit( -1 );
+    }
+    struct call_stats allocs = { NULL, 0, 0 };
+    struct call_stats frees = { NULL, 0, 0 };
+    long num_files = 0;
+    long num_samples = 0;
+    long ops = 0;
+    uint64_t rng = config->seed;
+    double start = now( );
+
+    for( ;; ops++ )
+    {
+        if( ops % config->interval == 0 )
+        {
+            if( num_samples == max_samples )
+            {
+                max_samples *= 2;
+                samples = realloc( samples, max_samples * sizeof(struct age_sample) );
+                if( samples == NULL )
+                {
+                    fprintf( stderr, "Failed to allocate memory for the samples\n" );
+                    exit( -1 );
+                }
+            }
+            take_sample( &samples[num_samples++], ops, files, num_files, used, num_blocks );
+        }
+
+        // both numbers are always drawn, so every allocator sees the same operations
+        int size = file_blocks( config, cdf, &rng );
+        uint64_t victim = next_random( &rng );
+        if( num_files > 0 && random_unit( &rng ) >= config->create )
+        {
+            long f = victim % num_files;
+            drop_file( &files[f], used, &frees );
+            files[f] = files[--num_files];
+            continue;
+        }
+
+        struct age_file* file = &files[num_files];
+        file->blocks = malloc( size * sizeof(int) );
+        if( file->blocks == NULL )
+        {
+            fprintf( stderr, "Failed to allocate memory for a file of %d blocks\n", size );
+            exit( -1 );
+        }
+        for( file->num_blocks = 0; file->num_blocks < size; file->num_blocks++ )
+        {
+            int goal = file->num_blocks > 0 ? file->blocks[file->num_blocks - 1] + 1 : -1;
+            double call = now( );
+            int block = allocate_block_near( goal );
+            record( &allocs, now( ) - call );
+            if( block < 0 )
+            {
+                break;
+            }
+            if( used[block] )
+            {
+                fprintf( stderr, "%s handed out block %d twice\n", allocator->name, block );
+                exit( -1 );
+            }
+            used[block] = 1;
+            file->blocks[file->num_blocks] = block;
+        }
+        if( file->num_blocks < size )
+        {
+            // the disk is full; the file does not get created
+            drop_file( file, used, &frees );
+            break;
+        }
+        num_files++;
+    }
+    double seconds = now( ) - start;
+    if( samples[num_samples - 1].ops != ops )
+    {
+        take_sample( &samples[num_samples++], ops, files, num_files, used, num_blocks );
+    }
+
+    // the table on disk must agree with what the allocator handed out
+    char* table = read_block_allocation_table( );
+    if( table == NULL || memcmp( table, used, num_blocks ) != 0 )
+    {
+        fprintf( stderr, "The block allocation table does not match the blocks of the files\n" );
+        exit( -1 );
+    }
+    free( table );
+
+    printf( "{\n" );
+    printf( "  \"allocator\": \"%s\", \"disk_blocks\": %d, \"create\": %g, \"seed\": %llu,\n",
+            allocator->name, num_blocks, config->create, (unsigned long long)config->seed );
+    if( cdf != NULL )
+        printf( "  \"sizes\": \"zipf\", \"zipf\": %g, \"max_blocks\": %d,\n", config->zipf, config->max_blocks );
+    else
+        printf( "  \"sizes\": \"lognormal\", \"median\": %g, \"sigma\": %g, \"max_blocks\": %d,\n",
+                config->median, config->sigma, config->max_blocks );
+    printf( "  \"time_to_full\": { \"ops\": %ld, \"seconds\": %.6f },\n", ops, seconds );
+    print_calls( "allocate_block", &allocs, "," );
+    print_calls( "free_block", &frees, "," );
+    printf( "  \"samples\": [\n" );
+    for( long i = 0; i < num_samples; i++ )
+    {
+        print_sample( &samples[i], num_blocks, i < num_samples - 1 ? "," : "" );
+    }
+    printf( "  ]\n" );
+    printf( "}\n" );
+
+    for( long f = 0; f < num_files; f++ )
+    {
+        free( files[f].blocks );
+    }
+    free( files );
+    free( samples );
+    free( used );
+}
+
+static void usage( const char* prog )
+{
+    fprintf( stderr, "This programs ages a simulated disk by creating and deleting files at\n"
+                     "random, starting empty, until a file does not fit any more. It times\n"
+                     "every allocate_block and free_block call and samples how many extents\n"
+                     "the files have and how fragmented the free space is. Every allocator\n"
+                     "gets the same operations for the same seed, so they can be compared.\n"
+                     "It prints one JSON object per allocator.\n"
+                     "\n"
+                     "Usage: %s [options]\n"
+                     "       -a NAME    allocator, all of them if not given:", prog );
+    for( int i = 0; block_allocators[i].name != NULL; i++ )
+    {
+        fprintf( stderr, " %s", block_allocators[i].name );
+    }
+    fprintf( stderr, "\n"
+                     "       -b N       blocks on the disk (16384)\n"
+                     "       -c P       chance that an operation creates a file (0.55)\n"
+                     "       -z S       Zipf exponent of the file sizes; lognormal sizes if not given\n"
+                     "       -g N       median of the lognormal sizes in blocks (2)\n"
+                     "       -v S       sigma of the lognormal sizes (1.5)\n"
+                     "       -m N       largest file size in blocks (1024)\n"
+                     "       -i N       operations between two samples (1000)\n"
+                     "       -x SEED    random seed (1)\n"
+                     "       -p PREFIX  the file PREFIX.bat is used (bench_alloc)\n" );
+    exit( -1 );
+}
+
+int main( int argc, char* argv[] )
+{
+    struct age_config config = { 16384, 0.55, 0, 2, 1.5, 1024, 1000, 1, "bench_alloc" };
+    const char* name = NULL;
+    int opt;
+    while( ( opt = getopt( argc, argv, "a:b:c:z:g:v:m:i:x:p:" ) ) != -1 )
+    {
+        switch( opt )
+        {
+        case 'a': name = optarg; break;
+        case 'b': config.disk_blocks = atoi( optarg ); break;
+        case 'c': config.create = atof( optarg ); break;
+        case 'z': config.zipf = atof( optarg ); break;
+        case 'g': config.median = atof( optarg ); break;
+        case 'v': config.sigma = atof( optarg ); break;
+        case 'm': config.max_blocks = atoi( optarg ); break;
+        case 'i': config.interval = atol( optarg ); break;
+        case 'x': config.seed = strtoull( optarg, NULL, 10 ); break;
+        case 'p': config.prefix = optarg; break;
+        default: usage( argv[0] );
+        }
+    }
+    // with creates no more likely than deletes the disk might never fill
+    if( optind != argc || config.disk_blocks < 1 || config.create <= 0.5 || config.create > 1
+        || config.zipf < 0 || config.median <= 0 || config.sigma < 0 || config.max_blocks < 1
+        || config.interval < 1 || config.seed == 0
+        || ( name != NULL && find_block_allocator( name ) == NULL ) )
+    {
+        usage( argv[0] );
+    }
+
+    double* cdf = NULL;
+    if( config.zipf > 0 && ( cdf = zipf_table( config.zipf, config.max_blocks ) ) == NULL )
+    {
+        fprintf( stderr, "Failed to allocate memory for the file sizes\n" );
+        exit( -1 );
+    }
+
+    char bat[256];
+    snprintf( bat, sizeof(bat), "%s.bat", config.prefix );
+    set_block_allocation_table_name( bat );
+    set_disk_num_blocks( config.disk_blocks );
+
+    if( name != NULL )
+    {
+        age_disk( &config, find_block_allocator( name ), cdf );
+    }
+    else
+    {
+        for( int i = 0; block_allocators[i].name != NULL; i++ )
+        {
+            age_disk( &config, &block_allocators[i], cdf );
+        }
+    }
+
+    free( cdf );
+    unlink( bat );
+    release_block_allocation_table_name( );
+    return 0;
+}
@@ -0,0 +1,558 @@
+#include "inode.h"
+#include "allocation.h"
+#include "stats.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/* The operations that are timed. Every call is timed on its own, so
+ * that the percentiles show the slow calls and not just the average.
+ */
+enum bench_op
+{
+    OP_CREATE_DIR,
+    OP_CREATE_FILE,
+    OP_FIND,
+    OP_DELETE_FILE,
+    OP_SAVE,
+    OP_LOAD,
+    OP_SHUTDOWN,
+    NUM_OPS
+};
+
+static const char* op_names[NUM_OPS] =
+{
+    "create_dir", "create_file", "find_inode_by_name", "delete_file",
+    "save_inodes", "load_inodes", "fs_shutdown"
+};
+
+struct op_stats
+{
+    double* latencies; // in seconds
+    long count;
+    long cap;
+    long failed;
+};
+
+struct bench_config
+{
+    const char* shape; // wide, deep or balanced
+    long inodes;
+    int fanout;
+    int depth;
+    double zipf;       // exponent of the file sizes, 0 for empty files
+    int max_blocks;    // the largest file size, in blocks
+    int disk_blocks;
+    int repeat;        // save, load and shutdown runs
+    uint64_t seed;
+    const char* prefix;
+    int threads;       // the most threads of the parallel creates, 0 for none
+};
+
+/* A file of the generated tree and the directory it is in. */
+struct bench_file
+{
+    struct inode* dir;
+    struct inode* node;
+    char name[24];
+};
+
+static struct op_stats stats[NUM_OPS];
+
+/* The parallel creates: with 1, 2, 4 ... threads, each creating files of
+ * one block in directories of its own, so that only the allocator and
+ * the counters of the root are shared. A directory gets at most
+ * PARALLEL_DIR_FILES files, so that a create costs the same with any
+ * number of threads.
+ */
+#define MAX_PARALLEL_RUNS 16
+#define PARALLEL_DIR_FILES 256
+
+struct parallel_run
+{
+    int threads;
+    long files;
+    long failed;
+    double seconds;
+};
+
+struct parallel_job
+{
+    struct inode* dir;
+    long count;
+    long failed;
+};
+
+static struct parallel_run parallel_runs[MAX_PARALLEL_RUNS];
+static int num_parallel_runs;
+
+/* The memory of the first tree that load_inodes returned. */
+static struct fs_memory loaded_memory;
+static long loaded_table_bytes;
+
+static double now( )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void record( enum bench_op op, double seconds, int ok )
+{
+    struct op_stats* s = &stats[op];
+    if( !ok )
+    {
+        s->failed++;
+        return;
+    }
+    if( s->count == s->cap )
+    {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->latencies = realloc( s->latencies, s->cap * sizeof(double) );
+        if( s->latencies == NULL )
+        {
+            fprintf( stderr, "Failed to allocate memory for the latencies\n" );
+            exit( -1 );
+        }
+    }
+    s->latencies[s->count++] = seconds;
+}
+
+/* xorshift64*, so that a seed gives the same tree on every machine. */
+static uint64_t next_random( uint64_t* state )
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static double random_unit( uint64_t* state )
+{
+    return ( next_random( state ) >> 11 ) * ( 1.0 / 9007199254740992.0 );
+}
+
+/* File sizes in blocks follow a Zipf distribution over 1 to max_blocks:
+ * size k has weight 1/k^s. cdf holds the cumulative weights, and a
+ * size is drawn by a binary search for a uniform number in it.
+ */
+static double* zipf_table( double s, int max_blocks )
+{
+    double* cdf = malloc( max_blocks * sizeof(double) );
+    if( cdf == NULL )
+    {
+        return NULL;
+    }
+    double sum = 0;
+    for( int k = 1; k <= max_blocks; k++ )
+    {
+        sum += 1.0 / pow( k, s );
+        cdf[k - 1] = sum;
+    }
+    for( int k = 0; k < max_blocks; k++ )
+    {
+        cdf[k] /= sum;
+    }
+    return cdf;
+}
+
+static int file_size( const struct bench_config* config, const double* cdf, uint64_t* rng )
+{
+    if( cdf == NULL )
+    {
+        return 0;
+    }
+    double u = random_unit( rng );
+    int lo = 0, hi = config->max_blocks - 1;
+    while( lo < hi )
+    {
+        int mid = ( lo + hi ) / 2;
+        if( cdf[mid] < u )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    // somewhere within the last block, so files are not all whole blocks
+    return lo * 4096 + 1 + (int)( next_random( rng ) % 4096 );
+}
+
+static struct inode* timed_create_dir( struct inode* parent, char* name )
+{
+    double start = now( );
+    struct inode* dir = create_dir( parent, name );
+    record( OP_CREATE_DIR, now( ) - start, dir != NULL );
+    return dir;
+}
+
+/* Builds the tree and fills files with the files created in it.
+ * wide:     all files in one directory
+ * deep:     a chain of depth directories, files spread over it
+ * balanced: directories with fanout subdirectories and fanout files
+ *           each, filled level by level
+ * Returns the number of files.
+ */
+static long build_tree( const struct bench_config* config, struct inode* root, struct bench_file* files )
+{
+    uint64_t rng = config->seed;
+    double* cdf = config->zipf > 0 ? zipf_table( config->zipf, config->max_blocks ) : NULL;
+    long num_files = 0;
+    long num_inodes = 1;
+    char name[16];
+
+    struct inode** dirs = malloc( ( config->inodes + 1 ) * sizeof(struct inode*) );
+    if( dirs == NULL )
+    {
+        fprintf( stderr, "Failed to allocate memory for the directories\n" );
+        exit( -1 );
+    }
+    long num_dirs = 0;
+    dirs[num_dirs++] = root;
+
+    if( strcmp( config->shape, "deep" ) == 0 )
+    {
+        for( int d = 0; d < config->depth && num_inodes < config->inodes; d++ )
+        {
+            snprintf( name, sizeof(name), "d%d", d );
+            struct inode* dir = timed_create_dir( dirs[num_dirs - 1], name );
+            if( dir == NULL )
+                break;
+            dirs[num_dirs++] = dir;
+            num_inodes++;
+        }
+    }
+    else if( strcmp( config->shape, "balanced" ) == 0 )
+    {
+        // every directory also gets about fanout files below
+        long max_dirs = config->inodes / ( 1 + config->fanout );
+        for( long next = 0; next < num_dirs && num_dirs < max_dirs; next++ )
+        {
+            for( int i = 0; i < config->fanout && num_dirs < max_dirs; i++ )
+            {
+                snprintf( name, sizeof(name), "d%d", i );
+                struct inode* dir = timed_create_dir( dirs[next], name );
+                if( dir == NULL )
+                    break;
+                dirs[num_dirs++] = dir;
+                num_inodes++;
+            }
+        }
+    }
+
+    // then the files, round robin over the directories
+    for( long i = 0; num_inodes < config->inodes; i++, num_inodes++ )
+    {
+        struct bench_file* file = &files[num_files];
+        file->dir = dirs[i % num_dirs];
+        snprintf( file->name, sizeof(file->name), "f%ld", i / num_dirs );
+        int size = file_size( config, cdf, &rng );
+
+        double start = now( );
+        file->node = create_file( file->dir, file->name, size );
+        record( OP_CREATE_FILE, now( ) - start, file->node != NULL );
+        if( file->node != NULL )
+        {
+            num_files++;
+        }
+    }
+
+    free( dirs );
+    free( cdf );
+    return num_files;
+}
+
+static void* create_files( void* arg )
+{
+    struct parallel_job* job = arg;
+    struct inode* dir = NULL;
+    char name[24];
+    for( long i = 0; i < job->count; i++ )
+    {
+        if( i % PARALLEL_DIR_FILES == 0 )
+        {
+            snprintf( name, sizeof(name), "d%ld", i / PARALLEL_DIR_FILES );
+            dir = create_dir( job->dir, name );
+        }
+        snprintf( name, sizeof(name), "f%ld", i % PARALLEL_DIR_FILES );
+        if( dir == NULL || create_file( dir, name, 4096 ) == NULL )
+            job->failed++;
+    }
+    return NULL;
+}
+
+/* Creates the same number of files with every thread count up to
+ * config->threads, on a freshly formatted disk each time.
+ */
+static void parallel_creates( const struct bench_config* config )
+{
+    long files = config->inodes < config->disk_blocks / 2 ? config->inodes : config->disk_blocks / 2;
+    for( int threads = 1; threads <= config->threads && num_parallel_runs < MAX_PARALLEL_RUNS; threads *= 2 )
+    {
+        format_disk( );
+        struct inode* root = create_dir( NULL, "/" );
+        pthread_t* ids = malloc( threads * sizeof(pthread_t) );
+        struct parallel_job* jobs = calloc( threads, sizeof(struct parallel_job) );
+        if( root == NULL || ids == NULL || jobs == NULL )
+        {
+            fprintf( stderr, "Failed to allocate memory for %d threads\n", threads );
+            exit( -1 );
+        }
+        char name[16];
+        for( int t = 0; t < threads; t++ )
+        {
+            snprintf( name, sizeof(name), "t%d", t );
+            jobs[t].dir = create_dir( root, name );
+            jobs[t].count = files / threads;
+        }
+
+        double start = now( );
+        int started = 0;
+        for( ; started < threads; started++ )
+        {
+            if( pthread_create( &ids[started], NULL, create_files, &jobs[started] ) != 0 )
+                break;
+        }
+        for( int t = 0; t < started; t++ )
+        {
+            pthread_join( ids[t], NULL );
+        }
+        struct parallel_run* run = &parallel_runs[num_parallel_runs++];
+        run->seconds = now( ) - start;
+        run->threads = started;
+        for( int t = 0; t < started; t++ )
+        {
+            run->files += jobs[t].count;
+            run->failed += jobs[t].failed;
+        }
+        fs_shutdown( root );
+        free( jobs );
+        free( ids );
+    }
+}
+
+static int compare_doubles( const void* a, const void* b )
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile( const struct op_stats* s, double p )
+{
+    long i = (long)ceil( p * s->count ) - 1;
+    return s->latencies[i < 0 ? 0 : i];
+}
+
+static long heap_bytes( const struct fs_memory* m )
+{
+    return m->headers + m->names + m->children + m->children_slack + m->blocks + m->slack + m->overhead;
+}
+
+static void print_json( const struct bench_config* config, long num_files )
+{
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+
+    printf( "{\n" );
+    printf( "  \"shape\": \"%s\", \"inodes\": %ld, \"files\": %ld, \"fanout\": %d, \"depth\": %d,\n",
+            config->shape, config->inodes, num_files, config->fanout, config->depth );
+    printf( "  \"zipf\": %g, \"max_blocks\": %d, \"disk_blocks\": %d, \"seed\": %llu,\n",
+            config->zipf, config->max_blocks, config->disk_blocks, (unsigned long long)config->seed );
+    printf( "  \"peak_rss_kb\": %ld,\n", usage.ru_maxrss );
+    const struct fs_memory* m = &loaded_memory;
+    printf( "  \"loaded_memory\": { \"inodes\": %ld, \"heap_bytes\": %ld, \"bytes_per_inode\": %.1f, "
+            "\"children_slack\": %ld, \"malloc_overhead\": %ld, \"mapped_bytes\": %ld, \"table_bytes\": %ld },\n",
+            m->inodes, heap_bytes( m ), m->inodes > 0 ? (double)heap_bytes( m ) / m->inodes : 0.0,
+            m->children_slack, m->overhead, m->mapped, loaded_table_bytes );
+    printf( "  \"ops\": {\n" );
+    for( int op = 0; op < NUM_OPS; op++ )
+    {
+        struct op_stats* s = &stats[op];
+        double total = 0;
+        for( long i = 0; i < s->count; i++ )
+        {
+            total += s->latencies[i];
+        }
+        qsort( s->latencies, s->count, sizeof(double), compare_doubles );
+
+        printf( "    \"%s\": { \"count\": %ld, \"failed\": %ld", op_names[op], s->count, s->failed );
+        if( s->count > 0 )
+        {
+            printf( ", \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"p50_us\": %.2f, \"p90_us\": %.2f, "
+                    "\"p99_us\": %.2f, \"max_us\": %.2f",
+                    total, total > 0 ? s->count / total : 0.0,
+                    percentile( s, 0.50 ) * 1e6, percentile( s, 0.90 ) * 1e6,
+                    percentile( s, 0.99 ) * 1e6, s->latencies[s->count - 1] * 1e6 );
+        }
+        printf( " }%s\n", op < NUM_OPS - 1 ? "," : "" );
+        free( s->latencies );
+    }
+    printf( "  },\n" );
+
+    if( num_parallel_runs > 0 )
+    {
+        printf( "  \"parallel_create\": [\n" );
+        for( int i = 0; i < num_parallel_runs; i++ )
+        {
+            struct parallel_run* run = &parallel_runs[i];
+            printf( "    { \"threads\": %d, \"files\": %ld, \"failed\": %ld, \"seconds\": %.6f, "
+                    "\"ops_per_sec\": %.1f, \"speedup\": %.2f }%s\n",
+                    run->threads, run->files, run->failed, run->seconds,
+                    run->seconds > 0 ? run->files / run->seconds : 0.0,
+                    run->seconds > 0 ? parallel_runs[0].seconds / run->seconds : 0.0,
+                    i < num_parallel_runs - 1 ? "," : "" );
+        }
+        printf( "  ],\n" );
+    }
+
+    struct fs_stats counters;
+    fs_stats( &counters );
+    printf( "  \"counters\": {" );
+    for( int c = 0; c < FS_NUM_COUNTERS; c++ )
+    {
+        printf( "%s \"%s\": %llu", c > 0 ? "," : "", fs_counter_name( c ),
+                (unsigned long long)counters.counters[c] );
+    }
+    printf( " }\n" );
+    printf( "}\n" );
+}
+
+static void usage( const char* prog )
+{
+    fprintf( stderr, "This programs builds a synthetic tree on a simulated disk and times\n"
+                     "create_dir, create_file, find_inode_by_name, delete_file, save_inodes,\n"
+                     "load_inodes and fs_shutdown, one call at a time. It prints the number\n"
+                     "of calls, calls per second, latency percentiles and the peak RSS as\n"
+                     "JSON, so that runs of different builds can be compared.\n"
+                     "\n"
+                     "Usage: %s [options]\n"
+                     "       -s SHAPE   wide, deep or balanced (balanced)\n"
+                     "       -n N       number of inodes (100000)\n"
+                     "       -f N       fanout of balanced trees (16)\n"
+                     "       -d N       depth of deep trees (64)\n"
+                     "       -z S       Zipf exponent of the file sizes, 0 for empty files (0)\n"
+                     "       -m N       largest file size in blocks (64)\n"
+                     "       -b N       blocks on the disk (65536)\n"
+                     "       -r N       runs of save, load and shutdown (3)\n"
+                     "       -x SEED    random seed (1)\n"
+                     "       -p PREFIX  files PREFIX.mft and PREFIX.bat are used (bench)\n"
+                     "       -t N       also time creating files of one block from 1, 2, 4 ...\n"
+                     "                  up to N threads, each in its own directory (0)\n"
+                     , prog );
+    exit( -1 );
+}
+
+int main( int argc, char* argv[] )
+{
+    struct bench_config config = { "balanced", 100000, 16, 64, 0, 64, 65536, 3, 1, "bench", 0 };
+    int opt;
+    while( ( opt = getopt( argc, argv, "s:n:f:d:z:m:b:r:x:p:t:" ) ) != -1 )
+    {
+        switch( opt )
+        {
+        case 's': config.shape = optarg; break;
+        case 'n': config.inodes = atol( optarg ); break;
+        case 'f': config.fanout = atoi( optarg ); break;
+        case 'd': config.depth = atoi( optarg ); break;
+        case 'z': config.zipf = atof( optarg ); break;
+        case 'm': config.max_blocks = atoi( optarg ); break;
+        case 'b': config.disk_blocks = atoi( optarg ); break;
+        case 'r': config.repeat = atoi( optarg ); break;
+        case 'x': config.seed = strtoull( optarg, NULL, 10 ); break;
+        case 'p': config.prefix = optarg; break;
+        case 't': config.threads = atoi( optarg ); break;
+        default: usage( argv[0] );
+        }
+    }
+    if( optind != argc || config.inodes < 1 || config.fanout < 1 || config.depth < 1 || config.max_blocks < 1
+        || config.disk_blocks < 1 || config.repeat < 1 || config.seed == 0 || config.threads < 0
+        || ( strcmp( config.shape, "wide" ) != 0 && strcmp( config.shape, "deep" ) != 0
+             && strcmp( config.shape, "balanced" ) != 0 ) )
+    {
+        usage( argv[0] );
+    }
+
+    char mft[256], bat[256];
+    snprintf( mft, sizeof(mft), "%s.mft", config.prefix );
+    snprintf( bat, sizeof(bat), "%s.bat", config.prefix );
+    set_block_allocation_table_name( bat );
+    set_disk_num_blocks( config.disk_blocks );
+    format_disk( );
+
+    struct bench_file* files = malloc( config.inodes * sizeof(struct bench_file) );
+    struct inode* root = create_dir( NULL, "/" );
+    if( files == NULL || root == NULL )
+    {
+        fprintf( stderr, "Failed to allocate memory for %ld inodes\n", config.inodes );
+        exit( -1 );
+    }
+    long num_files = build_tree( &config, root, files );
+
+    // look up every file in random order, by name in its directory
+    uint64_t rng = config.seed;
+    for( long i = 0; i < num_files; i++ )
+    {
+        struct bench_file* file = &files[next_random( &rng ) % num_files];
+        double start = now( );
+        struct inode* node = find_inode_by_name( file->dir, file->name );
+        record( OP_FIND, now( ) - start, node == file->node );
+    }
+
+    for( int run = 0; run < config.repeat; run++ )
+    {
+        double start = now( );
+        save_inodes( mft, root );
+        record( OP_SAVE, now( ) - start, 1 );
+
+        start = now( );
+        struct inode* loaded = load_inodes( mft );
+        record( OP_LOAD, now( ) - start, loaded != NULL );
+
+        struct fs_memory_report* report = run == 0 && loaded != NULL ? fs_memory_report( loaded ) : NULL;
+        if( report != NULL )
+        {
+            loaded_memory = report->all;
+            loaded_table_bytes = report->table_bytes;
+            fs_memory_report_free( report );
+        }
+
+        start = now( );
+        fs_shutdown( loaded );
+        record( OP_SHUTDOWN, now( ) - start, loaded != NULL );
+    }
+
+    // delete half of the files, picked at random
+    for( long i = num_files - 1; i > 0; i-- )
+    {
+        long j = next_random( &rng ) % ( i + 1 );
+        struct bench_file tmp = files[i];
+        files[i] = files[j];
+        files[j] = tmp;
+    }
+    for( long i = 0; i < num_files / 2; i++ )
+    {
+        double start = now( );
+        int retval = delete_file( files[i].dir, files[i].node );
+        record( OP_DELETE_FILE, now( ) - start, retval == 0 );
+    }
+
+    double start = now( );
+    fs_shutdown( root );
+    record( OP_SHUTDOWN, now( ) - start, 1 );
+
+    parallel_creates( &config );
+
+    print_json( &config, num_files );
+
+    free( files );
+    unlink( mft );
+    unlink( bat );
+    char idx[256 + 4];
+    snprintf( idx, sizeof(idx), "%s.idx", mft );
+    unlink( idx );
+    release_block_allocation_table_name( );
+    return 0;
+}
@@ -0,0 +1,153 @@
+#include "data.h"
+#include "allocation.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static int data_fd = -1;
+
+int fs_data_open(const char *path)
+{
+    fs_data_close();
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to open data file %s\n", path);
+        return -1;
+    }
+    struct stat st;
+    off_t size = (off_t)disk_num_blocks() * BLOCKSIZE;
+    if (fstat(fd, &st) != 0 || (st.st_size < size && ftruncate(fd, size) != 0))
+    {
+        fprintf(stderr, "Failed to make data file %s %lld bytes large\n", path, (long long)size);
+        close(fd);
+        return -1;
+    }
+    data_fd = fd;
+    return 0;
+}
+
+void fs_data_close(void)
+{
+    if (data_fd >= 0)
+    {
+        close(data_fd);
+        data_fd = -1;
+    }
+}
+
+int fs_data_fd(void)
+{
+    return data_fd;
+}
+
+size_t fs_data_run(struct inode *file, size_t pos, size_t len, off_t *at)
+{
+    int first = pos / BLOCKSIZE;
+    size_t run = BLOCKSIZE - pos % BLOCKSIZE;
+    int last = first;
+    while (run < len && last + 1 < file->num_blocks && file->blocks[last + 1] == file->blocks[last] + 1)
+    {
+        last++;
+        run += BLOCKSIZE;
+    }
+    if (first >= file->num_blocks || file->blocks[last] >= (size_t)disk_num_blocks())
+    {
+        fprintf(stderr, "File %s has no valid block for byte %zu\n", file->name, pos);
+        return 0;
+    }
+    *at = (off_t)file->blocks[first] * BLOCKSIZE + pos % BLOCKSIZE;
+    return run < len ? run : len;
+}
+
+/* Copies block from to block to, for fs_own_blocks() of inode.h. */
+static int copy_block(size_t from, size_t to)
+{
+    char buf[BLOCKSIZE];
+    ssize_t n = pread(data_fd, buf, sizeof(buf), (off_t)from * BLOCKSIZE);
+    if (n < 0)
+    {
+        return -1;
+    }
+    memset(buf + n, 0, sizeof(buf) - n);
+    return pwrite(data_fd, buf, sizeof(buf), (off_t)to * BLOCKSIZE) == (ssize_t)sizeof(buf) ? 0 : -1;
+}
+
+int fs_data_own_blocks(struct inode *file)
+{
+    return fs_own_blocks(file, copy_block);
+}
+
+/* Moves len bytes between buf and file from offset, a run of
+ * consecutive blocks per system call.
+ */
+static ssize_t transfer(struct inode *file, size_t offset, char *buf, size_t len, int write)
+{
+    if (data_fd < 0 || file == NULL || file->is_directory)
+    {
+        return -1;
+    }
+    if (offset >= (size_t)file->filesize)
+    {
+        return 0;
+    }
+    if (len > file->filesize - offset)
+    {
+        len = file->filesize - offset;
+    }
+    if (write && fs_data_own_blocks(file) != 0)
+    {
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < len)
+    {
+        off_t at;
+        size_t run = fs_data_run(file, offset + done, len - done, &at);
+        if (run == 0)
+        {
+            return -1;
+        }
+        ssize_t n = write ? pwrite(data_fd, buf + done, run, at) : pread(data_fd, buf + done, run, at);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return done > 0 ? (ssize_t)done : -1;
+        }
+        if (n == 0 && !write)
+        {
+            // past the end of a data file that a smaller disk made
+            memset(buf + done, 0, run);
+            n = run;
+        }
+        fs_count(write ? FS_DATA_WRITES : FS_DATA_READS, 1);
+        fs_count(write ? FS_DATA_BYTES_WRITTEN : FS_DATA_BYTES_READ, n);
+        done += n;
+    }
+    return done;
+}
+
+ssize_t fs_read(struct inode *file, size_t offset, void *buf, size_t len)
+{
+    uint64_t start = fs_now_ns();
+    ssize_t n = transfer(file, offset, buf, len, 0);
+    fs_op_done(FS_OP_READ, start, file != NULL ? file->id : -1);
+    return n;
+}
+
+ssize_t fs_write(struct inode *file, size_t offset, const void *buf, size_t len)
+{
+    uint64_t start = fs_now_ns();
+    ssize_t n = transfer(file, offset, (char *)buf, len, 1);
+    fs_op_done(FS_OP_WRITE, start, file != NULL ? file->id : -1);
+    return n;
+}
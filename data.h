@@ -0,0 +1,59 @@
+#ifndef DATA_H
+#define DATA_H
+
+#include "inode.h"
+
+#include <sys/types.h>
+
+/* The contents of the files on the simulated disk. They are kept in a
+ * data file of disk_num_blocks() blocks of BLOCKSIZE bytes, where
+ * block n of the block allocation table is at byte n * BLOCKSIZE.
+ * A byte of a file is found through the block list of its inode, and
+ * blocks that follow each other on disk are read or written with one
+ * system call, so the number of calls shows how well a file is laid
+ * out.
+ */
+/* Opens the data file path, creating it if need be, and makes it
+ * large enough for disk_num_blocks() blocks; the blocks that were never
+ * written read as zeros. A data file that was open is closed first.
+ * Returns 0 on success and -1 on failure.
+ */
+int fs_data_open(const char *path);
+
+void fs_data_close(void);
+
+/* Reads up to len bytes of file from offset into buf. Returns the
+ * number of bytes read, which is less than len at the end of the file
+ * and 0 from there on, or -1 if file is a directory, no data file is
+ * open or a read failed.
+ * Safe to call concurrently, as long as the file is not deleted.
+ */
+ssize_t fs_read(struct inode *file, size_t offset, void *buf, size_t len);
+
+/* Writes up to len bytes from buf to file at offset. A file keeps the
+ * size it was created with, so nothing is written past its end; the
+ * number of bytes written is returned, or -1 like fs_read().
+ * Snapshots never change: the first write to a file that a snapshot
+ * shares gives it new blocks with a copy of the old contents (see
+ * fs_own_blocks() in inode.h), and a file that only a snapshot has
+ * cannot be written, so -1 is returned for it.
+ */
+ssize_t fs_write(struct inode *file, size_t offset, const void *buf, size_t len);
+
+/* Calls fs_own_blocks() of inode.h for file, copying the contents of
+ * its blocks in the data file, as fs_write() does before it writes.
+ * Returns 0 if file can be written in place and -1 if not.
+ */
+int fs_data_own_blocks(struct inode *file);
+
+/* The descriptor of the open data file, -1 if there is none. */
+int fs_data_fd(void);
+
+/* Finds the run of blocks that follow each other on disk from byte pos
+ * of file, as much of it as fits into len bytes. Sets *at to where the
+ * run starts in the data file and returns its length, or returns 0 if
+ * file has no valid block for pos. pos must be below the file size.
+ */
+size_t fs_data_run(struct inode *file, size_t pos, size_t len, off_t *at);
+
+#endif
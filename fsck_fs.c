@@ -0,0 +1,347 @@
+#include "inode.h"
+#include "allocation.h"
+#include "walk.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define PATH_LEN 4096
+
+/* Both bitmaps hold one bit per block of the simulated disk, 64 blocks
+ * per word, so that the tables can be compared a word at a time.
+ */
+struct fsck_state
+{
+    int num_blocks;
+    int num_words;
+    _Atomic uint64_t* referenced; // blocks that a file refers to
+    _Atomic uint64_t* doubled;    // blocks that more than one file refers to, or one file twice
+    atomic_long problems;
+};
+
+/* Prints a problem with node as one line, so that lines from several
+ * threads do not mix.
+ */
+static void report( struct fsck_state* state, struct walk_frame* parent, struct inode* node, const char* format, ... )
+{
+    char path[PATH_LEN];
+    char what[PATH_LEN];
+    if( walk_path( parent, node, path, sizeof(path) ) < 0 )
+    {
+        snprintf( path, sizeof(path), "(id %d)", node->id );
+    }
+    va_list args;
+    va_start( args, format );
+    vsnprintf( what, sizeof(what), format, args );
+    va_end( args );
+    printf( "%s: %s\n", path, what );
+    atomic_fetch_add( &state->problems, 1 );
+}
+
+static int compare_names( const void* a, const void* b )
+{
+    return strcmp( *(char* const*)a, *(char* const*)b );
+}
+
+static void check_inode( struct inode* node, struct walk_frame* parent, int depth, void* arg )
+{
+    struct fsck_state* state = arg;
+    (void)depth;
+
+    if( node->is_directory )
+    {
+        if( node->num_children < 2 )
+        {
+            return;
+        }
+        char** names = malloc( node->num_children * sizeof(char*) );
+        if( names == NULL )
+        {
+            report( state, parent, node, "cannot check the names of %d children", node->num_children );
+            return;
+        }
+        for( int i = 0; i < node->num_children; i++ )
+        {
+            names[i] = node->children[i]->name;
+        }
+        qsort( names, node->num_children, sizeof(char*), compare_names );
+        for( int i = 1; i < node->num_children; i++ )
+        {
+            if( strcmp( names[i - 1], names[i] ) == 0 && ( i < 2 || strcmp( names[i - 2], names[i] ) != 0 ) )
+            {
+                report( state, parent, node, "name %s is used more than once", names[i] );
+            }
+        }
+        free( names );
+        return;
+    }
+
+    if( node->num_blocks != blocks_needed( node->filesize ) )
+    {
+        report( state, parent, node, "a file of %d bytes has %d blocks", node->filesize, node->num_blocks );
+    }
+    for( int i = 0; i < node->num_blocks; i++ )
+    {
+        size_t block = node->blocks[i];
+        if( block >= (size_t)state->num_blocks )
+        {
+            report( state, parent, node, "block %zu is outside of the disk of %d blocks", block, state->num_blocks );
+            continue;
+        }
+        uint64_t bit = (uint64_t)1 << ( block % 64 );
+        if( atomic_fetch_or( &state->referenced[block / 64], bit ) & bit )
+        {
+            atomic_fetch_or( &state->doubled[block / 64], bit );
+        }
+    }
+}
+
+/* Reports the files that use a block that more than one file uses. */
+static void find_doubled( struct inode* node, struct walk_frame* parent, int depth, void* arg )
+{
+    struct fsck_state* state = arg;
+    (void)depth;
+
+    for( int i = 0; !node->is_directory && i < node->num_blocks; i++ )
+    {
+        size_t block = node->blocks[i];
+        if( block < (size_t)state->num_blocks
+            && ( atomic_load( &state->doubled[block / 64] ) >> ( block % 64 ) ) & 1 )
+        {
+            report( state, parent, node, "block %zu is used by another file as well", block );
+        }
+    }
+}
+
+/* One thread's part of the comparison: the words lo to hi of the
+ * bitmaps. The table has one char per block, which is packed into
+ * words first.
+ */
+struct compare_job
+{
+    const struct fsck_state* state;
+    const char* table;
+    int lo;
+    int hi;
+    uint64_t* leaked;   // used in the table, but no file refers to them
+    uint64_t* unbacked; // free in the table, but a file refers to them
+};
+
+static void* compare_words( void* arg )
+{
+    struct compare_job* job = arg;
+    const struct fsck_state* state = job->state;
+
+    for( int w = job->lo; w < job->hi; w++ )
+    {
+        int first = w * 64;
+        int count = state->num_blocks - first < 64 ? state->num_blocks - first : 64;
+        uint64_t used = 0;
+        for( int b = 0; b < count; b++ )
+        {
+            used |= (uint64_t)( job->table[first + b] != 0 ) << b;
+        }
+        uint64_t referenced = atomic_load_explicit( &state->referenced[w], memory_order_relaxed );
+        job->leaked[w] = used & ~referenced;
+        job->unbacked[w] = referenced & ~used;
+    }
+    return NULL;
+}
+
+/* Compares the table with the referenced blocks using up to num_threads
+ * threads, each taking a range of words. Returns -1 if memory runs
+ * out.
+ */
+static int compare_table( const struct fsck_state* state, const char* table, int num_threads,
+                          uint64_t* leaked, uint64_t* unbacked )
+{
+    // starting a thread costs more than comparing a few thousand blocks
+    if( num_threads > state->num_words / 64 + 1 )
+    {
+        num_threads = state->num_words / 64 + 1;
+    }
+    struct compare_job* jobs = calloc( num_threads, sizeof(struct compare_job) );
+    pthread_t* threads = calloc( num_threads, sizeof(pthread_t) );
+    char* started = calloc( num_threads, 1 );
+    if( jobs == NULL || threads == NULL || started == NULL )
+    {
+        free( jobs );
+        free( threads );
+        free( started );
+        return -1;
+    }
+
+    for( int t = 0; t < num_threads; t++ )
+    {
+        jobs[t].state = state;
+        jobs[t].table = table;
+        jobs[t].lo = (long)state->num_words * t / num_threads;
+        jobs[t].hi = (long)state->num_words * ( t + 1 ) / num_threads;
+        jobs[t].leaked = leaked;
+        jobs[t].unbacked = unbacked;
+        // this thread takes the first range, and any range whose thread did not start
+        if( t > 0 && pthread_create( &threads[t], NULL, compare_words, &jobs[t] ) == 0 )
+        {
+            started[t] = 1;
+        }
+    }
+    for( int t = 0; t < num_threads; t++ )
+    {
+        if( !started[t] )
+        {
+            compare_words( &jobs[t] );
+        }
+    }
+    for( int t = 0; t < num_threads; t++ )
+    {
+        if( started[t] )
+        {
+            pthread_join( threads[t], NULL );
+        }
+    }
+    free( jobs );
+    free( threads );
+    free( started );
+    return 0;
+}
+
+/* Prints the blocks whose bits are set in bitmap after the label.
+ * Returns their number.
+ */
+static long print_blocks( const char* label, const uint64_t* bitmap, int num_words )
+{
+    long count = 0;
+    for( int w = 0; w < num_words; w++ )
+    {
+        for( uint64_t bits = bitmap[w]; bits != 0; bits &= bits - 1 )
+        {
+            if( count++ == 0 )
+            {
+                printf( "%s:", label );
+            }
+            printf( " %d", w * 64 + __builtin_ctzll( bits ) );
+        }
+    }
+    if( count > 0 )
+    {
+        printf( "\n" );
+    }
+    return count;
+}
+
+int main( int argc, char* argv[] )
+{
+    if( ( argc != 4 && argc != 5 ) || ( argc == 5 && strcmp( argv[4], "repair" ) != 0 ) )
+    {
+        fprintf( stderr, "This programs checks that the master file table (MFT) and the block\n"
+                         "allocation table (BAT) of a simulated disk agree. It reports blocks\n"
+                         "that are used but belong to no file, blocks that belong to more than\n"
+                         "one file, blocks of files that are free or outside of the disk, names\n"
+                         "used twice in a directory and files whose size does not match their\n"
+                         "number of blocks.\n"
+                         "With repair it frees the blocks that belong to no file and marks the\n"
+                         "free blocks that files use as used. The MFT is not changed.\n"
+                         "It exits with 0 if it found no problems and 1 if it did.\n"
+                         "\n"
+                         "Usage: %s MFT BAT THREADS [repair]\n"
+                         "       where\n"
+                         "       MFT is the name of the master file table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         "       THREADS is the number of threads, 0 for one per CPU\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    set_block_allocation_table_name( argv[2] );
+    int repair = argc == 5;
+    int threads = atoi( argv[3] );
+    if( threads <= 0 )
+    {
+        threads = sysconf( _SC_NPROCESSORS_ONLN );
+        if( threads <= 0 )
+            threads = 1;
+    }
+
+    struct inode* root = load_inodes_parallel( argv[1], threads );
+    char* table = read_block_allocation_table( );
+    if( root == NULL || table == NULL )
+    {
+        exit( -1 );
+    }
+
+    struct fsck_state state;
+    state.num_blocks = disk_num_blocks( );
+    state.num_words = ( state.num_blocks + 63 ) / 64;
+    state.referenced = calloc( state.num_words, sizeof(uint64_t) );
+    state.doubled = calloc( state.num_words, sizeof(uint64_t) );
+    atomic_init( &state.problems, 0 );
+    uint64_t* leaked = calloc( state.num_words, sizeof(uint64_t) );
+    uint64_t* unbacked = calloc( state.num_words, sizeof(uint64_t) );
+    if( state.referenced == NULL || state.doubled == NULL || leaked == NULL || unbacked == NULL )
+    {
+        fprintf( stderr, "Failed to allocate the bitmaps for %d blocks\n", state.num_blocks );
+        exit( -1 );
+    }
+
+    struct walk_ops ops = { check_inode, NULL, &state };
+    struct fs_usage total;
+    if( walk_tree( root, threads, &ops, &total ) != 0
+        || compare_table( &state, table, threads, leaked, unbacked ) != 0 )
+    {
+        fprintf( stderr, "The check ran out of memory\n" );
+        exit( -1 );
+    }
+
+    // a second walk names the files, now that the blocks are known
+    if( print_blocks( "blocks used by more than one file", (uint64_t*)state.doubled, state.num_words ) > 0 )
+    {
+        ops.visit = find_doubled;
+        if( walk_tree( root, threads, &ops, NULL ) != 0 )
+        {
+            fprintf( stderr, "The check ran out of memory\n" );
+            exit( -1 );
+        }
+    }
+
+    long problems = atomic_load( &state.problems );
+    long num_leaked = print_blocks( "blocks used by no file", leaked, state.num_words );
+    long num_unbacked = print_blocks( "blocks of files that are free", unbacked, state.num_words );
+    problems += num_leaked + num_unbacked;
+
+    printf( "checked %ld files and %ld directories with %ld blocks on a disk of %d blocks: ",
+            total.files, total.dirs, total.blocks, state.num_blocks );
+    if( problems == 0 )
+    {
+        printf( "clean\n" );
+    }
+    else
+    {
+        printf( "%ld problems\n", problems );
+    }
+
+    if( repair && num_leaked + num_unbacked > 0 )
+    {
+        for( int i = 0; i < state.num_blocks; i++ )
+        {
+            table[i] = ( atomic_load( &state.referenced[i / 64] ) >> ( i % 64 ) ) & 1;
+        }
+        if( write_block_allocation_table( table ) != 0 )
+        {
+            exit( -1 );
+        }
+        printf( "repaired: freed %ld blocks, marked %ld blocks as used\n", num_leaked, num_unbacked );
+    }
+
+    free( leaked );
+    free( unbacked );
+    free( (void*)state.referenced );
+    free( (void*)state.doubled );
+    free( table );
+    fs_shutdown( root );
+    release_block_allocation_table_name( );
+    return problems == 0 ? 0 : 1;
+}
@@ -1,25 +1,30 @@
 #include "allocation.h"
 #include "inode.h"
+#include "mft.h"
+#include "stats.h"
+#include "wal.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-/* The number of bytes in a block.
- * Do not change.
- */
-#define BLOCKSIZE 4096
-
-// The lowest unused node ID.
-static int num_inode_ids = 0;
+// The lowest unused node ID. Atomic so that concurrent writers get unique IDs.
+static atomic_int num_inode_ids = 0;
 
 /* This helper function computes the number of blocks that you must allocate
  * on the simulated disk for a give file system in bytes. You don't have to use
  * it.
  * Do not change.
  */
-static int blocks_needed(int bytes)
+int blocks_needed(int bytes)
 {
     int blocks = bytes / BLOCKSIZE;
     if (bytes % BLOCKSIZE != 0)
@@ -31,404 +36,3007 @@ static int blocks_needed(int bytes)
  * This helps you do avoid inode reuse before 2^32 inodes have been created. It
  * keeps the lowest unused inode ID in the global variable num_inode_ids.
  * Make sure to update num_inode_ids when you have loaded a simulated disk.
- * Do not change.
  */
 static int next_inode_id()
 {
-    int retval = num_inode_ids;
-    num_inode_ids += 1;
+    return atomic_fetch_add(&num_inode_ids, 1);
+}
+
+/* Looks up name among the children of parent. Unlike find_inode_by_name
+ * this does not check the type of parent; writers call it while they
+ * hold parent->lock.
+ */
+static struct inode *find_child_locked(struct inode *parent, char *name)
+{
+    for (int i = 0; i < parent->num_children; i++)
+    {
+        if (strcmp(parent->children[i]->name, name) == 0)
+        {
+            fs_count(FS_NAME_COMPARES, i + 1);
+            return parent->children[i];
+        }
+    }
+    fs_count(FS_NAME_COMPARES, parent->num_children);
+    return NULL;
+}
+
+/* Appends child to the children array of parent. parent->lock must be held.
+ * Returns 0 on success and -1 if the array could not be grown.
+ */
+static int add_child_locked(struct inode *parent, struct inode *child)
+{
+    struct inode **children = realloc(parent->children, (parent->num_children + 1) * sizeof(struct inode *));
+    if (children == NULL)
+    {
+        return -1;
+    }
+    fs_count(FS_CHILDREN_REALLOCS, 1);
+    children[parent->num_children] = child;
+    parent->children = children;
+    parent->num_children++;
+    return 0;
+}
+
+/* Sets the totals of a new inode to just the inode itself. */
+static void init_usage(struct inode *node)
+{
+    atomic_init(&node->tree_files, node->is_directory ? 0 : 1);
+    atomic_init(&node->tree_dirs, node->is_directory ? 1 : 0);
+    atomic_init(&node->tree_bytes, node->is_directory ? 0 : node->filesize);
+    atomic_init(&node->tree_blocks, node->is_directory ? 0 : node->num_blocks);
+}
+
+/* Adds sign times the totals of node to dir and all of its ancestors. */
+static void account_usage(struct inode *dir, struct inode *node, int sign)
+{
+    long files = sign * atomic_load_explicit(&node->tree_files, memory_order_relaxed);
+    long dirs = sign * atomic_load_explicit(&node->tree_dirs, memory_order_relaxed);
+    long bytes = sign * atomic_load_explicit(&node->tree_bytes, memory_order_relaxed);
+    long blocks = sign * atomic_load_explicit(&node->tree_blocks, memory_order_relaxed);
+    for (; dir != NULL; dir = dir->parent)
+    {
+        atomic_fetch_add_explicit(&dir->tree_files, files, memory_order_relaxed);
+        atomic_fetch_add_explicit(&dir->tree_dirs, dirs, memory_order_relaxed);
+        atomic_fetch_add_explicit(&dir->tree_bytes, bytes, memory_order_relaxed);
+        atomic_fetch_add_explicit(&dir->tree_blocks, blocks, memory_order_relaxed);
+    }
+}
+
+void fs_usage(struct inode *node, struct fs_usage *usage)
+{
+    usage->files = atomic_load_explicit(&node->tree_files, memory_order_relaxed);
+    usage->dirs = atomic_load_explicit(&node->tree_dirs, memory_order_relaxed);
+    usage->bytes = atomic_load_explicit(&node->tree_bytes, memory_order_relaxed);
+    usage->blocks = atomic_load_explicit(&node->tree_blocks, memory_order_relaxed);
+}
+
+/* Marks node as changed since the last save, and the directories above
+ * it as having a change below them. The walk up stops at the first
+ * directory that is marked already, since everything above it is too.
+ */
+static void mark_dirty(struct inode *node)
+{
+    __atomic_or_fetch(&node->flags, INODE_DIRTY, __ATOMIC_RELAXED);
+    for (struct inode *dir = node->parent; dir != NULL; dir = dir->parent)
+    {
+        if (__atomic_fetch_or(&dir->flags, INODE_DIRTY_BELOW, __ATOMIC_RELAXED) & INODE_DIRTY_BELOW)
+            break;
+    }
+}
+
+/* Removes node from the children array of parent. parent->lock must be held.
+ * Returns 0 on success and -1 if node is not a child of parent.
+ */
+static int remove_child_locked(struct inode *parent, struct inode *node)
+{
+    for (int i = 0; i < parent->num_children; i++)
+    {
+        if (parent->children[i] == node)
+        {
+            parent->num_children--;
+            memmove(&parent->children[i], &parent->children[i + 1],
+                    (parent->num_children - i) * sizeof(struct inode *));
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Frees what an inode owns. Names and block lists that point into a
+ * mapped master file table belong to the mapping and are left alone.
+ */
+static void release_inode(struct inode *node)
+{
+    if (!(node->flags & INODE_NAME_MAPPED))
+        free(node->name);
+    if (!(node->flags & INODE_BLOCKS_MAPPED))
+        free(node->blocks);
+    free(node->children);
+    pthread_mutex_destroy(&node->lock);
+    free(node);
+}
+
+/* Snapshots share inodes with the live tree they were taken from.
+ * Writers copy the directories they change out of every snapshot that
+ * still shares them, together with the directories above them (path
+ * copying), so the live tree keeps its inodes and the pointers callers
+ * hold stay valid. A copy belongs to one snapshot only.
+ *
+ * While there are snapshots, writers change directories only under
+ * snapshots_lock, since path copying reads the children arrays of live
+ * directories, and a snapshot is saved under it. The lock is taken
+ * after the directory locks. Saving a snapshot may load a directory
+ * while holding it, but no writer waits for the lock on a directory
+ * whose children are not loaded yet.
+ */
+struct snapshot
+{
+    struct inode *root;
+    struct inode *origin; // the root of the live tree
+    struct snapshot *next;
+};
+
+static struct snapshot *snapshots = NULL;
+static atomic_int num_snapshots = 0;
+static pthread_mutex_t snapshots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Copies the directory node for a snapshot, where it goes below parent.
+ * The children are shared with node. snapshots_lock must be held.
+ */
+static struct inode *copy_for_snapshot(struct inode *node, struct inode *parent)
+{
+    struct inode *copy = calloc(1, sizeof(struct inode));
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+    copy->name = strdup(node->name);
+    if (node->num_children > 0)
+    {
+        copy->children = malloc(node->num_children * sizeof(struct inode *));
+    }
+    if (copy->name == NULL || (node->num_children > 0 && copy->children == NULL))
+    {
+        free(copy->name);
+        free(copy->children);
+        free(copy);
+        return NULL;
+    }
+    copy->id = node->id;
+    copy->is_directory = node->is_directory;
+    copy->num_children = node->num_children;
+    for (int i = 0; i < node->num_children; i++)
+    {
+        copy->children[i] = node->children[i];
+        node->children[i]->shared++;
+    }
+    copy->parent = parent;
+    pthread_mutex_init(&copy->lock, NULL);
+    atomic_init(&copy->tree_files, atomic_load(&node->tree_files));
+    atomic_init(&copy->tree_dirs, atomic_load(&node->tree_dirs));
+    atomic_init(&copy->tree_bytes, atomic_load(&node->tree_bytes));
+    atomic_init(&copy->tree_blocks, atomic_load(&node->tree_blocks));
+    return copy;
+}
+
+/* Fills path with the directories from the root of the tree down to
+ * dir and returns the index of dir, or -1 if memory runs out.
+ */
+static int path_to(struct inode *dir, struct inode ***path)
+{
+    int depth = 0;
+    for (struct inode *node = dir; node->parent != NULL; node = node->parent)
+    {
+        depth++;
+    }
+    *path = malloc((depth + 1) * sizeof(struct inode *));
+    if (*path == NULL)
+    {
+        return -1;
+    }
+    int i = depth;
+    for (struct inode *node = dir; node != NULL; node = node->parent)
+    {
+        (*path)[i--] = node;
+    }
+    return depth;
+}
+
+/* Gives every snapshot of the tree its own copy of dir and of the
+ * directories above it, where it still shares them with the live tree.
+ * snapshots_lock must be held. Returns -1 if memory runs out.
+ */
+static int unshare_path(struct inode *dir)
+{
+    struct inode **path;
+    int depth = path_to(dir, &path);
+    if (depth < 0)
+    {
+        return -1;
+    }
+    int retval = 0;
+    for (struct snapshot *snap = snapshots; snap != NULL && retval == 0; snap = snap->next)
+    {
+        if (snap->origin != path[0])
+            continue;
+        struct inode *node = snap->root;
+        for (int i = 1; i <= depth && node != NULL; i++)
+        {
+            struct inode *next = NULL;
+            int j;
+            for (j = 0; j < node->num_children; j++)
+            {
+                if (strcmp(node->children[j]->name, path[i]->name) == 0)
+                {
+                    next = node->children[j];
+                    break;
+                }
+            }
+            // node belongs to the snapshot, so a live directory below it is replaced by a copy
+            if (next == path[i])
+            {
+                next = copy_for_snapshot(path[i], node);
+                if (next == NULL)
+                {
+                    retval = -1;
+                    break;
+                }
+                node->children[j] = next;
+                path[i]->shared--;
+            }
+            node = next;
+        }
+    }
+    free(path);
+    return retval;
+}
+
+/* Takes snapshots_lock before a writer changes dir, if there are any
+ * snapshots, and unshares dir. Returns 1 if the lock was taken, 0 if
+ * there are no snapshots and -1 on failure.
+ */
+static int begin_change(struct inode *dir)
+{
+    if (atomic_load(&num_snapshots) == 0)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&snapshots_lock);
+    if (unshare_path(dir) != 0)
+    {
+        pthread_mutex_unlock(&snapshots_lock);
+        return -1;
+    }
+    return 1;
+}
+
+static void end_change(int locked)
+{
+    if (locked > 0)
+        pthread_mutex_unlock(&snapshots_lock);
+}
+
+/* Returns the copy of path[depth] in snap, found by name from its root,
+ * or NULL if snap is of another tree or has no such directory.
+ * snapshots_lock must be held.
+ */
+static struct inode *snapshot_dir(struct snapshot *snap, struct inode **path, int depth)
+{
+    struct inode *holder = snap->origin == path[0] ? snap->root : NULL;
+    for (int i = 1; i <= depth && holder != NULL; i++)
+    {
+        holder = find_child_locked(holder, path[i]->name);
+    }
+    return holder;
+}
+
+/* Called when node has just been removed from the live directory dir.
+ * Returns 1 if nothing else refers to node, so it can be freed. If a
+ * snapshot still does, node moves to that snapshot's copy of dir.
+ */
+static int drop_from_live(struct inode *dir, struct inode *node)
+{
+    if (node->shared == 0)
+    {
+        return 1;
+    }
+    node->shared--;
+
+    struct inode **path;
+    int depth = path_to(dir, &path);
+    for (struct snapshot *snap = snapshots; snap != NULL && depth >= 0; snap = snap->next)
+    {
+        struct inode *holder = snapshot_dir(snap, path, depth);
+        for (int i = 0; holder != NULL && i < holder->num_children; i++)
+        {
+            if (holder->children[i] == node)
+            {
+                node->parent = holder;
+                free(path);
+                return 0;
+            }
+        }
+    }
+    free(path);
+    return 0;
+}
+
+/* Drops one reference to node, and frees it with everything below it
+ * that nothing else refers to. The blocks of files that are freed are
+ * given back if free_blocks is set. snapshots_lock must be held.
+ */
+static void release_ref(struct inode *node, int free_blocks)
+{
+    if (node->shared > 0)
+    {
+        node->shared--;
+        return;
+    }
+    for (int i = 0; i < node->num_children; i++)
+    {
+        release_ref(node->children[i], free_blocks);
+    }
+    for (int i = 0; free_blocks && i < node->num_blocks; i++)
+    {
+        free_block(node->blocks[i]);
+    }
+    release_inode(node);
+}
+
+static struct inode *take_snapshot(struct inode *root)
+{
+    if (root == NULL || root->parent != NULL || (root->flags & INODE_SNAPSHOT) || !root->is_directory
+        || fs_load_children(root) != 0)
+    {
+        return NULL;
+    }
+    struct snapshot *snap = malloc(sizeof(struct snapshot));
+    if (snap == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&snapshots_lock);
+    struct inode *copy = copy_for_snapshot(root, NULL);
+    if (copy != NULL)
+    {
+        copy->flags = INODE_SNAPSHOT;
+        snap->root = copy;
+        snap->origin = root;
+        snap->next = snapshots;
+        snapshots = snap;
+        atomic_fetch_add(&num_snapshots, 1);
+    }
+    else
+    {
+        free(snap);
+    }
+    pthread_mutex_unlock(&snapshots_lock);
+    return copy;
+}
+
+struct inode *fs_snapshot(struct inode *root)
+{
+    uint64_t start = fs_now_ns();
+    struct inode *snapshot = take_snapshot(root);
+    fs_op_done(FS_OP_SNAPSHOT, start, root != NULL ? root->id : -1);
+    return snapshot;
+}
+
+/* Removes the snapshot with the given root, or every snapshot of the
+ * live tree origin, and releases them.
+ */
+static void drop_snapshots(struct inode *root, struct inode *origin, int free_blocks)
+{
+    pthread_mutex_lock(&snapshots_lock);
+    struct snapshot **s = &snapshots;
+    while (*s != NULL)
+    {
+        struct snapshot *snap = *s;
+        if (snap->root != root && snap->origin != origin)
+        {
+            s = &snap->next;
+            continue;
+        }
+        *s = snap->next;
+        release_ref(snap->root, free_blocks);
+        free(snap);
+        atomic_fetch_sub(&num_snapshots, 1);
+    }
+    pthread_mutex_unlock(&snapshots_lock);
+}
+
+void fs_snapshot_drop(struct inode *snapshot)
+{
+    if (snapshot != NULL && (snapshot->flags & INODE_SNAPSHOT))
+    {
+        drop_snapshots(snapshot, NULL, 1);
+    }
+}
+
+/* Returns the live root that the snapshot with the given root was
+ * taken from, or root itself if it is not a snapshot.
+ */
+static struct inode *origin_of(struct inode *root)
+{
+    // writers set the dirty flags of the root at the same time
+    if (!(__atomic_load_n(&root->flags, __ATOMIC_RELAXED) & INODE_SNAPSHOT))
+    {
+        return root;
+    }
+    pthread_mutex_lock(&snapshots_lock);
+    for (struct snapshot *snap = snapshots; snap != NULL; snap = snap->next)
+    {
+        if (snap->root == root)
+        {
+            root = snap->origin;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&snapshots_lock);
+    return root;
+}
+
+/* Gives the snapshots that share file a copy of its inode with the old
+ * block list, and file new blocks with the same contents. The live tree
+ * keeps the inode, so the pointers callers hold stay valid. A file that
+ * no snapshot holds keeps its blocks.
+ * parent->lock and snapshots_lock must be held, and the path to parent
+ * unshared. Returns -1 if the disk or memory runs out.
+ */
+static int copy_file_blocks(struct inode *parent, struct inode *file, int (*copy_block)(size_t from, size_t to))
+{
+    // every snapshot has its own copy of parent now, and those that have file refer to it
+    struct inode **path;
+    int depth = path_to(parent, &path);
+    if (depth < 0)
+    {
+        return -1;
+    }
+    int holders = 0;
+    for (struct snapshot *snap = snapshots; snap != NULL; snap = snap->next)
+    {
+        struct inode *holder = snapshot_dir(snap, path, depth);
+        for (int i = 0; holder != NULL && i < holder->num_children; i++)
+        {
+            holders += holder->children[i] == file;
+        }
+    }
+    if (holders == 0)
+    {
+        free(path);
+        file->shared = 0;
+        return 0;
+    }
+
+    struct inode *old = calloc(1, sizeof(struct inode));
+    size_t *blocks = malloc(file->num_blocks * sizeof(size_t));
+    if (old == NULL || (file->num_blocks > 0 && blocks == NULL)
+        || (old->name = strdup(file->name)) == NULL
+        || (file->num_blocks > 0 && (old->blocks = malloc(file->num_blocks * sizeof(size_t))) == NULL))
+    {
+        if (old != NULL)
+            free(old->name);
+        free(old);
+        free(blocks);
+        free(path);
+        return -1;
+    }
+    int copied = 0;
+    for (; copied < file->num_blocks; copied++)
+    {
+        int number = allocate_block_near(copied > 0 ? (int)blocks[copied - 1] + 1 : -1);
+        if (number < 0 || copy_block(file->blocks[copied], number) != 0)
+        {
+            if (number >= 0)
+                free_block(number);
+            break;
+        }
+        blocks[copied] = number;
+    }
+    if (copied < file->num_blocks)
+    {
+        for (int i = 0; i < copied; i++)
+            free_block(blocks[i]);
+        free(blocks);
+        free(old->blocks);
+        free(old->name);
+        free(old);
+        free(path);
+        return -1;
+    }
+
+    memcpy(old->blocks, file->blocks, file->num_blocks * sizeof(size_t));
+    old->id = file->id;
+    old->filesize = file->filesize;
+    old->num_blocks = file->num_blocks;
+    pthread_mutex_init(&old->lock, NULL);
+    init_usage(old);
+
+    for (struct snapshot *snap = snapshots; snap != NULL; snap = snap->next)
+    {
+        struct inode *holder = snapshot_dir(snap, path, depth);
+        for (int i = 0; holder != NULL && i < holder->num_children; i++)
+        {
+            if (holder->children[i] == file)
+            {
+                holder->children[i] = old;
+                if (old->parent == NULL)
+                    old->parent = holder;
+            }
+        }
+    }
+    free(path);
+    old->shared = holders - 1;
+    file->shared = 0;
+
+    if (!(file->flags & INODE_BLOCKS_MAPPED))
+        free(file->blocks);
+    __atomic_and_fetch(&file->flags, ~INODE_BLOCKS_MAPPED, __ATOMIC_RELAXED);
+    file->blocks = blocks;
+    mark_dirty(file);
+    return 0;
+}
+
+int fs_own_blocks(struct inode *file, int (*copy_block)(size_t from, size_t to))
+{
+    if (file == NULL || file->is_directory)
+    {
+        return -1;
+    }
+    struct inode *parent = file->parent;
+    if (atomic_load(&num_snapshots) == 0 || parent == NULL)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&parent->lock);
+    pthread_mutex_lock(&snapshots_lock);
+    int retval = 0;
+    int shared = 0;
+    struct inode *root = file;
+    for (struct inode *node = file; node != NULL; node = node->parent)
+    {
+        shared |= node->shared > 0;
+        root = node;
+    }
+    if (__atomic_load_n(&root->flags, __ATOMIC_RELAXED) & INODE_SNAPSHOT)
+    {
+        retval = -1; // a file that only a snapshot has
+    }
+    else if (shared)
+    {
+        retval = unshare_path(parent) == 0 && copy_file_blocks(parent, file, copy_block) == 0 ? 0 : -1;
+    }
+    pthread_mutex_unlock(&snapshots_lock);
+    pthread_mutex_unlock(&parent->lock);
     return retval;
 }
 
+// Defined with the lazy loader below.
+static int load_children_locked(struct inode *dir);
+
+// Defined with the write-ahead log below.
+struct mft_mapping;
+static struct mft_mapping *wal_begin(struct inode *dir);
+static long wal_log(struct mft_mapping *mapping, int op, struct inode *parent, struct inode *node);
+static void wal_end(struct mft_mapping *mapping, long lsn);
+
 /* Oppretter en fil. */
-struct inode *create_file(struct inode *parent, char *name, int size_in_bytes)
+static struct inode *make_file(struct inode *parent, char *name, int size_in_bytes)
 {
     // printf(">> create_file ( %s )\n", name);
 
-    if (find_inode_by_name(parent, name) != NULL)
+    struct mft_mapping *wal = wal_begin(parent);
+    long lsn = 0;
+    if (parent != NULL)
+    {
+        pthread_mutex_lock(&parent->lock);
+        if (!parent->is_directory || load_children_locked(parent) != 0 || find_child_locked(parent, name) != NULL)
+        {
+            pthread_mutex_unlock(&parent->lock);
+            wal_end(wal, 0);
+            return NULL;
+        }
+    }
+
+    // allocation test is run before all other variables are set, making freeing resources easier if it fails.
+    int amount_of_blocks = blocks_needed(size_in_bytes);
+    size_t *blockarr = malloc(amount_of_blocks * sizeof(size_t));
+    struct inode *inode = malloc(sizeof(struct inode));
+    char *namecopy = strdup(name);
+    int allocated = 0;
+    if (blockarr == NULL || inode == NULL || namecopy == NULL)
+    {
+        goto fail;
+    }
+    for (; allocated < amount_of_blocks; allocated++)
+    {
+        // the allocator may keep the blocks of a file together
+        int number = allocate_block_near(allocated > 0 ? (int)blockarr[allocated - 1] + 1 : -1);
+        if (number < 0)
+        {
+            goto fail;
+        }
+        blockarr[allocated] = number;
+    }
+
+    inode->id = next_inode_id();
+    inode->name = namecopy;
+    inode->is_directory = 0;
+    inode->filesize = size_in_bytes;
+    inode->blocks = blockarr;
+    inode->num_blocks = amount_of_blocks;
+    inode->num_children = 0;
+    inode->children = NULL;
+    inode->parent = parent;
+    inode->flags = 0;
+    inode->shared = 0;
+    pthread_mutex_init(&inode->lock, NULL);
+    init_usage(inode);
+
+    // updating parent inode for all except root
+    if (parent != NULL)
+    {
+        // logged before the file can be seen, so nothing done to it can come first in the log
+        int locked = begin_change(parent);
+        lsn = locked < 0 ? -1 : wal_log(wal, WAL_CREATE_FILE, parent, inode);
+        if (lsn < 0 || add_child_locked(parent, inode) != 0)
+        {
+            if (lsn >= 0)
+            {
+                lsn = wal_log(wal, WAL_DELETE, parent, inode); // the create did not happen
+            }
+            end_change(locked);
+            pthread_mutex_destroy(&inode->lock);
+            goto fail;
+        }
+        account_usage(parent, inode, 1);
+        mark_dirty(parent);
+        mark_dirty(inode);
+        end_change(locked);
+        pthread_mutex_unlock(&parent->lock);
+    }
+    else
+    {
+        mark_dirty(inode);
+    }
+
+    wal_end(wal, lsn);
+    return inode;
+
+fail:
+    if (parent != NULL)
+    {
+        pthread_mutex_unlock(&parent->lock);
+    }
+    wal_end(wal, lsn);
+    // give back the blocks we got so a failed create does not leak disk space
+    for (int i = 0; i < allocated; i++)
+    {
+        free_block(blockarr[i]);
+    }
+    free(blockarr);
+    free(inode);
+    free(namecopy);
+    return NULL;
+}
+
+struct inode *create_file(struct inode *parent, char *name, int size_in_bytes)
+{
+    uint64_t start = fs_now_ns();
+    struct inode *inode = make_file(parent, name, size_in_bytes);
+    fs_op_done(FS_OP_CREATE_FILE, start, parent != NULL ? parent->id : -1);
+    return inode;
+}
+
+static struct inode *make_dir(struct inode *parent, char *name)
+{
+    // printf("> create_dir( %s )\n", name);
+
+    struct inode *dir = malloc(sizeof(struct inode));
+    if (dir == NULL)
+    {
+        return NULL;
+    }
+    dir->name = strdup(name);
+    if (dir->name == NULL)
+    {
+        free(dir);
+        return NULL;
+    }
+    dir->is_directory = 1;
+    dir->num_children = 0;
+    dir->children = NULL;
+    dir->filesize = 0;
+    dir->num_blocks = 0;
+    dir->blocks = NULL;
+    dir->parent = parent;
+    dir->flags = 0;
+    dir->shared = 0;
+    pthread_mutex_init(&dir->lock, NULL);
+    init_usage(dir);
+
+    // updating parent inode for all except root
+    if (parent != NULL)
+    {
+        struct mft_mapping *wal = wal_begin(parent);
+        pthread_mutex_lock(&parent->lock);
+        int locked = -1;
+        long lsn = -1;
+        if (parent->is_directory && load_children_locked(parent) == 0
+            && find_child_locked(parent, name) == NULL // if name already exists
+            && (locked = begin_change(parent)) >= 0)
+        {
+            // the ID is taken under the lock so IDs keep the order of the entries
+            dir->id = next_inode_id();
+            lsn = wal_log(wal, WAL_CREATE_DIR, parent, dir);
+            if (lsn >= 0 && add_child_locked(parent, dir) != 0)
+            {
+                wal_log(wal, WAL_DELETE, parent, dir); // the create did not happen
+                lsn = -1;
+            }
+        }
+        if (lsn < 0)
+        {
+            end_change(locked);
+            pthread_mutex_unlock(&parent->lock);
+            wal_end(wal, 0);
+            pthread_mutex_destroy(&dir->lock);
+            free(dir->name);
+            free(dir);
+            return NULL;
+        }
+        account_usage(parent, dir, 1);
+        mark_dirty(parent);
+        mark_dirty(dir);
+        end_change(locked);
+        pthread_mutex_unlock(&parent->lock);
+        wal_end(wal, lsn);
+    }
+    else
+    {
+        dir->id = next_inode_id();
+        mark_dirty(dir);
+    }
+
+    return dir;
+}
+
+struct inode *create_dir(struct inode *parent, char *name)
+{
+    uint64_t start = fs_now_ns();
+    struct inode *dir = make_dir(parent, name);
+    fs_op_done(FS_OP_CREATE_DIR, start, parent != NULL ? parent->id : -1);
+    return dir;
+}
+
+/* Check all the inodes that are directly referenced by
+ * the node parent. If one of them has the name "name",
+ * its inode pointer is returned.
+ * parent must be directory.
+ */
+static struct inode *find_by_name(struct inode *parent, char *name)
+{
+    /* gå gjennom hvert barn og sjekk navnet deres
+    returner peker til barn-inoden hvis funnet */
+    fs_count(FS_FIND_CALLS, 1);
+    if (parent == NULL)
+    {
+        return NULL;
+    }
+    if (parent->is_directory == 0)
+    {
+        return NULL;
+    }
+    if (fs_load_children(parent) != 0)
+    {
+        return NULL;
+    }
+    int num_children = parent->num_children;
+
+    struct inode *child = NULL;
+    for (int i = 0; i < num_children; i++)
+    {
+        child = parent->children[i];
+        char *childname = child->name;
+        if (strcmp(childname, name) == 0)
+        {
+            fs_count(FS_NAME_COMPARES, i + 1);
+            return parent->children[i];
+        }
+    }
+
+    fs_count(FS_NAME_COMPARES, num_children);
+    return NULL;
+}
+
+struct inode *find_inode_by_name(struct inode *parent, char *name)
+{
+    uint64_t start = fs_now_ns();
+    struct inode *node = find_by_name(parent, name);
+    fs_op_done(FS_OP_FIND_INODE_BY_NAME, start, parent != NULL ? parent->id : -1);
+    return node;
+}
+
+static int remove_file(struct inode *parent, struct inode *node)
+{
+    struct mft_mapping *wal = wal_begin(parent);
+    pthread_mutex_lock(&parent->lock);
+    int locked = begin_change(parent);
+    // a delete of a file that is not in parent is ignored by the replay
+    long lsn = locked < 0 ? -1 : wal_log(wal, WAL_DELETE, parent, node);
+    int retval = lsn < 0 ? -1 : remove_child_locked(parent, node);
+    int last = 0;
+    if (retval == 0)
+    {
+        account_usage(parent, node, -1);
+        mark_dirty(parent);
+        last = drop_from_live(parent, node);
+    }
+    end_change(locked);
+    pthread_mutex_unlock(&parent->lock);
+    // the blocks are only freed once the delete is on disk
+    wal_end(wal, lsn);
+    if (retval != 0)
+    {
+        return -1;
+    }
+    if (!last)
+    {
+        return 0; // a snapshot still has the file and its blocks
+    }
+
+    for (int i = 0; i < node->num_blocks; i++)
+    {
+        free_block(node->blocks[i]);
+    }
+    // a crash before this leaves the blocks allocated with no file, which fsck_fs reports
+    if (wal != NULL)
+    {
+        sync_blocks(node->blocks, node->num_blocks);
+    }
+
+    release_inode(node);
+    return 0;
+}
+
+int delete_file(struct inode *parent, struct inode *node)
+{
+    uint64_t start = fs_now_ns();
+    int id = node->id;
+    int retval = remove_file(parent, node);
+    fs_op_done(FS_OP_DELETE_FILE, start, id);
+    return retval;
+}
+
+static int remove_dir(struct inode *parent, struct inode *node)
+{
+    // lock order: parent before child
+    struct mft_mapping *wal = wal_begin(parent);
+    pthread_mutex_lock(&parent->lock);
+    pthread_mutex_lock(&node->lock);
+
+    int retval = -1;
+    int locked = -1;
+    int last = 0;
+    long lsn = 0;
+    if (load_children_locked(node) == 0 && node->num_children == 0 // a non-empty directory stays
+        && (locked = begin_change(parent)) >= 0
+        && (lsn = wal_log(wal, WAL_DELETE, parent, node)) >= 0)
+    {
+        retval = remove_child_locked(parent, node); // fails if node is not in parent
+    }
+    if (retval == 0)
+    {
+        account_usage(parent, node, -1);
+        mark_dirty(parent);
+        last = drop_from_live(parent, node);
+    }
+    end_change(locked);
+
+    pthread_mutex_unlock(&node->lock);
+    pthread_mutex_unlock(&parent->lock);
+    wal_end(wal, lsn);
+    if (retval != 0)
+    {
+        return -1;
+    }
+
+    if (last)
+    {
+        release_inode(node);
+    }
+    return 0;
+}
+
+int delete_dir(struct inode *parent, struct inode *node)
+{
+    uint64_t start = fs_now_ns();
+    int id = node->id;
+    int retval = remove_dir(parent, node);
+    fs_op_done(FS_OP_DELETE_DIR, start, id);
+    return retval;
+}
+
+/* Trees from load_inodes_lazy() only know where each record is until
+ * a directory is opened. entries[id] is the file offset of the record,
+ * except for directories of a version 1 table, which has no totals:
+ * there it is LAZY_DIR | n, and the offset and the totals that the
+ * scan summed up are in dirs[n].
+ */
+#define LAZY_DIR ((size_t)1 << (sizeof(size_t) * 8 - 1))
+#define LAZY_NONE ((size_t)-1)
+
+struct lazy_dir
+{
+    size_t offset;
+    struct fs_usage usage;
+};
+
+struct mft_lazy
+{
+    size_t *entries;
+    int num_entries;
+    struct lazy_dir *dirs;
+    int num_dirs;
+};
+
+/* A master file table that load_inodes() has mapped into memory.
+ * Names and block lists of the loaded inodes point into it, so it
+ * stays mapped until fs_shutdown() is called for its root.
+ * save_inodes() registers a mapping without addr for a tree that was
+ * not loaded, to remember the file it was saved to.
+ */
+struct mft_mapping
+{
+    struct inode *root;
+    void *addr;
+    size_t len;
+    int version;
+    struct mft_lazy *lazy; // NULL when the whole tree was loaded
+    int has_base;
+    struct mft_log_header base; // the file the tree matches, apart from dirty inodes
+    struct wal *wal;            // NULL unless fs_wal_open() was called
+    char *wal_table;            // the table the log belongs to
+    pthread_rwlock_t wal_lock;
+    uint64_t generation;        // of the table the tree matches, see mft_lock()
+    struct mft_mapping *next;
+};
+
+static struct mft_mapping *mappings = NULL;
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The number of trees with a write-ahead log, so that others skip the lookup.
+static atomic_int num_wals = 0;
+
+/* The version that save_inodes() writes. */
+static int mft_format = MFT_V1;
+
+void set_mft_format(int version)
+{
+    if (version != MFT_V1 && version != MFT_V2 && version != MFT_V3)
+    {
+        fprintf(stderr, "Unknown master file table version %d\n", version);
+        exit(-1);
+    }
+    mft_format = version;
+}
+
+/* Creates an inode for a decoded record. The name is used where it is
+ * in the mapped table, and so is the block list if it is stored as
+ * aligned size_t values. A directory gets no children here.
+ */
+static struct inode *inode_from_record(const struct mft_record *rec, struct inode *parent)
+{
+    struct inode *inode = calloc(1, sizeof(struct inode));
+    if (inode == NULL)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&inode->lock, NULL);
+    inode->parent = parent;
+    inode->id = rec->id;
+    inode->is_directory = rec->is_directory;
+    if (rec->transient)
+    {
+        // a version 3 record is decoded into memory that the next record reuses
+        inode->name = strdup(rec->name);
+        if (inode->name == NULL)
+        {
+            release_inode(inode);
+            return NULL;
+        }
+    }
+    else
+    {
+        inode->name = (char *)rec->name;
+        inode->flags = INODE_NAME_MAPPED;
+    }
+
+    if (inode->is_directory)
+    {
+        init_usage(inode);
+        if (rec->has_usage)
+        {
+            atomic_store(&inode->tree_files, rec->usage.files);
+            atomic_store(&inode->tree_dirs, rec->usage.dirs);
+            atomic_store(&inode->tree_bytes, rec->usage.bytes);
+            atomic_store(&inode->tree_blocks, rec->usage.blocks);
+        }
+        return inode;
+    }
+
+    inode->filesize = rec->filesize;
+    inode->num_blocks = rec->num_blocks;
+    if (rec->num_blocks == 0)
+    {
+        inode->blocks = NULL;
+    }
+    else if (!rec->transient && rec->block_size == sizeof(size_t) && (uintptr_t)rec->blocks % _Alignof(size_t) == 0)
+    {
+        inode->blocks = (size_t *)rec->blocks;
+        inode->flags |= INODE_BLOCKS_MAPPED;
+    }
+    else
+    {
+        inode->blocks = malloc(sizeof(size_t) * rec->num_blocks);
+        if (inode->blocks == NULL)
+        {
+            release_inode(inode);
+            return NULL;
+        }
+        for (int i = 0; i < rec->num_blocks; i++)
+        {
+            inode->blocks[i] = mft_block(rec, i);
+        }
+    }
+    init_usage(inode);
+    return inode;
+}
+
+/* Parses the inode at the cursor and, for a directory, all inodes
+ * below it. Returns NULL if the file is cut short or memory runs out.
+ */
+static struct inode *load_inodes_recursive(struct mft_cursor *cur, int version, struct inode *parent, int *max_id)
+{
+    struct mft_record rec;
+    if (mft_decode_record(cur, version, &rec) != 0)
+    {
+        return NULL;
+    }
+    if (rec.id > *max_id)
+    {
+        *max_id = rec.id;
+    }
+    struct inode *inode = inode_from_record(&rec, parent);
+    if (inode == NULL || rec.num_children == 0)
+    {
+        return inode;
+    }
+
+    inode->children = malloc(sizeof(struct inode *) * rec.num_children);
+    if (inode->children == NULL)
+    {
+        release_inode(inode);
+        return NULL;
+    }
+
+    // the totals are summed up on the way, even where the file has them
+    struct fs_usage usage = { 0, 1, 0, 0 };
+    for (int i = 0; i < rec.num_children; i++)
+    {
+        struct inode *child = load_inodes_recursive(cur, version, inode, max_id);
+        if (child == NULL)
+        {
+            fs_shutdown(inode);
+            return NULL;
+        }
+        inode->children[i] = child;
+        inode->num_children++;
+
+        struct fs_usage sub;
+        fs_usage(child, &sub);
+        usage.files += sub.files;
+        usage.dirs += sub.dirs;
+        usage.bytes += sub.bytes;
+        usage.blocks += sub.blocks;
+    }
+    atomic_store(&inode->tree_files, usage.files);
+    atomic_store(&inode->tree_dirs, usage.dirs);
+    atomic_store(&inode->tree_bytes, usage.bytes);
+    atomic_store(&inode->tree_blocks, usage.blocks);
+    return inode;
+}
+
+/* Maps the file read-only into a new mft_mapping and finds out its
+ * version. Returns NULL and prints a message if that fails.
+ */
+static struct mft_mapping *map_table(char *master_file_table)
+{
+    int fd = open(master_file_table, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to open file %s\n", master_file_table);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        fprintf(stderr, "File %s is empty\n", master_file_table);
+        close(fd);
+        return NULL;
+    }
+
+    struct mft_mapping *mapping = calloc(1, sizeof(struct mft_mapping));
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == NULL || addr == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map file %s\n", master_file_table);
+        if (addr != MAP_FAILED)
+            munmap(addr, st.st_size);
+        free(mapping);
+        return NULL;
+    }
+    mapping->addr = addr;
+    mapping->len = st.st_size;
+    mapping->has_base = mft_log_identify(master_file_table, &mapping->base) == 0;
+    mapping->version = mft_read_header(addr, st.st_size, NULL);
+    if (mapping->version < 0)
+    {
+        fprintf(stderr, "File %s has an unknown master file table header\n", master_file_table);
+        munmap(addr, st.st_size);
+        free(mapping);
+        return NULL;
+    }
+    return mapping;
+}
+
+static void unmap_table(struct mft_mapping *mapping)
+{
+    if (mapping->wal != NULL)
+    {
+        wal_close(mapping->wal);
+        free(mapping->wal_table);
+        pthread_rwlock_destroy(&mapping->wal_lock);
+        atomic_fetch_sub(&num_wals, 1);
+    }
+    if (mapping->addr != NULL)
+        munmap(mapping->addr, mapping->len);
+    if (mapping->lazy)
+    {
+        free(mapping->lazy->entries);
+        free(mapping->lazy->dirs);
+        free(mapping->lazy);
+    }
+    free(mapping);
+}
+
+/* Makes the mapping known to fs_shutdown() and the lazy loader, and
+ * makes sure new inodes get IDs above every ID in the file.
+ */
+static void register_table(struct mft_mapping *mapping, struct inode *root, int max_id)
+{
+    int lowest_unused = max_id + 1;
+    int current = atomic_load(&num_inode_ids);
+    while (current < lowest_unused && !atomic_compare_exchange_weak(&num_inode_ids, &current, lowest_unused))
+        ;
+
+    mapping->root = root;
+    pthread_mutex_lock(&mappings_lock);
+    mapping->next = mappings;
+    mappings = mapping;
+    pthread_mutex_unlock(&mappings_lock);
+}
+
+/* Returns the mapping that the tree of node was loaded from, or NULL. */
+static struct mft_mapping *mapping_of(struct inode *node)
+{
+    while (node->parent != NULL)
+    {
+        node = node->parent;
+    }
+    node = origin_of(node); // a snapshot reads what is still on disk through its live tree
+    pthread_mutex_lock(&mappings_lock);
+    struct mft_mapping *mapping = mappings;
+    while (mapping != NULL && mapping->root != node)
+    {
+        mapping = mapping->next;
+    }
+    pthread_mutex_unlock(&mappings_lock);
+    return mapping;
+}
+
+/* While a tree has a write-ahead log, create_* and delete_* hold the
+ * read lock of the log from before they lock any inode until their
+ * record is on disk. A checkpoint takes it for writing, so that every
+ * change is either in the saved tree and not in the new log, or not
+ * yet begun.
+ * Returns the mapping of the tree of dir with the lock held, or NULL if
+ * the tree has no log.
+ */
+static struct mft_mapping *wal_begin(struct inode *dir)
+{
+    if (dir == NULL || atomic_load(&num_wals) == 0)
+    {
+        return NULL;
+    }
+    struct inode *root = dir;
+    while (root->parent != NULL)
+    {
+        root = root->parent;
+    }
+    if (__atomic_load_n(&root->flags, __ATOMIC_RELAXED) & INODE_SNAPSHOT)
+    {
+        return NULL; // the log is the live tree's
+    }
+    struct mft_mapping *mapping = mapping_of(root);
+    if (mapping == NULL || mapping->wal == NULL)
+    {
+        return NULL;
+    }
+    pthread_rwlock_rdlock(&mapping->wal_lock);
+    return mapping;
+}
+
+/* Appends what is done to node in parent to the log of mapping. Called
+ * under the lock of parent, so the records of one directory are in the
+ * order of its changes. Returns what wal_end() has to sync, 0 if there
+ * is no log and -1 on failure.
+ */
+static long wal_log(struct mft_mapping *mapping, int op, struct inode *parent, struct inode *node)
+{
+    if (mapping == NULL)
+    {
+        return 0;
+    }
+    // replay takes the blocks of a create as allocated, so the table must show them before the record can
+    if (op == WAL_CREATE_FILE && sync_blocks(node->blocks, node->num_blocks) != 0)
+    {
+        fprintf(stderr, "Failed to sync the block allocation table\n");
+        return -1;
+    }
+    struct wal_op rec = { op, node->id, parent->id, node->name, node->filesize, node->num_blocks, node->blocks };
+    long lsn = wal_append(mapping->wal, &rec);
+    if (lsn < 0)
+    {
+        fprintf(stderr, "Failed to write to the write-ahead log\n");
+    }
+    return lsn;
+}
+
+// Waits until the log is on disk up to lsn and releases the read lock.
+static void wal_end(struct mft_mapping *mapping, long lsn)
+{
+    if (mapping == NULL)
+    {
+        return;
+    }
+    if (lsn > 0 && wal_sync(mapping->wal, lsn) != 0)
+    {
+        fprintf(stderr, "Failed to sync the write-ahead log\n");
+    }
+    pthread_rwlock_unlock(&mapping->wal_lock);
+}
+
+/* Set on a directory while its children array holds the child IDs
+ * from a log record instead of pointers.
+ */
+#define INODE_RELINK 64
+
+/* What replaying a delta log needs: every inode by ID, and the
+ * directories whose children came from the log.
+ */
+struct replay_state
+{
+    struct inode **by_id;
+    int num_ids;
+    struct inode **relink;
+    int num_relink;
+    int max_id;
+};
+
+static int grow_by_id(struct replay_state *rs, int id)
+{
+    if (id < rs->num_ids)
+    {
+        return 0;
+    }
+    int num = rs->num_ids ? rs->num_ids : 1024;
+    while (num <= id)
+        num *= 2;
+    struct inode **by_id = realloc(rs->by_id, num * sizeof(struct inode *));
+    if (by_id == NULL)
+    {
+        return -1;
+    }
+    memset(by_id + rs->num_ids, 0, (num - rs->num_ids) * sizeof(struct inode *));
+    rs->by_id = by_id;
+    rs->num_ids = num;
+    return 0;
+}
+
+static int index_tree(struct replay_state *rs, struct inode *node)
+{
+    if (node->id < 0 || node->id > rs->max_id)
+    {
+        return -1;
+    }
+    rs->by_id[node->id] = node;
+    for (int i = 0; i < node->num_children; i++)
+    {
+        if (index_tree(rs, node->children[i]) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Creates or updates the inode of a log record. Names and block lists
+ * are copied, since the log is unmapped after the replay. A directory
+ * keeps the child IDs until relink_children().
+ */
+static int apply_record(const struct mft_record *rec, void *arg)
+{
+    struct replay_state *rs = arg;
+    if (rec->id < 0 || grow_by_id(rs, rec->id) != 0)
+    {
+        return -1;
+    }
+    struct inode *node = rs->by_id[rec->id];
+    if (node == NULL)
+    {
+        node = calloc(1, sizeof(struct inode));
+        if (node == NULL)
+        {
+            return -1;
+        }
+        pthread_mutex_init(&node->lock, NULL);
+        node->id = rec->id;
+        node->is_directory = rec->is_directory;
+        rs->by_id[rec->id] = node;
+    }
+    else if (node->is_directory != rec->is_directory)
+    {
+        return -1;
+    }
+    if (rec->id > rs->max_id)
+    {
+        rs->max_id = rec->id;
+    }
+
+    if (node->name == NULL || strcmp(node->name, rec->name) != 0)
+    {
+        char *name = strdup(rec->name);
+        if (name == NULL)
+        {
+            return -1;
+        }
+        if (!(node->flags & INODE_NAME_MAPPED))
+            free(node->name);
+        node->name = name;
+        node->flags &= ~INODE_NAME_MAPPED;
+    }
+
+    if (node->is_directory)
+    {
+        struct inode **children = NULL;
+        if (rec->num_children > 0)
+        {
+            children = malloc(rec->num_children * sizeof(struct inode *));
+            if (children == NULL)
+            {
+                return -1;
+            }
+        }
+        for (int i = 0; i < rec->num_children; i++)
+        {
+            children[i] = (struct inode *)(intptr_t)mft_child_id(rec, i);
+        }
+        free(node->children);
+        node->children = children;
+        node->num_children = rec->num_children;
+        if (!(node->flags & INODE_RELINK))
+        {
+            struct inode **relink = realloc(rs->relink, (rs->num_relink + 1) * sizeof(struct inode *));
+            if (relink == NULL)
+            {
+                return -1;
+            }
+            rs->relink = relink;
+            rs->relink[rs->num_relink++] = node;
+            node->flags |= INODE_RELINK;
+        }
+        return 0;
+    }
+
+    size_t *blocks = NULL;
+    if (rec->num_blocks > 0)
+    {
+        blocks = malloc(rec->num_blocks * sizeof(size_t));
+        if (blocks == NULL)
+        {
+            return -1;
+        }
+    }
+    for (int i = 0; i < rec->num_blocks; i++)
+    {
+        blocks[i] = mft_block(rec, i);
+    }
+    if (!(node->flags & INODE_BLOCKS_MAPPED))
+        free(node->blocks);
+    node->blocks = blocks;
+    node->flags &= ~INODE_BLOCKS_MAPPED;
+    node->filesize = rec->filesize;
+    node->num_blocks = rec->num_blocks;
+    return 0;
+}
+
+/* Turns the child IDs of the directories from the log into pointers. */
+static int relink_children(struct replay_state *rs)
+{
+    int retval = 0;
+    for (int i = 0; i < rs->num_relink; i++)
+    {
+        struct inode *dir = rs->relink[i];
+        int num = 0;
+        for (int j = 0; j < dir->num_children; j++)
+        {
+            intptr_t id = (intptr_t)dir->children[j];
+            struct inode *child = id >= 0 && id < rs->num_ids ? rs->by_id[id] : NULL;
+            if (child == NULL)
+            {
+                retval = -1; // a child without a record; leave it out
+                continue;
+            }
+            child->parent = dir;
+            dir->children[num++] = child;
+        }
+        dir->num_children = num;
+        dir->flags &= ~INODE_RELINK;
+    }
+    return retval;
+}
+
+static void mark_reachable(struct inode *node, char *reachable)
+{
+    if (reachable[node->id])
+        return;
+    reachable[node->id] = 1;
+    for (int i = 0; i < node->num_children; i++)
+    {
+        mark_reachable(node->children[i], reachable);
+    }
+}
+
+/* Sets the totals of every directory from those of its children. */
+static void sum_usage(struct inode *node)
+{
+    init_usage(node);
+    if (!node->is_directory)
+    {
+        return;
+    }
+    for (int i = 0; i < node->num_children; i++)
+    {
+        sum_usage(node->children[i]);
+        atomic_fetch_add(&node->tree_files, atomic_load(&node->children[i]->tree_files));
+        atomic_fetch_add(&node->tree_dirs, atomic_load(&node->children[i]->tree_dirs));
+        atomic_fetch_add(&node->tree_bytes, atomic_load(&node->children[i]->tree_bytes));
+        atomic_fetch_add(&node->tree_blocks, atomic_load(&node->children[i]->tree_blocks));
+    }
+}
+
+/* Applies the delta log of master_file_table to the tree just loaded
+ * from it. Inodes that no directory refers to any more were deleted
+ * and are freed. Returns 0 on success, also when there is no log, and
+ * -1 if the log could not be applied.
+ */
+static int replay_log(char *master_file_table, struct inode *root, int *max_id)
+{
+    if (!mft_log_exists(master_file_table))
+    {
+        return 0;
+    }
+
+    struct replay_state rs;
+    memset(&rs, 0, sizeof(rs));
+    rs.max_id = *max_id;
+    if (grow_by_id(&rs, *max_id) != 0 || index_tree(&rs, root) != 0)
+    {
+        free(rs.by_id);
+        return -1;
+    }
+
+    long num = mft_log_replay(master_file_table, apply_record, &rs);
+    int retval = num < 0 ? -1 : 0;
+    if (relink_children(&rs) != 0)
+    {
+        retval = -1;
+    }
+    if (num != 0)
+    {
+        char *reachable = calloc(rs.num_ids, 1);
+        if (reachable == NULL)
+        {
+            retval = -1;
+        }
+        else
+        {
+            mark_reachable(root, reachable);
+            for (int id = 0; id < rs.num_ids; id++)
+            {
+                if (rs.by_id[id] != NULL && !reachable[id])
+                {
+                    release_inode(rs.by_id[id]);
+                }
+            }
+            free(reachable);
+        }
+        sum_usage(root);
+        *max_id = rs.max_id;
+    }
+    free(rs.by_id);
+    free(rs.relink);
+    return retval;
+}
+
+/* Sets the totals of dir from those of its children, which have theirs. */
+static void sum_usage_shallow(struct inode *dir)
+{
+    init_usage(dir);
+    for (int i = 0; i < dir->num_children; i++)
+    {
+        account_usage(dir, dir->children[i], 1);
+    }
+}
+
+/* Redoes a create or delete from the write-ahead log. The blocks of the
+ * file are already allocated or freed in the block allocation table.
+ */
+static int apply_wal_op(const struct wal_op *op, void *arg)
+{
+    struct replay_state *rs = arg;
+    if (op->id < 0 || op->parent_id < 0 || grow_by_id(rs, op->id) != 0 || grow_by_id(rs, op->parent_id) != 0)
+    {
+        return -1;
+    }
+    struct inode *parent = rs->by_id[op->parent_id];
+    struct inode *node = rs->by_id[op->id];
+
+    if (op->op == WAL_DELETE)
+    {
+        // a delete that failed, such as of an inode that was not in parent, was logged all the same
+        if (parent == NULL || node == NULL || node->num_children > 0 || remove_child_locked(parent, node) != 0)
+        {
+            return 0;
+        }
+        account_usage(parent, node, -1);
+        mark_dirty(parent);
+        rs->by_id[op->id] = NULL;
+        release_inode(node);
+        return 0;
+    }
+
+    if ((op->op != WAL_CREATE_FILE && op->op != WAL_CREATE_DIR) || parent == NULL || !parent->is_directory
+        || node != NULL || op->num_blocks < 0 || (op->op == WAL_CREATE_DIR && op->num_blocks > 0))
+    {
+        return -1;
+    }
+    node = calloc(1, sizeof(struct inode));
+    if (node == NULL)
+    {
+        return -1;
+    }
+    pthread_mutex_init(&node->lock, NULL);
+    node->id = op->id;
+    node->is_directory = op->op == WAL_CREATE_DIR;
+    node->filesize = op->filesize;
+    node->parent = parent;
+    node->name = strdup(op->name);
+    if (op->num_blocks > 0 && (node->blocks = malloc(op->num_blocks * sizeof(size_t))) != NULL)
+    {
+        memcpy(node->blocks, op->blocks, op->num_blocks * sizeof(size_t));
+        node->num_blocks = op->num_blocks;
+    }
+    init_usage(node);
+    if (node->name == NULL || node->num_blocks != op->num_blocks || add_child_locked(parent, node) != 0)
+    {
+        release_inode(node);
+        return -1;
+    }
+    account_usage(parent, node, 1);
+    mark_dirty(parent);
+    mark_dirty(node);
+    rs->by_id[op->id] = node;
+    if (op->id > rs->max_id)
+    {
+        rs->max_id = op->id;
+    }
+    return 0;
+}
+
+/* Replays the write-ahead log of master_file_table, if it belongs to the
+ * table and its delta log as they are now, over the tree of root. The
+ * inodes it changes are dirty, so the next save writes them.
+ */
+static int replay_wal(char *master_file_table, struct inode *root, int *max_id)
+{
+    if (!wal_exists(master_file_table))
+    {
+        return 0;
+    }
+
+    struct replay_state rs;
+    memset(&rs, 0, sizeof(rs));
+    rs.max_id = *max_id;
+    if (grow_by_id(&rs, *max_id) != 0 || index_tree(&rs, root) != 0)
+    {
+        free(rs.by_id);
+        return -1;
+    }
+    long num = wal_replay(master_file_table, apply_wal_op, &rs);
+    *max_id = rs.max_id;
+    free(rs.by_id);
+    return num < 0 ? -1 : 0;
+}
+
+/* The common end of the eager loaders: replays the delta log and the
+ * write-ahead log over the tree that was parsed from mapping, or cleans
+ * up if there is none.
+ */
+static struct inode *finish_load(char *master_file_table, struct mft_mapping *mapping, struct inode *root, int max_id)
+{
+    if (root == NULL)
+    {
+        fprintf(stderr, "File %s is not a valid master file table\n", master_file_table);
+        unmap_table(mapping);
+        return NULL;
+    }
+    if (replay_log(master_file_table, root, &max_id) != 0)
+    {
+        fprintf(stderr, "The delta log of %s is not valid\n", master_file_table);
+        fs_shutdown(root);
+        unmap_table(mapping);
+        return NULL;
+    }
+    if (replay_wal(master_file_table, root, &max_id) != 0)
+    {
+        fprintf(stderr, "The write-ahead log of %s is not valid\n", master_file_table);
+        fs_shutdown(root);
+        unmap_table(mapping);
+        return NULL;
+    }
+
+    register_table(mapping, root, max_id);
+    return root;
+}
+
+/* Parses a table that map_table() has mapped, from its first record. */
+static struct inode *load_mapped(char *master_file_table, struct mft_mapping *mapping)
+{
+    madvise(mapping->addr, mapping->len, MADV_SEQUENTIAL);
+
+    struct mft_cursor cur = { mapping->addr, mapping->len, mft_first_record(mapping->version), NULL };
+    if (mapping->version == MFT_V3 && (cur.ctx = mft_context_new()) == NULL)
+    {
+        return finish_load(master_file_table, mapping, NULL, -1);
+    }
+    int max_id = -1;
+    struct inode *root = load_inodes_recursive(&cur, mapping->version, NULL, &max_id);
+    mft_context_free(cur.ctx);
+    return finish_load(master_file_table, mapping, root, max_id);
+}
+
+/* Read the file master_file_table and create an inode in memory
+ * for every inode that is stored in the file. Set the pointers
+ * between inodes correctly.
+ * The file master_file_table remains unchanged.
+ *
+ * The file is mapped into memory and parsed from there, which saves
+ * a system call per field and a malloc per name and block list.
+ */
+static struct inode *load_whole(char *master_file_table)
+{
+    struct mft_mapping *mapping = map_table(master_file_table);
+    if (mapping == NULL)
+    {
+        return NULL;
+    }
+    return load_mapped(master_file_table, mapping);
+}
+
+/* Counts a load or save that started at start, for fs_stats(). */
+static void count_time(enum fs_counter calls, enum fs_counter ns, uint64_t start)
+{
+    fs_count(calls, 1);
+    fs_count(ns, fs_now_ns() - start);
+}
+
+/* Records that the tree of root matches the given generation of the
+ * table it was loaded from or saved to.
+ */
+static void set_generation(struct inode *root, uint64_t generation)
+{
+    struct mft_mapping *mapping = root != NULL && !(root->flags & INODE_SNAPSHOT) ? mapping_of(root) : NULL;
+    if (mapping != NULL)
+    {
+        mapping->generation = generation;
+    }
+}
+
+struct inode *load_inodes(char *master_file_table)
+{
+    uint64_t start = fs_now_ns();
+    int lock = mft_lock(master_file_table, 0);
+    uint64_t generation = mft_generation(master_file_table, lock);
+    struct inode *root = load_whole(master_file_table);
+    mft_unlock(lock, 0);
+    set_generation(root, generation);
+    count_time(FS_LOADS, FS_LOAD_NS, start);
+    fs_op_done(FS_OP_LOAD_INODES, start, root != NULL ? root->id : -1);
+    return root;
+}
+
+/* One worker of load_inodes_parallel(). Workers take the next child of
+ * the root that nobody has taken yet, so a few large subtrees do not
+ * leave the other threads idle.
+ */
+struct parallel_load
+{
+    struct mft_mapping *mapping;
+    struct inode *root;
+    const size_t *offsets; // where the record of each child of the root starts
+    const int *ids;
+    atomic_int next;
+    atomic_int failed;
+};
+
+struct parallel_worker
+{
+    struct parallel_load *load;
+    int max_id;
+    pthread_t thread;
+};
+
+static void *parallel_load_worker(void *arg)
+{
+    struct parallel_worker *worker = arg;
+    struct parallel_load *load = worker->load;
+    struct mft_mapping *mapping = load->mapping;
+
+    for (;;)
+    {
+        int i = atomic_fetch_add(&load->next, 1);
+        if (i >= load->root->num_children || atomic_load(&load->failed))
+        {
+            break;
+        }
+        struct mft_cursor cur = { mapping->addr, mapping->len, load->offsets[i], NULL };
+        struct inode *child = load_inodes_recursive(&cur, mapping->version, load->root, &worker->max_id);
+        load->root->children[i] = child;
+        if (child == NULL || child->id != load->ids[i])
+        {
+            atomic_store(&load->failed, 1);
+        }
+    }
+    return NULL;
+}
+
+/* Finds where the subtree of every child of the root starts. A version
+ * 2 table has that in its offset table; a version 1 table is skimmed,
+ * which decodes the fixed part of each record but allocates nothing.
+ */
+static int find_subtrees(struct mft_mapping *mapping, const struct mft_record *root, struct mft_cursor *cur,
+                         size_t *offsets, int *ids)
+{
+    struct mft_header header;
+    if (mapping->version == MFT_V2)
+    {
+        mft_read_header(mapping->addr, mapping->len, &header);
+    }
+    for (int i = 0; i < root->num_children; i++)
+    {
+        ids[i] = mft_child_id(root, i);
+        if (mapping->version == MFT_V2)
+        {
+            if (ids[i] < 0 || ids[i] > header.max_id)
+            {
+                return -1;
+            }
+            offsets[i] = mft_table_entry(&header, (char *)mapping->addr + header.table_offset, ids[i]);
+            continue;
+        }
+        offsets[i] = cur->pos;
+        for (int remaining = 1; remaining > 0; remaining--)
+        {
+            struct mft_record rec;
+            if (mft_decode_record(cur, mapping->version, &rec) != 0)
+            {
+                return -1;
+            }
+            remaining += rec.num_children;
+        }
+    }
+    return 0;
+}
+
+static struct inode *load_parallel(char *master_file_table, int num_threads)
+{
+    if (num_threads <= 0)
+    {
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_threads <= 0)
+            num_threads = 1;
+    }
+    if (num_threads == 1 || mft_log_exists(master_file_table) || wal_exists(master_file_table))
+    {
+        return load_whole(master_file_table);
+    }
+
+    struct mft_mapping *mapping = map_table(master_file_table);
+    if (mapping == NULL)
+    {
+        return NULL;
+    }
+    // a version 3 table can only be read from the start
+    if (mapping->version == MFT_V3)
+    {
+        return load_mapped(master_file_table, mapping);
+    }
+    madvise(mapping->addr, mapping->len, MADV_WILLNEED);
+
+    struct mft_cursor cur = { mapping->addr, mapping->len, mft_first_record(mapping->version), NULL };
+    struct mft_record rec;
+    struct inode *root = NULL;
+    if (mft_decode_record(&cur, mapping->version, &rec) == 0)
+    {
+        root = inode_from_record(&rec, NULL);
+    }
+    if (root == NULL || rec.num_children == 0)
+    {
+        return finish_load(master_file_table, mapping, root, root ? rec.id : -1);
+    }
+
+    struct parallel_load load;
+    load.mapping = mapping;
+    load.root = root;
+    atomic_init(&load.next, 0);
+    atomic_init(&load.failed, 0);
+    size_t *offsets = malloc(rec.num_children * sizeof(size_t));
+    int *ids = malloc(rec.num_children * sizeof(int));
+    root->children = calloc(rec.num_children, sizeof(struct inode *));
+    if (num_threads > rec.num_children)
+    {
+        num_threads = rec.num_children;
+    }
+    struct parallel_worker *workers = calloc(num_threads, sizeof(struct parallel_worker));
+    if (offsets == NULL || ids == NULL || root->children == NULL || workers == NULL
+        || find_subtrees(mapping, &rec, &cur, offsets, ids) != 0)
+    {
+        atomic_store(&load.failed, 1);
+    }
+    load.offsets = offsets;
+    load.ids = ids;
+    root->num_children = rec.num_children;
+
+    // the calling thread is the first worker
+    int started = 1;
+    for (int t = 0; t < num_threads && !atomic_load(&load.failed); t++)
+    {
+        workers[t].load = &load;
+        workers[t].max_id = rec.id;
+        if (t > 0)
+        {
+            // with fewer threads than asked for the others just take more subtrees
+            if (pthread_create(&workers[t].thread, NULL, parallel_load_worker, &workers[t]) != 0)
+                break;
+            started++;
+        }
+    }
+    int max_id = rec.id;
+    if (!atomic_load(&load.failed))
+    {
+        parallel_load_worker(&workers[0]);
+        for (int t = 1; t < started; t++)
+        {
+            pthread_join(workers[t].thread, NULL);
+        }
+        for (int t = 0; t < started; t++)
+        {
+            if (workers[t].max_id > max_id)
+                max_id = workers[t].max_id;
+        }
+    }
+    free(workers);
+    free(offsets);
+    free(ids);
+
+    if (atomic_load(&load.failed))
+    {
+        // children that were not loaded are NULL, drop them before freeing the rest
+        int num = 0;
+        for (int i = 0; root->children != NULL && i < root->num_children; i++)
+        {
+            if (root->children[i] != NULL)
+                root->children[num++] = root->children[i];
+        }
+        root->num_children = num;
+        fs_shutdown(root);
+        return finish_load(master_file_table, mapping, NULL, -1);
+    }
+    sum_usage_shallow(root);
+    return finish_load(master_file_table, mapping, root, max_id);
+}
+
+struct inode *load_inodes_parallel(char *master_file_table, int num_threads)
+{
+    uint64_t start = fs_now_ns();
+    int lock = mft_lock(master_file_table, 0);
+    uint64_t generation = mft_generation(master_file_table, lock);
+    struct inode *root = load_parallel(master_file_table, num_threads);
+    mft_unlock(lock, 0);
+    set_generation(root, generation);
+    count_time(FS_LOADS, FS_LOAD_NS, start);
+    fs_op_done(FS_OP_LOAD_INODES_PARALLEL, start, root != NULL ? root->id : -1);
+    return root;
+}
+
+struct inode *fs_refresh(char *master_file_table, struct inode *root)
+{
+    struct mft_mapping *mapping = root != NULL ? mapping_of(root) : NULL;
+    if (mapping == NULL || root->parent != NULL || (root->flags & (INODE_SNAPSHOT | INODE_DIRTY | INODE_DIRTY_BELOW))
+        || mapping->wal != NULL || mft_generation(master_file_table, -1) == mapping->generation)
+    {
+        return root;
+    }
+    struct inode *fresh = mapping->lazy != NULL ? load_inodes_lazy(master_file_table) : load_inodes(master_file_table);
+    if (fresh != NULL)
+    {
+        fs_shutdown(root);
+    }
+    return fresh;
+}
+
+int fs_lock_table(char *master_file_table)
+{
+    return mft_lock(master_file_table, 1);
+}
+
+void fs_unlock_table(int lock)
+{
+    mft_unlock(lock, 1);
+}
+
+static int grow_entries(struct mft_lazy *lazy, int id)
+{
+    if (id < lazy->num_entries)
+    {
+        return 0;
+    }
+    int num = lazy->num_entries ? lazy->num_entries : 1024;
+    while (num <= id)
+        num *= 2;
+    size_t *entries = realloc(lazy->entries, num * sizeof(size_t));
+    if (entries == NULL)
+    {
+        return -1;
+    }
+    for (int i = lazy->num_entries; i < num; i++)
+        entries[i] = LAZY_NONE;
+    lazy->entries = entries;
+    lazy->num_entries = num;
+    return 0;
+}
+
+/* Builds the ID -> offset index of a version 1 table in one pass. The
+ * records are in depth-first order, so a stack of the open directories
+ * is enough to sum up the totals of every subtree.
+ */
+static struct mft_lazy *scan_index(struct mft_cursor *cur, int *max_id)
+{
+    struct mft_lazy *lazy = calloc(1, sizeof(struct mft_lazy));
+    int *stack = NULL;       // indexes into lazy->dirs
+    int *remaining = NULL;   // children of stack[i] not yet complete
+    int depth = 0, stack_cap = 0, dirs_cap = 0;
+    if (lazy == NULL)
+    {
+        return NULL;
+    }
+
+    do
+    {
+        size_t offset = cur->pos;
+        struct mft_record rec;
+        if (mft_decode_record(cur, MFT_V1, &rec) != 0 || rec.id < 0 || grow_entries(lazy, rec.id) != 0)
+        {
+            goto fail;
+        }
+        if (rec.id > *max_id)
+        {
+            *max_id = rec.id;
+        }
+
+        struct fs_usage done;
+        if (rec.is_directory)
+        {
+            if (lazy->num_dirs == dirs_cap)
+            {
+                dirs_cap = dirs_cap ? dirs_cap * 2 : 256;
+                struct lazy_dir *dirs = realloc(lazy->dirs, dirs_cap * sizeof(struct lazy_dir));
+                if (dirs == NULL)
+                    goto fail;
+                lazy->dirs = dirs;
+            }
+            int n = lazy->num_dirs++;
+            struct lazy_dir *dir = &lazy->dirs[n];
+            dir->offset = offset;
+            dir->usage = (struct fs_usage){ 0, 1, 0, 0 };
+            lazy->entries[rec.id] = LAZY_DIR | n;
+
+            if (rec.num_children > 0)
+            {
+                if (depth == stack_cap)
+                {
+                    stack_cap = stack_cap ? stack_cap * 2 : 64;
+                    int *s = realloc(stack, stack_cap * sizeof(int));
+                    if (s == NULL)
+                        goto fail;
+                    stack = s;
+                    int *r = realloc(remaining, stack_cap * sizeof(int));
+                    if (r == NULL)
+                        goto fail;
+                    remaining = r;
+                }
+                stack[depth] = n;
+                remaining[depth] = rec.num_children;
+                depth++;
+                continue;
+            }
+            done = dir->usage;
+        }
+        else
+        {
+            lazy->entries[rec.id] = offset;
+            done = (struct fs_usage){ 1, 0, rec.filesize, rec.num_blocks };
+        }
+
+        // a record without children completes its parent, and so on upwards
+        while (depth > 0)
+        {
+            struct lazy_dir *top = &lazy->dirs[stack[depth - 1]];
+            top->usage.files += done.files;
+            top->usage.dirs += done.dirs;
+            top->usage.bytes += done.bytes;
+            top->usage.blocks += done.blocks;
+            if (--remaining[depth - 1] > 0)
+                break;
+            done = top->usage;
+            depth--;
+        }
+    } while (depth > 0);
+
+    free(stack);
+    free(remaining);
+    return lazy;
+
+fail:
+    free(stack);
+    free(remaining);
+    free(lazy->entries);
+    free(lazy->dirs);
+    free(lazy);
+    return NULL;
+}
+
+/* A version 2 table already has the index, it only has to be copied. */
+static struct mft_lazy *read_index(struct mft_mapping *mapping, const struct mft_header *header)
+{
+    struct mft_lazy *lazy = calloc(1, sizeof(struct mft_lazy));
+    if (lazy == NULL)
+    {
+        return NULL;
+    }
+    if (grow_entries(lazy, header->max_id) != 0)
+    {
+        free(lazy);
+        return NULL;
+    }
+    const char *table = (const char *)mapping->addr + header->table_offset;
+    for (int i = 0; i <= header->max_id; i++)
+    {
+        uint64_t offset = mft_table_entry(header, table, i);
+        lazy->entries[i] = (offset == 0 || offset >= mapping->len) ? LAZY_NONE : offset;
+    }
+    return lazy;
+}
+
+/* Returns the offset of the record of id in a lazy tree, or LAZY_NONE. */
+static size_t lazy_offset(struct mft_lazy *lazy, int id)
+{
+    if (id < 0 || id >= lazy->num_entries || lazy->entries[id] == LAZY_NONE)
+    {
+        return LAZY_NONE;
+    }
+    size_t entry = lazy->entries[id];
+    return (entry & LAZY_DIR) ? lazy->dirs[entry & ~LAZY_DIR].offset : entry;
+}
+
+/* Parses the record of a directory or file that load_inodes_lazy() has
+ * not loaded yet. A directory comes back with its children still
+ * on disk and INODE_CHILDREN_PENDING set.
+ */
+static struct inode *load_lazy_record(struct mft_mapping *mapping, int id, struct inode *parent)
+{
+    size_t offset = lazy_offset(mapping->lazy, id);
+    if (offset == LAZY_NONE)
+    {
+        return NULL;
+    }
+
+    struct mft_cursor cur = { mapping->addr, mapping->len, offset, NULL };
+    struct mft_record rec;
+    if (mft_decode_record(&cur, mapping->version, &rec) != 0 || rec.id != id)
+    {
+        return NULL;
+    }
+    struct inode *inode = inode_from_record(&rec, parent);
+    if (inode != NULL && inode->is_directory)
+    {
+        size_t entry = mapping->lazy->entries[id];
+        if (entry & LAZY_DIR)
+        {
+            struct lazy_dir *dir = &mapping->lazy->dirs[entry & ~LAZY_DIR];
+            atomic_store(&inode->tree_files, dir->usage.files);
+            atomic_store(&inode->tree_dirs, dir->usage.dirs);
+            atomic_store(&inode->tree_bytes, dir->usage.bytes);
+            atomic_store(&inode->tree_blocks, dir->usage.blocks);
+        }
+        inode->flags |= INODE_CHILDREN_PENDING;
+    }
+    return inode;
+}
+
+/* Loads the children of a directory from a lazy tree. dir->lock must
+ * be held. Returns 0 on success and -1 on failure.
+ */
+static int load_children_locked(struct inode *dir)
+{
+    if (!(__atomic_load_n(&dir->flags, __ATOMIC_ACQUIRE) & INODE_CHILDREN_PENDING))
+    {
+        return 0;
+    }
+
+    struct mft_mapping *mapping = mapping_of(dir);
+    if (mapping == NULL || mapping->lazy == NULL)
+    {
+        return -1;
+    }
+
+    // the record is read again for its child IDs
+    struct mft_cursor cur = { mapping->addr, mapping->len, lazy_offset(mapping->lazy, dir->id), NULL };
+    struct mft_record rec;
+    if (cur.pos == LAZY_NONE || mft_decode_record(&cur, mapping->version, &rec) != 0)
+    {
+        return -1;
+    }
+
+    struct inode **children = malloc(sizeof(struct inode *) * rec.num_children);
+    if (rec.num_children > 0 && children == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < rec.num_children; i++)
+    {
+        children[i] = load_lazy_record(mapping, mft_child_id(&rec, i), dir);
+        if (children[i] == NULL)
+        {
+            while (i-- > 0)
+                release_inode(children[i]);
+            free(children);
+            return -1;
+        }
+    }
+
+    dir->children = children;
+    dir->num_children = rec.num_children;
+    __atomic_and_fetch(&dir->flags, ~INODE_CHILDREN_PENDING, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int fs_load_children(struct inode *dir)
+{
+    if (dir == NULL || !(__atomic_load_n(&dir->flags, __ATOMIC_ACQUIRE) & INODE_CHILDREN_PENDING))
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&dir->lock);
+    int retval = load_children_locked(dir);
+    pthread_mutex_unlock(&dir->lock);
+    return retval;
+}
+
+static struct inode *load_lazy(char *master_file_table)
+{
+    // the changes in a log can be anywhere in the tree
+    if (mft_log_exists(master_file_table) || wal_exists(master_file_table))
+    {
+        return load_whole(master_file_table);
+    }
+
+    struct mft_mapping *mapping = map_table(master_file_table);
+    if (mapping == NULL)
+    {
+        return NULL;
+    }
+    if (mapping->version == MFT_V3)
+    {
+        return load_mapped(master_file_table, mapping);
+    }
+
+    // a version 2 table has the index and the totals, a version 1 table is scanned for them
+    struct mft_header header;
+    int max_id = -1;
+    if (mapping->version == MFT_V2)
+    {
+        mft_read_header(mapping->addr, mapping->len, &header);
+        mapping->lazy = read_index(mapping, &header);
+        max_id = header.max_id;
+    }
+    else
+    {
+        struct mft_cursor cur = { mapping->addr, mapping->len, 0, NULL };
+        mapping->lazy = scan_index(&cur, &max_id);
+    }
+
+    struct inode *root = NULL;
+    if (mapping->lazy != NULL)
+    {
+        int root_id; // the first record is the root
+        memcpy(&root_id, (char *)mapping->addr + mft_first_record(mapping->version), sizeof(int));
+        root = load_lazy_record(mapping, root_id, NULL);
+    }
+    if (root == NULL)
+    {
+        fprintf(stderr, "File %s is not a valid master file table\n", master_file_table);
+        unmap_table(mapping);
+        return NULL;
+    }
+    madvise(mapping->addr, mapping->len, MADV_RANDOM);
+
+    register_table(mapping, root, max_id);
+    return root;
+}
+
+struct inode *load_inodes_lazy(char *master_file_table)
+{
+    uint64_t start = fs_now_ns();
+    int lock = mft_lock(master_file_table, 0);
+    uint64_t generation = mft_generation(master_file_table, lock);
+    struct inode *root = load_lazy(master_file_table);
+    mft_unlock(lock, 0);
+    set_generation(root, generation);
+    count_time(FS_LOADS, FS_LOAD_NS, start);
+    fs_op_done(FS_OP_LOAD_INODES_LAZY, start, root != NULL ? root->id : -1);
+    return root;
+}
+
+/* What save_inodes() needs while it walks the tree: the buffer the
+ * table is built in, and for version 2 the offset of every record.
+ */
+struct save_state
+{
+    struct mft_buffer buf;
+    int version;
+    struct mft_mapping *mapping;
+    uint64_t *offsets;
+    int num_offsets;
+    int max_id;
+    uint32_t count;
+    int *child_ids;
+    int child_ids_cap;
+};
+
+static void note_record(struct save_state *st, int id, size_t offset)
+{
+    st->count++;
+    if (id > st->max_id)
+    {
+        st->max_id = id;
+    }
+    if (st->version != MFT_V2 || id < 0)
+    {
+        return;
+    }
+    if (id >= st->num_offsets)
+    {
+        int num = st->num_offsets ? st->num_offsets : 1024;
+        while (num <= id)
+            num *= 2;
+        uint64_t *offsets = realloc(st->offsets, num * sizeof(uint64_t));
+        if (offsets == NULL)
+        {
+            st->buf.failed = 1;
+            return;
+        }
+        memset(offsets + st->num_offsets, 0, (num - st->num_offsets) * sizeof(uint64_t));
+        st->offsets = offsets;
+        st->num_offsets = num;
+    }
+    st->offsets[id] = offset;
+}
+
+/* Copies the records of a directory that was never opened, and all
+ * records below it, from the table it was loaded from.
+ */
+static void copy_pending(struct save_state *st, struct inode *node)
+{
+    struct mft_mapping *mapping = st->mapping;
+    size_t start = lazy_offset(mapping->lazy, node->id);
+    struct mft_cursor cur = { mapping->addr, mapping->len, start, NULL };
+    size_t base = st->buf.len;
+
+    for (int remaining = 1; remaining > 0; remaining--)
+    {
+        size_t offset = cur.pos;
+        struct mft_record rec;
+        if (mft_decode_record(&cur, mapping->version, &rec) != 0)
+        {
+            st->buf.failed = 1;
+            return;
+        }
+        note_record(st, rec.id, base + (offset - start));
+        remaining += rec.num_children;
+    }
+    mft_put(&st->buf, (char *)mapping->addr + start, cur.pos - start);
+}
+
+/* Appends the record of node alone to the buffer. */
+static void encode_inode(struct save_state *st, struct inode *node)
+{
+    struct mft_record rec;
+    rec.id = node->id;
+    rec.name = node->name;
+    rec.name_len = strlen(node->name);
+    rec.is_directory = node->is_directory;
+    rec.num_children = 0;
+    rec.child_ids = NULL;
+    rec.child_id_size = sizeof(int);
+    rec.filesize = node->filesize;
+    rec.num_blocks = 0;
+    rec.blocks = NULL;
+    rec.block_size = sizeof(size_t);
+    rec.has_usage = 0;
+
+    if (node->flags & INODE_CHILDREN_PENDING)
+    {
+        st->buf.failed = 1; // its children are not in memory, and the record would drop them
+        return;
+    }
+    if (node->is_directory)
+    {
+        if (node->num_children > st->child_ids_cap)
+        {
+            int *ids = realloc(st->child_ids, node->num_children * sizeof(int));
+            if (ids == NULL)
+            {
+                st->buf.failed = 1;
+                return;
+            }
+            st->child_ids = ids;
+            st->child_ids_cap = node->num_children;
+        }
+        for (int i = 0; i < node->num_children; i++)
+        {
+            st->child_ids[i] = node->children[i]->id;
+        }
+        rec.num_children = node->num_children;
+        rec.child_ids = st->child_ids;
+        rec.has_usage = 1;
+        fs_usage(node, &rec.usage);
+    }
+    else
+    {
+        rec.num_blocks = node->num_blocks;
+        rec.blocks = node->blocks;
+    }
+    mft_encode_record(&st->buf, st->version, &rec);
+}
+
+/* The function save_inode is a recursive functions that is
+ * called by save_inodes to store a single inode on disk,
+ * and call itself recursively for every child if the node
+ * itself is a directory.
+ */
+static void save_inode(struct save_state *st, struct inode *node)
+{
+    if (!node)
+        return;
+
+    if (node->flags & INODE_CHILDREN_PENDING)
+    {
+        // a directory that was never opened is still the same bytes on disk
+        if (st->mapping != NULL && st->mapping->version == st->version)
+        {
+            copy_pending(st, node);
+            return;
+        }
+        // without its children the directory would be saved empty, and its subtree lost
+        if (fs_load_children(node) != 0)
+        {
+            st->buf.failed = 1;
+            return;
+        }
+    }
+
+    note_record(st, node->id, st->buf.len);
+    encode_inode(st, node);
+
+    if (node->is_directory)
+    {
+        for (int i = 0; i < node->num_children; i++)
+        {
+            struct inode *child = node->children[i];
+            save_inode(st, child);
+        }
+    }
+}
+
+/* Appends the records of the dirty inodes at and below node, following
+ * only the directories that have a change below them.
+ */
+static void save_dirty(struct save_state *st, struct inode *node)
+{
+    if (node->flags & INODE_DIRTY)
+    {
+        st->count++;
+        encode_inode(st, node);
+    }
+    if (node->flags & INODE_DIRTY_BELOW)
+    {
+        for (int i = 0; i < node->num_children; i++)
+        {
+            if (node->children[i]->flags & (INODE_DIRTY | INODE_DIRTY_BELOW))
+                save_dirty(st, node->children[i]);
+        }
+    }
+}
+
+static void clear_dirty(struct inode *node)
+{
+    char flags = __atomic_fetch_and(&node->flags, ~(INODE_DIRTY | INODE_DIRTY_BELOW), __ATOMIC_RELAXED);
+    if (flags & INODE_DIRTY_BELOW)
+    {
+        for (int i = 0; i < node->num_children; i++)
+        {
+            if (node->children[i]->flags & (INODE_DIRTY | INODE_DIRTY_BELOW))
+                clear_dirty(node->children[i]);
+        }
+    }
+}
+
+/* Starts the write-ahead log of the tree over after it was saved to
+ * master_file_table. A save to another table leaves the log alone, as
+ * the table it belongs to has not changed.
+ */
+static void restart_wal(char *master_file_table, struct mft_mapping *mapping)
+{
+    if (mapping->wal != NULL && strcmp(mapping->wal_table, master_file_table) == 0
+        && wal_reset(mapping->wal, master_file_table) != 0)
+    {
+        fprintf(stderr, "Failed to restart the write-ahead log of %s\n", master_file_table);
+    }
+}
+
+/* Remembers that the tree of root now matches master_file_table, with
+ * no log, so that the next incremental save can append to a new log.
+ */
+static void set_base(char *master_file_table, struct inode *root)
+{
+    mft_log_remove(master_file_table);
+    if (root->flags & INODE_SNAPSHOT)
+    {
+        return; // the dirty flags and the base belong to the live tree
+    }
+    clear_dirty(root);
+
+    struct mft_mapping *mapping = mapping_of(root);
+    if (mapping == NULL)
+    {
+        mapping = calloc(1, sizeof(struct mft_mapping));
+        if (mapping == NULL)
+        {
+            return;
+        }
+        register_table(mapping, root, -1);
+    }
+    mapping->has_base = mft_log_identify(master_file_table, &mapping->base) == 0;
+    restart_wal(master_file_table, mapping);
+}
+
+/* Returns a copy of node on its own, with no parent and no children. */
+static struct inode *detach_inode(struct inode *node)
+{
+    struct inode *copy = calloc(1, sizeof(struct inode));
+    if (copy == NULL)
     {
         return NULL;
     }
-
-    // allocation test is run before all other variables are set, making freeing resources easier if it fails.
-    int amount_of_blocks = blocks_needed(size_in_bytes);
-    size_t *blockarr = malloc(amount_of_blocks * sizeof(size_t));
-    if (blockarr == NULL)
+    pthread_mutex_init(&copy->lock, NULL);
+    copy->id = node->id;
+    copy->is_directory = node->is_directory;
+    copy->filesize = node->filesize;
+    copy->name = strdup(node->name);
+    if (node->num_blocks > 0 && (copy->blocks = malloc(node->num_blocks * sizeof(size_t))) != NULL)
     {
+        memcpy(copy->blocks, node->blocks, node->num_blocks * sizeof(size_t));
+        copy->num_blocks = node->num_blocks;
+    }
+    if (copy->name == NULL || copy->num_blocks != node->num_blocks)
+    {
+        release_inode(copy);
         return NULL;
     }
-    for (int i = 0; i < amount_of_blocks; i++)
+    atomic_init(&copy->tree_files, atomic_load(&node->tree_files));
+    atomic_init(&copy->tree_dirs, atomic_load(&node->tree_dirs));
+    atomic_init(&copy->tree_bytes, atomic_load(&node->tree_bytes));
+    atomic_init(&copy->tree_blocks, atomic_load(&node->tree_blocks));
+    return copy;
+}
+
+static struct inode *lookup_path(char *master_file_table, char *path)
+{
+    // the index and the table are mapped under the lock, and stay as they were after it
+    int lock = mft_lock(master_file_table, 0);
+    struct mft_index *index = mft_index_open(master_file_table);
+    mft_unlock(lock, 0);
+    if (index != NULL)
     {
-        int number = allocate_block();
-        if (number >= 0)
-        {
-            blockarr[i] = number;
-        }
-        else
+        struct inode *node = NULL;
+        struct mft_record rec;
+        if (mft_index_find(index, path, &rec) == 0)
         {
-            format_disk();
-            return NULL;
+            rec.transient = 1; // the table is unmapped below, so the inode needs copies
+            node = inode_from_record(&rec, NULL);
         }
+        mft_index_close(index);
+        return node;
     }
 
-    struct inode *inode = malloc(sizeof(struct inode));
-    if (inode == NULL)
+    struct inode *root = load_inodes_lazy(master_file_table);
+    if (root == NULL || path[0] != '/')
     {
+        fs_shutdown(root);
         return NULL;
     }
-
-    inode->id = next_inode_id();
-    inode->name = strdup(name);
-    inode->is_directory = 0;
-    inode->filesize = size_in_bytes;
-    inode->blocks = blockarr;
-    inode->num_blocks = amount_of_blocks;
-    inode->children = NULL;
-
-    // updating parent inode for all except root
-    if (parent != NULL)
+    struct inode *node = root;
+    char *copy = strdup(path + 1);
+    char *saveptr = NULL;
+    for (char *name = copy ? strtok_r(copy, "/", &saveptr) : NULL; name != NULL && node != NULL;
+         name = strtok_r(NULL, "/", &saveptr))
     {
-
-        parent->num_children++;
-        parent->children = realloc(parent->children, parent->num_children * sizeof(struct inode *));
-        parent->children[parent->num_children - 1] = inode;
+        node = find_inode_by_name(node, name);
     }
-
-    return inode;
+    node = copy != NULL && node != NULL ? detach_inode(node) : NULL;
+    free(copy);
+    fs_shutdown(root);
+    return node;
 }
 
-struct inode *create_dir(struct inode *parent, char *name)
+struct inode *lookup_inode(char *master_file_table, char *path)
 {
-    // printf("> create_dir( %s )\n", name);
+    uint64_t start = fs_now_ns();
+    struct inode *node = lookup_path(master_file_table, path);
+    fs_op_done(FS_OP_LOOKUP_INODE, start, node != NULL ? node->id : -1);
+    return node;
+}
 
-    if (find_inode_by_name(parent, name) != NULL) // if name already exists
+/* Returns 0 if the table was written and -1 if not. */
+static int save_whole(char *master_file_table, struct inode *root)
+{
+    if (root == NULL)
     {
-        return NULL;
-    }
-       
+        fprintf(stderr, "root inode is NULL\n");
+        return -1;
     }
 
-    dir->blocks = NULL;
+    struct save_state st;
+    memset(&st, 0, sizeof(st));
+    st.version = mft_format;
+    st.mapping = mapping_of(root);
+    st.max_id = -1;
 
-    // updating parent inode for all except root
-    if (parent != NULL)
+    // writers copy directories out of a snapshot while they change the live tree
+    int snapshot = root->flags & INODE_SNAPSHOT;
+    if (snapshot)
     {
-        parent->num_children++;
-        int num_siblings = parent->num_children;
-        parent->children = realloc(parent->children, parent->num_children * sizeof(struct inode *));
-        parent->children[num_siblings - 1] = dir;
+        pthread_mutex_lock(&snapshots_lock);
     }
 
-    dir->id = next_inode_id();
-    dir->name = strdup(name);
-    dir->is_directory = 1;
-    dir->num_children = 0;
-    dir->children = NULL;
-
-    return dir;
-}
-
-/* Check all the inodes that are directly referenced by
- * the node parent. If one of them has the name "name",
- * its inode pointer is returned.
- * parent must be directory.
- */
-struct inode *find_inode_by_name(struct inode *parent, char *name)
-{
-    /* gå gjennom hvert barn og sjekk navnet deres
-    returner peker til barn-inoden hvis funnet */
-    if (parent == NULL)
+    /* The cached totals give the size of everything except the names,
+     * so the buffer rarely has to grow.
+     */
+    struct fs_usage usage;
+    fs_usage(root, &usage);
+    long inodes = usage.files + usage.dirs;
+    mft_reserve(&st.buf, inodes * (2 * sizeof(int) + 16 + sizeof(char) + sizeof(size_t))
+                         + usage.dirs * (sizeof(int) + sizeof(struct fs_usage))
+                         + usage.files * 2 * sizeof(int)
+                         + usage.blocks * sizeof(size_t)
+                         + sizeof(struct mft_header) + inodes * sizeof(uint64_t));
+    st.buf.len = 0;
+
+    if (st.version != MFT_V1)
     {
-        return NULL;
+        mft_reserve(&st.buf, sizeof(struct mft_header));
     }
-    if (parent->is_directory == 0)
+    if (st.version == MFT_V3 && (st.buf.ctx = mft_context_new()) == NULL)
     {
-        return NULL;
+        st.buf.failed = 1;
     }
-    int num_children = parent->num_children;
-
-    struct inode *child = NULL;
-    for (int i = 0; i < num_children; i++)
+    save_inode(&st, root);
+    if (snapshot)
     {
-        child = parent->children[i];
-        char *childname = child->name;
-        if (strcmp(childname, name) == 0)
-        {
-            return parent->children[i];
-        }
+        pthread_mutex_unlock(&snapshots_lock);
     }
 
-    return NULL;
-}
+    if (st.version == MFT_V3 && !st.buf.failed)
+    {
+        struct mft_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MFT_MAGIC_V3, sizeof(header.magic));
+        header.version = MFT_V3;
+        header.num_inodes = st.count;
+        header.max_id = st.max_id;
+        memcpy(st.buf.data, &header, sizeof(header));
+    }
 
-static int verified_delete_in_parent(struct inode *parent, struct inode *node)
-{
-    int num_children = parent->num_children;
-    for (int i = 0; i < num_children; i++)
+    if (st.version == MFT_V2 && !st.buf.failed)
     {
-        if (parent->children[i] == node)
+        struct mft_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MFT_MAGIC, sizeof(header.magic));
+        header.version = MFT_V2;
+        header.num_inodes = st.count;
+        header.max_id = st.max_id;
+        header.table_offset = st.buf.len;
+        header.offset_size = st.buf.len <= UINT32_MAX ? sizeof(uint32_t) : sizeof(uint64_t);
+        // the table covers every ID up to max_id, unused ones are 0
+        char *table = mft_reserve(&st.buf, ((size_t)st.max_id + 1) * header.offset_size);
+        if (table != NULL)
         {
-            return 1;
+            for (int i = 0; i <= st.max_id; i++)
+            {
+                uint64_t offset = i < st.num_offsets ? st.offsets[i] : 0;
+                uint32_t narrow = (uint32_t)offset;
+                memcpy(table + (size_t)i * header.offset_size,
+                       header.offset_size == sizeof(narrow) ? (void *)&narrow : (void *)&offset, header.offset_size);
+            }
+            memcpy(st.buf.data, &header, sizeof(header));
         }
     }
-    return 0;
-}
 
-int is_node_in_parent(struct inode *parent, struct inode *node)
-{
-    int i = parent->num_children;
-    for (int j = 0; j < i; j++)
+    int retval = -1;
+    if (st.buf.failed)
+    {
+        fprintf(stderr, "Failed to encode the tree for %s\n", master_file_table);
+    }
+    else if (mft_replace_file(master_file_table, st.buf.data, st.buf.len) == 0)
     {
-        if (parent->children[j] == node)
+        retval = 0;
+        set_base(master_file_table, root);
+        if (mft_index_write(master_file_table, st.buf.data, st.buf.len) != 0)
         {
-            return 1;
+            // lookups fall back to loading the table
+            fprintf(stderr, "Failed to write the path index of %s\n", master_file_table);
+            mft_index_remove(master_file_table);
         }
     }
-    return 0;
+    free(st.buf.data);
+    mft_context_free(st.buf.ctx);
+    free(st.offsets);
+    free(st.child_ids);
+    return retval;
 }
 
-int delete_file(struct inode *parent, struct inode *node)
+/* Moves the table to its next generation after a save with the lock
+ * held, and notes that the tree of root matches it.
+ */
+static void saved(int lock, struct inode *root)
 {
+    uint64_t generation = mft_next_generation(lock);
+    set_generation(root, generation);
+}
 
-    for (int i = 0; i < node->num_blocks; i++)
+void save_inodes(char *master_file_table, struct inode *root)
+{
+    uint64_t start = fs_now_ns();
+    int lock = mft_lock(master_file_table, 1);
+    if (save_whole(master_file_table, root) == 0)
     {
-        free_block(node->blocks[i]);
+        saved(lock, root);
     }
-
-    parent->num_children--;
-    struct inode** tempchild;
-    tempchild = malloc(sizeof(struct inode*)*parent->num_children);
-    int j = 0;
-    for (int i= 0; i<parent->num_children+1;i++){
-        if(parent->children[i] == node ) continue;
-        
-        tempchild[j] = parent->children[i];
-        j++;
-    }    
-    free(parent->children);
-    parent->children = tempchild;
-    free(node->blocks);
-    free(node->name);
-    free(node);
-    return 0;
+    mft_unlock(lock, 1);
+    count_time(FS_SAVES, FS_SAVE_NS, start);
+    fs_op_done(FS_OP_SAVE_INODES, start, root != NULL ? root->id : -1);
 }
 
-int delete_dir(struct inode *parent, struct inode *node)
+/* The log is folded into a new table once it is this large relative
+ * to the table, which bounds the work load_inodes spends replaying it.
+ */
+#define MFT_LOG_COMPACT_RATIO 2
+
+/* Returns 0 if the changes or the whole table were written, 1 if there
+ * was nothing to write and -1 on failure. generation is that of the
+ * table on disk.
+ */
+static int save_changes(char *master_file_table, struct inode *root, uint64_t generation)
 {
-    if (node->num_children != 0)
+    if (root == NULL)
     {
+        fprintf(stderr, "root inode is NULL\n");
         return -1;
     }
 
-    if (is_node_in_parent(parent, node) == 0) // if node is not in parent
+    /* The log only works for the file the tree came from, as it is on
+     * disk. If another process has saved it since, the log holds
+     * changes this tree does not know of, and the tree replaces them.
+     */
+    struct mft_mapping *mapping = (root->flags & INODE_SNAPSHOT) ? NULL : mapping_of(root);
+    struct mft_log_header now;
+    if (mapping == NULL || !mapping->has_base
+        || mft_log_identify(master_file_table, &now) != 0
+        || memcmp(&now, &mapping->base, sizeof(now)) != 0
+        || mapping->generation != generation)
     {
-        return -1;
+        return save_whole(master_file_table, root);
+    }
+    if (!(root->flags & (INODE_DIRTY | INODE_DIRTY_BELOW)))
+    {
+        return 1;
     }
-    /*
-    parent->num_children--;
-    parent->children[parent->num_children] = NULL;
-    parent->children = realloc(parent->children, sizeof(struct inode) * parent->num_children);
-    */
 
-    parent->num_children--;
-    struct inode **tempchild;
-    tempchild = malloc(sizeof(struct inode *) * parent->num_children);
-    int j = 0;
-    for (int i = 0; i < parent->num_children + 1; i++)
+    struct save_state st;
+    memset(&st, 0, sizeof(st));
+    st.version = MFT_V2;
+    save_dirty(&st, root);
+
+    long log_size = -1;
+    if (st.buf.failed)
     {
-        if (parent->children[i] == node)
-            continue;
+        fprintf(stderr, "Failed to encode the tree for %s\n", master_file_table);
+    }
+    else
+    {
+        log_size = mft_log_append(master_file_table, st.buf.data, st.buf.len, st.count);
+    }
+    free(st.buf.data);
+    free(st.child_ids);
 
-        tempchild[j] = parent->children[i];
-        j++;
+    if (log_size < 0 || (uint64_t)log_size * MFT_LOG_COMPACT_RATIO > now.base_size)
+    {
+        return save_whole(master_file_table, root);
     }
-    free(parent->children);
-    parent->children = tempchild;
-    free(node->name);
-    free(node);
+    clear_dirty(root);
+    restart_wal(master_file_table, mapping);
     return 0;
 }
 
-struct inode *load_inodes_recursive(FILE *file, int *reader)
+void save_inodes_incremental(char *master_file_table, struct inode *root)
 {
-    next_inode_id();
-
-    // prep
-    struct inode *inode = malloc(sizeof(struct inode));
-    if (inode == NULL)
+    uint64_t start = fs_now_ns();
+    int lock = mft_lock(master_file_table, 1);
+    if (save_changes(master_file_table, root, mft_generation(master_file_table, lock)) == 0)
     {
-        return NULL;
+        saved(lock, root);
     }
-    fseek(file, *reader, SEEK_SET);
-
-    // ID
-    int id;
-    fread(&id, sizeof(int), 1, file);
-    inode->id = id;
-    *reader += sizeof(int);
-
-    // name_len;
-    int name_len;
-    fread(&name_len, sizeof(int), 1, file);
-    *reader += sizeof(int);
+    mft_unlock(lock, 1);
+    count_time(FS_SAVES, FS_SAVE_NS, start);
+    fs_op_done(FS_OP_SAVE_INODES_INCREMENTAL, start, root != NULL ? root->id : -1);
+}
 
-    // name
-    char *name_ptr = malloc(name_len);
-    if (name_ptr == NULL)
+int fs_wal_open(char *master_file_table, struct inode *root)
+{
+    if (root == NULL || root->parent != NULL || (root->flags & INODE_SNAPSHOT))
     {
-        return NULL;
+        return -1;
     }
-    fread(name_ptr, 1, name_len, file);
-    inode->name = name_ptr;
-    *reader += sizeof(char) * name_len;
-
-    // is_directory
-    char is_directory;
-    fread(&is_directory, sizeof(char), 1, file);
-    inode->is_directory = is_directory;
-    *reader += sizeof(char);
-
-    if (is_directory)
+    // the log records changes to the table as it is on disk
+    struct mft_mapping *mapping = mapping_of(root);
+    struct mft_log_header now;
+    if (mapping == NULL || !mapping->has_base
+        || mft_log_identify(master_file_table, &now) != 0
+        || memcmp(&now, &mapping->base, sizeof(now)) != 0
+        || (root->flags & (INODE_DIRTY | INODE_DIRTY_BELOW)))
     {
-        inode->blocks = NULL;
-
-        int num_children;
-        fread(&num_children, sizeof(int), 1, file);
-        inode->num_children = num_children;
-        *reader += sizeof(int);
-
-        if (num_children == 0)
-        {
-            inode->children = NULL;
-            return inode;
-        }
-
-        struct inode **children = malloc(sizeof(struct inode *) * num_children);
-        if (children == NULL)
-        {
-            return NULL;
-        }
-        *reader += sizeof(size_t) * num_children;
-
-        for (int i = 0; i < num_children; i++)
-        {
-            children[i] = load_inodes_recursive(file, reader);
-        }
-
-        inode->children = children;
+        save_inodes_incremental(master_file_table, root);
+        mapping = mapping_of(root);
     }
-    else
+    if (mapping == NULL || !mapping->has_base || (root->flags & (INODE_DIRTY | INODE_DIRTY_BELOW)))
     {
-        inode->children = NULL;
-
-        // filesize
-        int filesize;
-        fread(&filesize, sizeof(int), 1, file);
-        inode->filesize = filesize;
-        *reader += sizeof(int);
-
-        // num_blocks
-        int num_blocks;
-        fread(&num_blocks, sizeof(int), 1, file);
-        inode->num_blocks = num_blocks;
-        *reader += sizeof(int);
+        return -1; // the save failed
+    }
+    if (mapping->wal != NULL)
+    {
+        return strcmp(mapping->wal_table, master_file_table) == 0 ? 0 : -1;
+    }
 
-        // blocks
-        size_t *blocks = malloc(sizeof(size_t) * num_blocks);
-        if (blocks == NULL)
-        {
-            return NULL;
-        }
-        fread(blocks, sizeof(size_t), num_blocks, file);
-        inode->blocks = blocks;
-        *reader += sizeof(size_t) * num_blocks;
+    mapping->wal_table = strdup(master_file_table);
+    mapping->wal = mapping->wal_table ? wal_open(master_file_table) : NULL;
+    if (mapping->wal == NULL)
+    {
+        fprintf(stderr, "Failed to open the write-ahead log of %s\n", master_file_table);
+        free(mapping->wal_table);
+        mapping->wal_table = NULL;
+        return -1;
     }
-    return inode;
+    pthread_rwlock_init(&mapping->wal_lock, NULL);
+    atomic_fetch_add(&num_wals, 1);
+    return 0;
 }
 
-/* Read the file master_file_table and create an inode in memory
- * for every inode that is stored in the file. Set the pointers
- * between inodes correctly.
- * The file master_file_table remains unchanged.
- */
-struct inode *load_inodes(char *master_file_table)
+static int checkpoint(char *master_file_table, struct inode *root)
 {
-    FILE *file = fopen(master_file_table, "r");
-
-    if (!file)
+    struct mft_mapping *mapping = root != NULL ? mapping_of(root) : NULL;
+    if (mapping == NULL || mapping->wal == NULL)
     {
-        fprintf(stderr, "Failed to open file %s\n", master_file_table);
-        return NULL;
+        return -1;
     }
+    pthread_rwlock_wrlock(&mapping->wal_lock);
+    save_inodes_incremental(master_file_table, root);
+    // a failed save leaves the changes dirty, and in the log
+    int retval = (root->flags & (INODE_DIRTY | INODE_DIRTY_BELOW)) ? -1 : 0;
+    if (retval == 0 && wal_size(mapping->wal) > (long)sizeof(struct wal_header))
+    {
+        restart_wal(master_file_table, mapping); // records of creates that failed, with nothing to save
+    }
+    pthread_rwlock_unlock(&mapping->wal_lock);
+    return retval;
+}
 
-    int reader = 0;
-    struct inode *root = load_inodes_recursive(file, &reader);
-
-    fclose(file);
-    return root;
+int fs_checkpoint(char *master_file_table, struct inode *root)
+{
+    uint64_t start = fs_now_ns();
+    int retval = checkpoint(master_file_table, root);
+    fs_op_done(FS_OP_CHECKPOINT, start, root != NULL ? root->id : -1);
+    return retval;
 }
 
-/* The function save_inode is a recursive functions that is
- * called by save_inodes to store a single inode on disk,
- * and call itself recursively for every child if the node
- * itself is a directory.
+/* malloc keeps a size_t in front of every allocation. */
+#define MALLOC_OVERHEAD sizeof(size_t)
+
+/* Adds an allocation of size bytes at p, which the inode owns, to
+ * *bytes and its slack and overhead to the rest.
  */
-static void save_inode(FILE *file, struct inode *node)
+static void count_allocation(void *p, size_t size, long *bytes, long *slack, long *overhead)
 {
-    if (!node)
+    if (p == NULL)
+    {
         return;
+    }
+    size_t usable = malloc_usable_size(p);
+    *bytes += size;
+    *slack += usable > size ? usable - size : 0;
+    *overhead += MALLOC_OVERHEAD;
+}
 
-    int len = strlen(node->name) + 1;
-
-    fwrite(&node->id, 1, sizeof(int), file);
-    fwrite(&len, 1, sizeof(int), file);
-    fwrite(node->name, 1, len, file);
-    fwrite(&node->is_directory, 1, sizeof(char), file);
+static void count_memory(struct fs_memory *m, struct inode *node)
+{
+    m->inodes++;
+    count_allocation(node, sizeof(struct inode), &m->headers, &m->slack, &m->overhead);
+    if (node->flags & INODE_NAME_MAPPED)
+    {
+        m->mapped += strlen(node->name) + 1;
+    }
+    else
+    {
+        count_allocation(node->name, strlen(node->name) + 1, &m->names, &m->slack, &m->overhead);
+    }
     if (node->is_directory)
     {
-        fwrite(&node->num_children, 1, sizeof(int), file);
-        for (int i = 0; i < node->num_children; i++)
-        {
-            struct inode *child = node->children[i];
-            size_t id = child->id;
-            fwrite(&id, 1, sizeof(size_t), file);
-        }
+        size_t size = node->num_children * sizeof(struct inode *);
+        count_allocation(node->children, size, &m->children, &m->children_slack, &m->overhead);
+    }
+    else if (node->flags & INODE_BLOCKS_MAPPED)
+    {
+        m->mapped += node->num_blocks * sizeof(size_t);
+    }
+    else
+    {
+        size_t size = node->num_blocks * sizeof(size_t);
+        count_allocation(node->blocks, size, &m->blocks, &m->slack, &m->overhead);
+    }
+}
 
-        for (int i = 0; i < node->num_children; i++)
+static int report_memory(struct fs_memory_report *report, struct inode *node, int depth)
+{
+    if (depth == report->num_depths)
+    {
+        struct fs_memory *by_depth = realloc(report->by_depth, (depth + 1) * sizeof(struct fs_memory));
+        if (by_depth == NULL)
         {
-            struct inode *child = node->children[i];
-            save_inode(file, child);
+            return -1;
         }
+        memset(&by_depth[depth], 0, sizeof(struct fs_memory));
+        report->by_depth = by_depth;
+        report->num_depths++;
     }
-    else
+    count_memory(node->is_directory ? &report->dirs : &report->files, node);
+    count_memory(&report->all, node);
+    count_memory(&report->by_depth[depth], node);
+
+    if (node->flags & INODE_CHILDREN_PENDING)
     {
-        fwrite(&node->filesize, 1, sizeof(int), file);
-        fwrite(&node->num_blocks, 1, sizeof(int), file);
-        for (int i = 0; i < node->num_blocks; i++)
+        report->pending_dirs++;
+        return 0;
+    }
+    for (int i = 0; node->is_directory && i < node->num_children; i++)
+    {
+        if (report_memory(report, node->children[i], depth + 1) != 0)
         {
-            fwrite(&node->blocks[i], 1, sizeof(size_t), file);
+            return -1;
         }
     }
+    return 0;
 }
 
-void save_inodes(char *master_file_table, struct inode *root)
+struct fs_memory_report *fs_memory_report(struct inode *root)
 {
-    if (root == NULL)
+    struct fs_memory_report *report = calloc(1, sizeof(struct fs_memory_report));
+    if (report == NULL)
     {
-        fprintf(stderr, "root inode is NULL\n");
-        return;
+        return NULL;
     }
-
-    FILE *file = fopen(master_file_table, "w");
-    if (!file)
+    if (root != NULL && report_memory(report, root, 0) != 0)
     {
-        fprintf(stderr, "Failed to open file %s\n", master_file_table);
-        return;
+        fs_memory_report_free(report);
+        return NULL;
+    }
+    struct mft_mapping *mapping = root != NULL ? mapping_of(root) : NULL;
+    if (mapping != NULL && mapping->addr != NULL)
+    {
+        report->table_bytes = mapping->len;
     }
+    return report;
+}
 
-    save_inode(file, root);
+static void print_memory(FILE *f, const char *label, const struct fs_memory *m)
+{
+    long total = m->headers + m->names + m->children + m->children_slack + m->blocks + m->slack + m->overhead;
+    fprintf(f, "%-10s %10ld %12ld %12ld %12ld %12ld %12ld %12ld %12ld %12ld %14ld %9.1f\n",
+            label, m->inodes, m->headers, m->names, m->children, m->children_slack, m->blocks,
+            m->slack, m->overhead, m->mapped, total, m->inodes > 0 ? (double)total / m->inodes : 0.0);
+}
+
+void fs_memory_report_print(FILE *f, const struct fs_memory_report *report)
+{
+    fprintf(f, "%-10s %10s %12s %12s %12s %12s %12s %12s %12s %12s %14s %9s\n",
+            "", "inodes", "headers", "names", "children", "child_slack", "blocks",
+            "slack", "overhead", "mapped", "heap_total", "per_inode");
+    print_memory(f, "dirs", &report->dirs);
+    print_memory(f, "files", &report->files);
+    print_memory(f, "all", &report->all);
+    for (int d = 0; d < report->num_depths; d++)
+    {
+        char label[32];
+        snprintf(label, sizeof(label), "depth %d", d);
+        print_memory(f, label, &report->by_depth[d]);
+    }
+    fprintf(f, "mapped table: %ld bytes\n", report->table_bytes);
+    if (report->pending_dirs > 0)
+    {
+        fprintf(f, "directories not loaded yet: %ld\n", report->pending_dirs);
+    }
+}
 
-    fclose(file);
+void fs_memory_report_free(struct fs_memory_report *report)
+{
+    if (report != NULL)
+    {
+        free(report->by_depth);
+        free(report);
+    }
 }
 
 /* This static variable is used to change the indentation while debug_fs
@@ -446,6 +3054,7 @@ void debug_fs(struct inode *node)
 
     if (node->is_directory)
     {
+        fs_load_children(node);
         printf("%s (id %d)\n", node->name, node->id);
         indent++;
         for (int i = 0; i < node->num_children; i++)
@@ -466,25 +3075,55 @@ void debug_fs(struct inode *node)
     }
 }
 
-// Do not change.
-void fs_shutdown(struct inode *inode)
+static void shutdown_recursive(struct inode *inode)
+{
+    if (inode->is_directory)
+    {
+        for (int i = 0; i < inode->num_children; i++)
+        {
+            shutdown_recursive(inode->children[i]);
+        }
+    }
+    release_inode(inode);
+}
+
+static void shutdown_tree(struct inode *inode)
 {
     if (!inode)
         return;
 
-    if (inode->is_directory)
+    // the blocks of a snapshot still belong to the disk
+    if (inode->flags & INODE_SNAPSHOT)
     {
-        for (int i = 0; i < inode->num_children; i++)
+        drop_snapshots(inode, NULL, 0);
+        return;
+    }
+    if (atomic_load(&num_snapshots) > 0)
+    {
+        drop_snapshots(NULL, inode, 0);
+    }
+
+    shutdown_recursive(inode);
+
+    // a tree from load_inodes() takes its mapping with it
+    pthread_mutex_lock(&mappings_lock);
+    for (struct mft_mapping **m = &mappings; *m != NULL; m = &(*m)->next)
+    {
+        if ((*m)->root == inode)
         {
-            fs_shutdown(inode->children[i]);
+            struct mft_mapping *mapping = *m;
+            *m = mapping->next;
+            unmap_table(mapping);
+            break;
         }
     }
+    pthread_mutex_unlock(&mappings_lock);
+}
 
-    if (inode->name)
-        free(inode->name);
-    if (inode->children)
-        free(inode->children);
-    if (inode->blocks)
-        free(inode->blocks);
-    free(inode);
+void fs_shutdown(struct inode *inode)
+{
+    uint64_t start = fs_now_ns();
+    int id = inode != NULL ? inode->id : -1;
+    shutdown_tree(inode);
+    fs_op_done(FS_OP_SHUTDOWN, start, id);
 }
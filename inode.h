@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 /* This is the inode structure as described in the
  * assignment.
@@ -25,6 +27,70 @@ struct inode
 	int filesize;
 	int num_blocks;
 	size_t *blocks;
+
+	/* Protects num_children and children of a directory while
+	 * writers add or remove entries. Locks are always taken
+	 * parent before child, so two-directory operations cannot
+	 * deadlock.
+	 */
+	pthread_mutex_t lock;
+
+	/* The directory that contains this inode, NULL for the root. */
+	struct inode *parent;
+
+	/* Totals for the subtree rooted at this inode, the inode itself
+	 * included. create_* and delete_* update them along the parent
+	 * chain, so reading them with fs_usage() is O(1).
+	 */
+	atomic_long tree_files;
+	atomic_long tree_dirs;
+	atomic_long tree_bytes;
+	atomic_long tree_blocks;
+
+	/* INODE_NAME_MAPPED and INODE_BLOCKS_MAPPED are set when name
+	 * or blocks point into a master file table that load_inodes()
+	 * has mapped, rather than to memory the inode owns.
+	 * INODE_CHILDREN_PENDING is set on a directory from
+	 * load_inodes_lazy() whose children are still on disk.
+	 * INODE_DIRTY is set on an inode that changed since it was
+	 * last saved, and INODE_DIRTY_BELOW on every directory above
+	 * it, so save_inodes_incremental() finds the changes without
+	 * visiting the rest of the tree.
+	 * INODE_SNAPSHOT is set on the root of a snapshot.
+	 */
+	char flags;
+
+	/* The number of directories besides the first that refer to
+	 * this inode: snapshots share inodes with the live tree until
+	 * one of them changes. Only changed under the snapshot lock.
+	 */
+	int shared;
+};
+
+#define INODE_NAME_MAPPED      1
+#define INODE_BLOCKS_MAPPED    2
+#define INODE_CHILDREN_PENDING 4
+#define INODE_DIRTY            8
+#define INODE_DIRTY_BELOW      16
+#define INODE_SNAPSHOT         32
+
+/* The number of bytes in a block.
+ * Do not change.
+ */
+#define BLOCKSIZE 4096
+
+/* Returns the number of blocks a file of the given size in bytes
+ * takes on the simulated disk.
+ */
+int blocks_needed(int bytes);
+
+/* Totals for a subtree. A directory counts itself in dirs. */
+struct fs_usage
+{
+	long files;
+	long dirs;
+	long bytes;
+	long blocks;
 };
 
 /* Create a file below the inode parent. Parent must
@@ -33,6 +99,8 @@ struct inode
  * enough number of times to reserve blocks in the simulated
  * disk to store all of these bytes.
  * Returns a pointer to file's inodes.
+ * Safe to call concurrently; writers in different directories
+ * do not block each other.
  */
 struct inode *create_file(struct inode *parent, char *name, int size_in_bytes);
 
@@ -54,6 +122,7 @@ struct inode *find_inode_by_name(struct inode *parent, char *name);
  * The function calls free_block for every block that is
  * referenced by this file. This removes those blocks from
  * simulate disk.
+ * Returns 0 on success and -1 if node is not a child of parent.
  */
 int delete_file(struct inode *parent, struct inode *node);
 
@@ -61,22 +130,217 @@ int delete_file(struct inode *parent, struct inode *node);
  * directly referenced by parent.
  * The function fails if the node is still referencing other
  * inodes.
+ * The caller must make sure no other thread is still using node.
  */
 int delete_dir(struct inode *parent, struct inode *node);
 
+/* Fill in usage with the cached totals for the subtree rooted at
+ * node. This does not walk the subtree.
+ */
+void fs_usage(struct inode *node, struct fs_usage *usage);
+
 /* Write the given inode root and all inodes referenced by it
  * to the file called superblock, following the oblig instructions.
  * No inodes are changed.
+ * The file is replaced atomically: after a crash it holds either the
+ * old or the new table.
  */
 void save_inodes(char *master_file_table, struct inode *root);
 
+/* Like save_inodes, but if root was loaded from master_file_table or
+ * last saved to it, only the inodes that were created or changed since
+ * then are appended to the delta log <master_file_table>.log (see
+ * mft.h). load_inodes replays the log over the table.
+ * Once the log has grown to half the size of the table, and in any
+ * case where the log cannot be used, the whole table is written with
+ * save_inodes instead, which also removes the log.
+ */
+void save_inodes_incremental(char *master_file_table, struct inode *root);
+
+/* Makes every later create_* and delete_* in the tree of root durable
+ * when it returns, by appending a record to the write-ahead log
+ * <master_file_table>.wal (see wal.h) and syncing it. Threads that
+ * change the tree at the same time share their syncs. load_inodes
+ * replays the log over the table.
+ * If the tree has changes that are not in master_file_table yet, it is
+ * saved first with save_inodes_incremental. Call this before any other
+ * thread changes the tree. The log is closed by fs_shutdown.
+ * Returns 0 on success and -1 on failure.
+ */
+int fs_wal_open(char *master_file_table, struct inode *root);
+
+/* Saves the tree of root with save_inodes_incremental and starts its
+ * write-ahead log over, so the log does not grow without end. Changes
+ * made by other threads wait for it. Call it every so often, for
+ * example when the log has grown by a few megabytes.
+ * Returns 0 on success and -1 if the tree has no log or the save
+ * failed, in which case the log keeps every change.
+ */
+int fs_checkpoint(char *master_file_table, struct inode *root);
+
+/* Choose the on-disk format that save_inodes writes: 1 for the
+ * layout from the assignment (the default), 2 for the format with
+ * a header, an offset table and stored subtree totals, 3 for the
+ * compact encoding with varints and shared name prefixes (see mft.h).
+ * The load functions read all of them; a version 3 table is always
+ * loaded in full, from the start.
+ */
+void set_mft_format(int version);
+
 /* Read the file master_file_table and create an inode in memory
  * for every inode that is stored in the file. Set the pointers
  * between inodes correctly.
  * The file master_file_table remains unchanged.
+ * Changes in its delta log, if it has one, are applied on top.
  */
 struct inode *load_inodes(char *master_file_table);
 
+/* Like load_inodes, but only the root is created. One pass over
+ * the file records where every inode is stored, and a directory's
+ * children are read when the directory is first used, through
+ * find_inode_by_name, create_*, delete_dir, debug_fs or
+ * fs_load_children. Looking up one path touches only the inodes
+ * on that path. save_inodes copies directories that were never
+ * opened straight from the old file.
+ * A table with a delta log is loaded in full, like load_inodes.
+ */
+struct inode *load_inodes_lazy(char *master_file_table);
+
+/* Like load_inodes, but the subtrees below the root are parsed by
+ * num_threads threads, <= 0 for one per online CPU. Each thread takes
+ * the next top-level subtree nobody has started on. For a version 2
+ * table the subtrees are found through the offset table, a version 1
+ * table is skimmed for them first.
+ */
+struct inode *load_inodes_parallel(char *master_file_table, int num_threads);
+
+/* Several processes may load and save the same table: saves take an
+ * exclusive lock on it and loads a shared one (see mft_lock() in
+ * mft.h), and every save starts a new generation of the table. A
+ * process that saves a tree older than the table replaces the changes
+ * the others saved since, so writers that load, change and save the
+ * table hold fs_lock_table() meanwhile. Readers keep up with
+ * fs_refresh().
+ *
+ * Returns root if master_file_table is still at the generation the
+ * tree of root was loaded or last saved at, which costs one read of
+ * the lock file. Otherwise the table is loaded again, lazily if root
+ * was loaded lazily, root is released with fs_shutdown and the new
+ * root is returned. A tree with unsaved changes or a write-ahead log
+ * is returned as it is. Returns NULL, and keeps root, if the load fails.
+ */
+struct inode *fs_refresh(char *master_file_table, struct inode *root);
+
+/* Keeps other processes, and the other threads of this one, from
+ * loading or saving master_file_table until fs_unlock_table() is called
+ * with the returned lock. Loads and saves of the table by the calling
+ * thread go ahead. Returns -1 if the lock file cannot be opened or
+ * locked.
+ */
+int fs_lock_table(char *master_file_table);
+
+void fs_unlock_table(int lock);
+
+/* Make sure the children of dir are in memory. Code that walks
+ * the children array itself must call this first, since a tree
+ * from load_inodes_lazy may not have read them yet.
+ * Returns 0 on success and -1 if they could not be read.
+ */
+int fs_load_children(struct inode *dir);
+
+/* Looks up one inode by its full path, such as "/etc/hosts" ("/" for
+ * the root, no trailing "/"), without loading the table. It uses the
+ * path index that save_inodes writes next to the table, so it reads a
+ * few pages whatever the size of the tree. Without a valid index (a
+ * version 3 table, or one with a delta log or a write-ahead log) the
+ * table is loaded lazily instead.
+ * Returns a new inode that is not part of any tree: a file with its
+ * size and blocks, or a directory without its children. Release it
+ * with fs_shutdown. Returns NULL if there is no such path.
+ */
+struct inode *lookup_inode(char *master_file_table, char *path);
+
+/* Take a point-in-time view of the tree below root, which must be the
+ * root of a tree and not a snapshot. Only the root is copied; every
+ * other inode is shared with the live tree. Before create_* or
+ * delete_* change a directory that a snapshot still shares, the
+ * snapshot gets its own copy of that directory and of the directories
+ * above it, so the snapshot never changes. A file deleted from the
+ * live tree keeps its inode and its blocks while a snapshot refers to
+ * it; the inode is the only owner of its block list, so its reference
+ * count covers the blocks too.
+ * The returned root can be used wherever a root can, in particular
+ * with save_inodes to write the snapshot as a table of its own.
+ * Must not run at the same time as writers in the same tree.
+ * Returns NULL if root is not a root or memory runs out.
+ */
+struct inode *fs_snapshot(struct inode *root);
+
+/* Makes file the only owner of its blocks before they are written, so
+ * that writing a live file does not change a snapshot. If a snapshot
+ * shares file, the snapshot gets a copy of the inode with the blocks it
+ * has now, and file gets new blocks, filled by copy_block(from, to),
+ * which returns 0 on success; the live tree keeps its inode. A file
+ * that only a snapshot has cannot be written.
+ * Like the other writers, it must not run at the same time as
+ * fs_snapshot() on the same tree.
+ * Returns 0 if file can be written in place, and -1 if it cannot or
+ * the disk or memory ran out.
+ */
+int fs_own_blocks(struct inode *file, int (*copy_block)(size_t from, size_t to));
+
+/* Releases a snapshot. Inodes that only it referred to are freed,
+ * and so are the blocks of files that were deleted from the live tree
+ * since the snapshot was taken.
+ */
+void fs_snapshot_drop(struct inode *snapshot);
+
+/* The heap memory of a group of inodes, in bytes. The sizes are what
+ * the inodes asked malloc for; slack is what malloc handed out beyond
+ * that, and overhead estimates malloc's own header of each allocation.
+ * Names and block lists that point into a table that load_inodes()
+ * has mapped take no heap memory and are counted in mapped instead.
+ */
+struct fs_memory
+{
+	long inodes;
+	long headers;        // struct inode
+	long names;          // names with their 0
+	long children;       // children arrays, a pointer per child
+	long children_slack; // what malloc added to the children arrays
+	long blocks;         // block lists
+	long slack;          // what malloc added to the other allocations
+	long overhead;
+	long mapped;
+};
+
+struct fs_memory_report
+{
+	struct fs_memory dirs;
+	struct fs_memory files;
+	struct fs_memory all;       // directories and files together
+	int num_depths;
+	struct fs_memory *by_depth; // directories and files at each depth, the root at 0
+	long table_bytes;           // the mapped master file table, 0 if there is none
+	long pending_dirs;          // directories whose children were not loaded yet
+};
+
+/* Measures the memory of the tree below root, which is walked once
+ * and must not change meanwhile. Directories that load_inodes_lazy()
+ * has not opened yet are not opened. Inodes that a snapshot shares are
+ * counted in every tree that reaches them.
+ * Returns NULL if memory runs out. Free the report with
+ * fs_memory_report_free.
+ */
+struct fs_memory_report *fs_memory_report(struct inode *root);
+
+/* Prints the report as a table, with the heap total and the bytes per
+ * inode of every row.
+ */
+void fs_memory_report_print(FILE *f, const struct fs_memory_report *report);
+
+void fs_memory_report_free(struct fs_memory_report *report);
+
 /* This function is handed out.
  *
  * It releases all dynamically allocated memory.
@@ -89,6 +353,10 @@ struct inode *load_inodes(char *master_file_table);
  *
  * This function can be used to end a program after
  * save_inodes and helps you to avoid valgrind errors.
+ * When node is a root returned by load_inodes, the mapping
+ * of the master file table is released as well.
+ * Snapshots of a root are released with it, and a snapshot passed
+ * here is released without freeing any blocks.
  */
 void fs_shutdown(struct inode *node);
 
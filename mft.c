@@ -0,0 +1,1750 @@
+#include "mft.h"
+#include "stats.h"
+#include "wal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const char *mft_take(struct mft_cursor *cur, size_t n)
+{
+    if (n > cur->len - cur->pos)
+    {
+        return NULL;
+    }
+    const char *p = cur->base + cur->pos;
+    cur->pos += n;
+    return p;
+}
+
+/* Reads a 4-byte number. The records are packed, so the fields are
+ * copied out rather than read through a cast pointer.
+ */
+static int take_u32(struct mft_cursor *cur, uint32_t *value)
+{
+    const char *p = mft_take(cur, sizeof(uint32_t));
+    if (p == NULL)
+    {
+        return -1;
+    }
+    memcpy(value, p, sizeof(uint32_t));
+    return 0;
+}
+
+static int take_int(struct mft_cursor *cur, int *value)
+{
+    uint32_t v;
+    if (take_u32(cur, &v) != 0)
+    {
+        return -1;
+    }
+    memcpy(value, &v, sizeof(int));
+    return 0;
+}
+
+int mft_read_header(const char *base, size_t len, struct mft_header *header)
+{
+    // the magic is "MFT" and the version as a byte
+    if (len < sizeof(MFT_MAGIC) - 1
+        || (memcmp(base, MFT_MAGIC, sizeof(MFT_MAGIC) - 1) != 0
+            && memcmp(base, MFT_MAGIC_V3, sizeof(MFT_MAGIC_V3) - 1) != 0))
+    {
+        return MFT_V1;
+    }
+
+    struct mft_header h;
+    if (len < sizeof(h))
+    {
+        return -1;
+    }
+    memcpy(&h, base, sizeof(h));
+    if (h.version != (unsigned char)h.magic[3] || h.max_id < -1)
+    {
+        return -1;
+    }
+    if (h.version == MFT_V2
+        && (h.table_offset > len
+            || (h.offset_size != sizeof(uint32_t) && h.offset_size != sizeof(uint64_t))
+            || ((uint64_t)h.max_id + 1) * h.offset_size > len - h.table_offset))
+    {
+        return -1;
+    }
+    if (header)
+    {
+        *header = h;
+    }
+    return h.version;
+}
+
+uint64_t mft_table_entry(const struct mft_header *header, const char *table, int id)
+{
+    const char *p = table + (size_t)id * header->offset_size;
+    if (header->offset_size == sizeof(uint32_t))
+    {
+        uint32_t offset;
+        memcpy(&offset, p, sizeof(offset));
+        return offset;
+    }
+    uint64_t offset;
+    memcpy(&offset, p, sizeof(offset));
+    return offset;
+}
+
+size_t mft_first_record(int version)
+{
+    return version == MFT_V1 ? 0 : sizeof(struct mft_header);
+}
+
+static int decode_v3(struct mft_cursor *cur, struct mft_record *rec);
+
+static int decode_record(struct mft_cursor *cur, int version, struct mft_record *rec)
+{
+    if (version == MFT_V3)
+    {
+        return decode_v3(cur, rec);
+    }
+
+    // v1 stores IDs and block numbers as size_t, v2 in 4 bytes
+    int wide = version == MFT_V1 ? sizeof(size_t) : sizeof(uint32_t);
+    int name_len;
+    const char *type;
+    if (take_int(cur, &rec->id) != 0
+        || take_int(cur, &name_len) != 0
+        || name_len <= 0
+        || (rec->name = mft_take(cur, name_len)) == NULL
+        || rec->name[name_len - 1] != '\0'
+        || (type = mft_take(cur, sizeof(char))) == NULL)
+    {
+        return -1;
+    }
+    rec->name_len = name_len - 1;
+    rec->is_directory = *type;
+    rec->has_usage = 0;
+    rec->transient = 0;
+
+    if (rec->is_directory)
+    {
+        rec->filesize = 0;
+        rec->num_blocks = 0;
+        rec->blocks = NULL;
+        rec->block_size = wide;
+        rec->child_id_size = wide;
+        if (take_int(cur, &rec->num_children) != 0
+            || rec->num_children < 0
+            || (rec->child_ids = mft_take(cur, (size_t)wide * rec->num_children)) == NULL)
+        {
+            return -1;
+        }
+
+        if (version == MFT_V2)
+        {
+            uint32_t files, dirs, blocks;
+            const char *bytes;
+            if (take_u32(cur, &files) != 0
+                || take_u32(cur, &dirs) != 0
+                || take_u32(cur, &blocks) != 0
+                || (bytes = mft_take(cur, sizeof(uint64_t))) == NULL)
+            {
+                return -1;
+            }
+            uint64_t b;
+            memcpy(&b, bytes, sizeof(b));
+            rec->usage.files = files;
+            rec->usage.dirs = dirs;
+            rec->usage.blocks = blocks;
+            rec->usage.bytes = b;
+            rec->has_usage = 1;
+        }
+    }
+    else
+    {
+        rec->num_children = 0;
+        rec->child_ids = NULL;
+        rec->child_id_size = wide;
+        rec->block_size = wide;
+        if (take_int(cur, &rec->filesize) != 0
+            || take_int(cur, &rec->num_blocks) != 0
+            || rec->num_blocks < 0
+            || (rec->blocks = mft_take(cur, (size_t)wide * rec->num_blocks)) == NULL)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int mft_decode_record(struct mft_cursor *cur, int version, struct mft_record *rec)
+{
+    size_t start = cur->pos;
+    if (decode_record(cur, version, rec) != 0)
+    {
+        return -1;
+    }
+    fs_count(FS_MFT_RECORDS_READ, 1);
+    fs_count(FS_MFT_BYTES_READ, cur->pos - start);
+    return 0;
+}
+
+int mft_child_id(const struct mft_record *rec, int i)
+{
+    const char *p = (const char *)rec->child_ids + (size_t)i * rec->child_id_size;
+    if (rec->child_id_size == sizeof(uint32_t))
+    {
+        int32_t id;
+        memcpy(&id, p, sizeof(id));
+        return id;
+    }
+    size_t id;
+    memcpy(&id, p, sizeof(id));
+    return (int)id;
+}
+
+size_t mft_block(const struct mft_record *rec, int i)
+{
+    const char *p = (const char *)rec->blocks + (size_t)i * rec->block_size;
+    if (rec->block_size == sizeof(uint32_t))
+    {
+        uint32_t block;
+        memcpy(&block, p, sizeof(block));
+        return block;
+    }
+    size_t block;
+    memcpy(&block, p, sizeof(block));
+    return block;
+}
+
+char *mft_reserve(struct mft_buffer *buf, size_t n)
+{
+    if (buf->failed)
+    {
+        return NULL;
+    }
+    if (buf->len + n > buf->cap)
+    {
+        size_t cap = buf->cap ? buf->cap : 4096;
+        while (cap < buf->len + n)
+            cap *= 2;
+        char *data = realloc(buf->data, cap);
+        if (data == NULL)
+        {
+            buf->failed = 1;
+            return NULL;
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+    char *p = buf->data + buf->len;
+    buf->len += n;
+    return p;
+}
+
+void mft_put(struct mft_buffer *buf, const void *src, size_t n)
+{
+    char *p = mft_reserve(buf, n);
+    if (p != NULL && n > 0)
+    {
+        memcpy(p, src, n);
+    }
+}
+
+static void put_u32(struct mft_buffer *buf, uint32_t value)
+{
+    mft_put(buf, &value, sizeof(value));
+}
+
+/* Appends count numbers of src_size bytes each as dst_size bytes each.
+ * Equal sizes are copied in one go.
+ */
+static void put_array(struct mft_buffer *buf, const void *src, int src_size, int count, int dst_size)
+{
+    if (src_size == dst_size)
+    {
+        mft_put(buf, src, (size_t)src_size * count);
+        return;
+    }
+
+    char *dst = mft_reserve(buf, (size_t)dst_size * count);
+    if (dst == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t value = 0;
+        const char *p = (const char *)src + (size_t)i * src_size;
+        if (src_size == sizeof(uint32_t))
+        {
+            uint32_t v;
+            memcpy(&v, p, sizeof(v));
+            value = v;
+        }
+        else
+        {
+            memcpy(&value, p, sizeof(value));
+        }
+
+        if (dst_size == sizeof(uint32_t))
+        {
+            uint32_t v = (uint32_t)value;
+            memcpy(dst + (size_t)i * dst_size, &v, sizeof(v));
+        }
+        else
+        {
+            memcpy(dst + (size_t)i * dst_size, &value, sizeof(value));
+        }
+    }
+}
+
+static void encode_v3(struct mft_buffer *buf, const struct mft_record *rec);
+
+static void encode_record(struct mft_buffer *buf, int version, const struct mft_record *rec)
+{
+    if (version == MFT_V3)
+    {
+        encode_v3(buf, rec);
+        return;
+    }
+
+    int wide = version == MFT_V1 ? sizeof(size_t) : sizeof(uint32_t);
+
+    put_u32(buf, (uint32_t)rec->id);
+    put_u32(buf, (uint32_t)rec->name_len + 1);
+    mft_put(buf, rec->name, rec->name_len + 1);
+    mft_put(buf, &rec->is_directory, sizeof(char));
+    if (rec->is_directory)
+    {
+        put_u32(buf, (uint32_t)rec->num_children);
+        put_array(buf, rec->child_ids, rec->child_id_size, rec->num_children, wide);
+        if (version == MFT_V2)
+        {
+            uint64_t bytes = rec->usage.bytes;
+            put_u32(buf, (uint32_t)rec->usage.files);
+            put_u32(buf, (uint32_t)rec->usage.dirs);
+            put_u32(buf, (uint32_t)rec->usage.blocks);
+            mft_put(buf, &bytes, sizeof(bytes));
+        }
+    }
+    else
+    {
+        put_u32(buf, (uint32_t)rec->filesize);
+        put_u32(buf, (uint32_t)rec->num_blocks);
+        put_array(buf, rec->blocks, rec->block_size, rec->num_blocks, wide);
+    }
+}
+
+void mft_encode_record(struct mft_buffer *buf, int version, const struct mft_record *rec)
+{
+    size_t start = buf->len;
+    encode_record(buf, version, rec);
+    fs_count(FS_MFT_RECORDS_WRITTEN, 1);
+    fs_count(FS_MFT_BYTES_WRITTEN, buf->len - start);
+}
+
+/* Version 3. */
+
+struct mft_level
+{
+    char *name; // the last name at this depth, 0-terminated
+    size_t name_len;
+    size_t name_cap;
+    long remaining; // children still to come of the open directory at this depth
+};
+
+struct mft_context
+{
+    int prev_id;
+    int depth; // the number of open directories
+    int num_levels;
+    struct mft_level *levels;
+
+    uint64_t *values;
+    size_t values_cap;
+    int32_t *ids;
+    size_t ids_cap;
+    size_t *blocks;
+    size_t blocks_cap;
+};
+
+struct mft_context *mft_context_new(void)
+{
+    return calloc(1, sizeof(struct mft_context));
+}
+
+void mft_context_free(struct mft_context *ctx)
+{
+    if (ctx == NULL)
+        return;
+    for (int i = 0; i < ctx->num_levels; i++)
+    {
+        free(ctx->levels[i].name);
+    }
+    free(ctx->levels);
+    free(ctx->values);
+    free(ctx->ids);
+    free(ctx->blocks);
+    free(ctx);
+}
+
+/* Grows *array to hold at least n elements of size bytes. */
+static int grow_scratch(void **array, size_t *cap, size_t n, size_t size)
+{
+    if (n <= *cap)
+    {
+        return 0;
+    }
+    size_t num = *cap ? *cap : 64;
+    while (num < n)
+        num *= 2;
+    void *p = realloc(*array, num * size);
+    if (p == NULL)
+    {
+        return -1;
+    }
+    *array = p;
+    *cap = num;
+    return 0;
+}
+
+/* Returns the level for the record that comes next, making sure there
+ * is one more below it for its children.
+ */
+static struct mft_level *context_level(struct mft_context *ctx)
+{
+    if (ctx->depth + 2 > ctx->num_levels)
+    {
+        int num = ctx->num_levels ? ctx->num_levels * 2 : 16;
+        struct mft_level *levels = realloc(ctx->levels, num * sizeof(struct mft_level));
+        if (levels == NULL)
+        {
+            return NULL;
+        }
+        memset(levels + ctx->num_levels, 0, (num - ctx->num_levels) * sizeof(struct mft_level));
+        ctx->levels = levels;
+        ctx->num_levels = num;
+    }
+    return &ctx->levels[ctx->depth];
+}
+
+static int set_level_name(struct mft_level *level, size_t prefix, const char *rest, size_t rest_len)
+{
+    size_t len = prefix + rest_len;
+    if (len + 1 > level->name_cap)
+    {
+        char *name = realloc(level->name, len + 1);
+        if (name == NULL)
+        {
+            return -1;
+        }
+        level->name = name;
+        level->name_cap = len + 1;
+    }
+    memcpy(level->name + prefix, rest, rest_len);
+    level->name[len] = '\0';
+    level->name_len = len;
+    return 0;
+}
+
+/* Moves the context past a record with num_children children: into the
+ * directory if it has any, else out of every directory it completes.
+ */
+static void context_next(struct mft_context *ctx, long num_children)
+{
+    if (ctx->depth > 0)
+    {
+        ctx->levels[ctx->depth - 1].remaining--;
+    }
+    if (num_children > 0)
+    {
+        ctx->levels[ctx->depth].remaining = num_children;
+        ctx->depth++;
+        ctx->levels[ctx->depth].name_len = 0; // a new directory starts without a previous name
+        return;
+    }
+    while (ctx->depth > 0 && ctx->levels[ctx->depth - 1].remaining == 0)
+    {
+        ctx->depth--;
+    }
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static void put_varint(struct mft_buffer *buf, uint64_t value)
+{
+    char bytes[10];
+    int n = 0;
+    while (value >= 0x80)
+    {
+        bytes[n++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[n++] = (char)value;
+    mft_put(buf, bytes, n);
+}
+
+#define VARINT_HIGH_BITS 0x8080808080808080ULL
+
+/* Decodes one varint. Where eight bytes can be loaded at once, the
+ * length comes from the first clear top bit of the word and the 7-bit
+ * groups are packed together with three shift-and-mask steps instead
+ * of a branch per byte. Longer varints take the byte loop.
+ */
+static int take_varint(struct mft_cursor *cur, uint64_t *value)
+{
+    const unsigned char *p = (const unsigned char *)cur->base + cur->pos;
+    size_t avail = cur->len - cur->pos;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (avail >= sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        uint64_t stops = ~word & VARINT_HIGH_BITS;
+        if (stops != 0)
+        {
+            int len = __builtin_ctzll(stops) / 8 + 1;
+            uint64_t x = word & 0x7f7f7f7f7f7f7f7fULL;
+            if (len < 8)
+                x &= ((uint64_t)1 << (8 * len)) - 1;
+            x = ((x & 0x7f007f007f007f00ULL) >> 1) | (x & 0x007f007f007f007fULL);
+            x = ((x & 0x3fff00003fff0000ULL) >> 2) | (x & 0x00003fff00003fffULL);
+            x = ((x & 0x0fffffff00000000ULL) >> 4) | (x & 0x000000000fffffffULL);
+            *value = x;
+            cur->pos += len;
+            return 0;
+        }
+    }
+#endif
+    uint64_t v = 0;
+    for (size_t i = 0; i < avail && i < 10; i++)
+    {
+        v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80))
+        {
+            *value = v;
+            cur->pos += i + 1;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Decodes n varints into values. Runs of eight that all fit into one
+ * byte, the usual case for ID and block differences, are copied out
+ * of one 8-byte load.
+ */
+static int take_varints(struct mft_cursor *cur, uint64_t *values, size_t n)
+{
+    size_t i = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (n - i >= 8 && cur->len - cur->pos >= sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, cur->base + cur->pos, sizeof(word));
+        if (word & VARINT_HIGH_BITS)
+            break;
+        for (int j = 0; j < 8; j++)
+        {
+            values[i + j] = (word >> (8 * j)) & 0xff;
+        }
+        cur->pos += 8;
+        i += 8;
+    }
+#endif
+    for (; i < n; i++)
+    {
+        if (take_varint(cur, &values[i]) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Reads a count that takes at least one byte per element, so it can
+ * be checked against what is left of the table before anything is
+ * allocated for it.
+ */
+static int take_count(struct mft_cursor *cur, size_t per_element, uint64_t *count)
+{
+    if (take_varint(cur, count) != 0 || *count > INT32_MAX || *count * per_element > cur->len - cur->pos)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Decodes a version 3 record. The context only changes once the whole
+ * record has been read, so a record that is cut short can be decoded
+ * again after more of the table has been read in.
+ */
+static int decode_v3(struct mft_cursor *cur, struct mft_record *rec)
+{
+    struct mft_context *ctx = cur->ctx;
+    struct mft_level *level = ctx == NULL ? NULL : context_level(ctx);
+    uint64_t id, prefix, rest_len;
+    const char *rest;
+    const char *type;
+    if (level == NULL
+        || take_varint(cur, &id) != 0
+        || take_varint(cur, &prefix) != 0
+        || prefix > level->name_len
+        || take_count(cur, 1, &rest_len) != 0
+        || (rest = mft_take(cur, rest_len)) == NULL
+        || (type = mft_take(cur, sizeof(char))) == NULL)
+    {
+        return -1;
+    }
+    rec->id = ctx->prev_id + (int)unzigzag(id);
+    rec->is_directory = *type;
+    rec->has_usage = 0;
+    rec->transient = 1;
+    rec->num_children = 0;
+    rec->child_ids = ctx->ids;
+    rec->child_id_size = sizeof(int32_t);
+    rec->filesize = 0;
+    rec->num_blocks = 0;
+    rec->blocks = ctx->blocks;
+    rec->block_size = sizeof(size_t);
+
+    if (rec->is_directory)
+    {
+        uint64_t n;
+        if (take_count(cur, 1, &n) != 0
+            || grow_scratch((void **)&ctx->values, &ctx->values_cap, n, sizeof(uint64_t)) != 0
+            || grow_scratch((void **)&ctx->ids, &ctx->ids_cap, n, sizeof(int32_t)) != 0
+            || take_varints(cur, ctx->values, n) != 0)
+        {
+            return -1;
+        }
+        int32_t prev = rec->id;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            prev += (int32_t)unzigzag(ctx->values[i]);
+            ctx->ids[i] = prev;
+        }
+        rec->num_children = n;
+        rec->child_ids = ctx->ids;
+    }
+    else
+    {
+        uint64_t filesize, num_blocks, num_runs;
+        if (take_varint(cur, &filesize) != 0
+            || take_varint(cur, &num_blocks) != 0
+            || num_blocks > (uint32_t)filesize // every block holds at least one byte
+            || take_count(cur, 2, &num_runs) != 0
+            || num_runs > num_blocks
+            || grow_scratch((void **)&ctx->values, &ctx->values_cap, 2 * num_runs, sizeof(uint64_t)) != 0
+            || grow_scratch((void **)&ctx->blocks, &ctx->blocks_cap, num_blocks, sizeof(size_t)) != 0
+            || take_varints(cur, ctx->values, 2 * num_runs) != 0)
+        {
+            return -1;
+        }
+        uint64_t end = 0;
+        uint64_t num = 0;
+        for (uint64_t r = 0; r < num_runs; r++)
+        {
+            uint64_t start = end + unzigzag(ctx->values[2 * r]);
+            uint64_t len = ctx->values[2 * r + 1];
+            if (len == 0 || len > num_blocks - num)
+            {
+                return -1;
+            }
+            for (uint64_t b = 0; b < len; b++)
+            {
+                ctx->blocks[num++] = start + b;
+            }
+            end = start + len;
+        }
+        if (num != num_blocks)
+        {
+            return -1;
+        }
+        rec->filesize = (int)filesize;
+        rec->num_blocks = num_blocks;
+        rec->blocks = ctx->blocks;
+    }
+
+    if (set_level_name(level, prefix, rest, rest_len) != 0)
+    {
+        return -1;
+    }
+    rec->name = level->name;
+    rec->name_len = level->name_len;
+    ctx->prev_id = rec->id;
+    context_next(ctx, rec->num_children);
+    return 0;
+}
+
+static void encode_v3(struct mft_buffer *buf, const struct mft_record *rec)
+{
+    struct mft_context *ctx = buf->ctx;
+    struct mft_level *level = ctx == NULL ? NULL : context_level(ctx);
+    if (level == NULL)
+    {
+        buf->failed = 1;
+        return;
+    }
+
+    put_varint(buf, zigzag((int64_t)rec->id - ctx->prev_id));
+    ctx->prev_id = rec->id;
+
+    size_t prefix = 0;
+    while (prefix < level->name_len && prefix < (size_t)rec->name_len && level->name[prefix] == rec->name[prefix])
+    {
+        prefix++;
+    }
+    put_varint(buf, prefix);
+    put_varint(buf, rec->name_len - prefix);
+    mft_put(buf, rec->name + prefix, rec->name_len - prefix);
+    if (set_level_name(level, prefix, rec->name + prefix, rec->name_len - prefix) != 0)
+    {
+        buf->failed = 1;
+        return;
+    }
+    mft_put(buf, &rec->is_directory, sizeof(char));
+
+    if (rec->is_directory)
+    {
+        put_varint(buf, rec->num_children);
+        int64_t prev = rec->id;
+        for (int i = 0; i < rec->num_children; i++)
+        {
+            int64_t id = mft_child_id(rec, i);
+            put_varint(buf, zigzag(id - prev));
+            prev = id;
+        }
+        context_next(ctx, rec->num_children);
+        return;
+    }
+
+    put_varint(buf, (uint32_t)rec->filesize);
+    put_varint(buf, rec->num_blocks);
+    int num_runs = 0;
+    for (int i = 0; i < rec->num_blocks; i++)
+    {
+        if (i == 0 || mft_block(rec, i) != mft_block(rec, i - 1) + 1)
+            num_runs++;
+    }
+    put_varint(buf, num_runs);
+    uint64_t end = 0;
+    for (int i = 0; i < rec->num_blocks;)
+    {
+        uint64_t start = mft_block(rec, i);
+        int len = 1;
+        while (i + len < rec->num_blocks && mft_block(rec, i + len) == start + len)
+            len++;
+        put_varint(buf, zigzag((int64_t)(start - end)));
+        put_varint(buf, len);
+        end = start + len;
+        i += len;
+    }
+    context_next(ctx, 0);
+}
+
+/* A directory that mft_scan() is in, with the number of its children
+ * still to come.
+ */
+struct scan_dir
+{
+    int id;
+    long remaining;
+};
+
+/* Reads more of the table into buf after the len bytes there, growing
+ * it if it is full. Returns the number of bytes read, 0 at the end of
+ * the file and -1 on failure.
+ */
+static ssize_t scan_fill(int fd, char **buf, size_t *cap, size_t len)
+{
+    if (len == *cap)
+    {
+        char *bigger = realloc(*buf, *cap * 2);
+        if (bigger == NULL)
+        {
+            return -1;
+        }
+        *buf = bigger;
+        *cap *= 2;
+    }
+    for (;;)
+    {
+        ssize_t num = read(fd, *buf + len, *cap - len);
+        if (num >= 0 || errno != EINTR)
+            return num;
+    }
+}
+
+int mft_scan(const char *master_file_table, mft_visitor visit, void *arg)
+{
+    int fd = open(master_file_table, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to open file %s\n", master_file_table);
+        return -1;
+    }
+    struct stat st;
+    size_t cap = MFT_SCAN_BUFSIZE;
+    char *buf = malloc(cap);
+    struct mft_context *ctx = mft_context_new();
+    struct scan_dir *dirs = NULL;
+    int num_dirs = 0;
+    int dirs_cap = 0;
+    int retval = -1;
+    if (fstat(fd, &st) != 0 || buf == NULL || ctx == NULL)
+    {
+        goto out;
+    }
+
+    // the header is read on its own; only its own bytes are looked at
+    struct mft_header header;
+    ssize_t head = pread(fd, &header, sizeof(header), 0);
+    int version = mft_read_header((const char *)&header, head < 0 ? 0 : st.st_size, NULL);
+    if (head < 0 || version < 0 || lseek(fd, mft_first_record(version), SEEK_SET) < 0)
+    {
+        goto out;
+    }
+
+    struct mft_cursor cur = { buf, 0, 0, ctx };
+    int eof = 0;
+    int started = 0;
+    while (!started || num_dirs > 0)
+    {
+        struct mft_record rec;
+        size_t start = cur.pos;
+        if (mft_decode_record(&cur, version, &rec) != 0)
+        {
+            // the record may just be cut off by the end of the buffer
+            if (eof)
+            {
+                goto out;
+            }
+            memmove(buf, buf + start, cur.len - start);
+            cur.len -= start;
+            cur.pos = 0;
+            ssize_t num = scan_fill(fd, &buf, &cap, cur.len);
+            if (num < 0)
+            {
+                goto out;
+            }
+            eof = num == 0;
+            cur.base = buf;
+            cur.len += num;
+            continue;
+        }
+
+        int parent_id = num_dirs > 0 ? dirs[num_dirs - 1].id : -1;
+        int stop = visit(&rec, num_dirs, parent_id, arg);
+        if (stop != 0)
+        {
+            retval = stop;
+            goto out;
+        }
+        started = 1;
+
+        if (num_dirs > 0)
+        {
+            dirs[num_dirs - 1].remaining--;
+        }
+        if (rec.num_children > 0)
+        {
+            if (num_dirs == dirs_cap)
+            {
+                int num = dirs_cap ? dirs_cap * 2 : 16;
+                struct scan_dir *bigger = realloc(dirs, num * sizeof(struct scan_dir));
+                if (bigger == NULL)
+                {
+                    goto out;
+                }
+                dirs = bigger;
+                dirs_cap = num;
+            }
+            dirs[num_dirs].id = rec.id;
+            dirs[num_dirs].remaining = rec.num_children;
+            num_dirs++;
+        }
+        while (num_dirs > 0 && dirs[num_dirs - 1].remaining == 0)
+        {
+            num_dirs--;
+        }
+    }
+    retval = 0;
+
+out:
+    if (retval < 0)
+    {
+        fprintf(stderr, "File %s is not a valid master file table\n", master_file_table);
+    }
+    close(fd);
+    free(buf);
+    free(dirs);
+    mft_context_free(ctx);
+    return retval;
+}
+
+/* Writes len bytes to fd, carrying on after short writes. */
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t num = write(fd, data, len);
+        if (num < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += num;
+        len -= num;
+    }
+    return 0;
+}
+
+int mft_replace_file(const char *path, const char *data, size_t len)
+{
+    size_t path_len = strlen(path);
+    char *tmp_name = malloc(path_len + sizeof(".XXXXXX"));
+    if (tmp_name == NULL)
+    {
+        return -1;
+    }
+    memcpy(tmp_name, path, path_len);
+    memcpy(tmp_name + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+    int fd = mkstemp(tmp_name);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to create a temporary file for %s\n", path);
+        perror("reason:");
+        free(tmp_name);
+        return -1;
+    }
+    fchmod(fd, 0644);
+
+    if (write_all(fd, data, len) != 0 || fsync(fd) != 0)
+    {
+        fprintf(stderr, "Failed to write %s\n", tmp_name);
+        perror("reason:");
+        close(fd);
+        unlink(tmp_name);
+        free(tmp_name);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp_name, path) != 0)
+    {
+        fprintf(stderr, "Failed to rename %s to %s\n", tmp_name, path);
+        perror("reason:");
+        unlink(tmp_name);
+        free(tmp_name);
+        return -1;
+    }
+    free(tmp_name);
+
+    // make the rename itself durable
+    char *dir_name = strdup(path);
+    if (dir_name != NULL)
+    {
+        char *slash = strrchr(dir_name, '/');
+        int dir_fd = open(slash == NULL ? "." : slash == dir_name ? "/" : (*slash = '\0', dir_name), O_RDONLY | O_DIRECTORY);
+        if (dir_fd >= 0)
+        {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+        free(dir_name);
+    }
+    return 0;
+}
+
+uint64_t mft_hash(const void *data, size_t len, uint64_t seed)
+{
+    const unsigned char *p = data;
+    uint64_t hash = seed;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Returns path with suffix appended in a new string.
+static char *suffixed_name(const char *path, const char *suffix)
+{
+    size_t len = strlen(path);
+    size_t suffix_len = strlen(suffix);
+    char *name = malloc(len + suffix_len + 1);
+    if (name != NULL)
+    {
+        memcpy(name, path, len);
+        memcpy(name + len, suffix, suffix_len + 1);
+    }
+    return name;
+}
+
+char *mft_log_name(const char *master_file_table)
+{
+    return suffixed_name(master_file_table, ".log");
+}
+
+int mft_log_identify(const char *master_file_table, struct mft_log_header *header)
+{
+    struct stat st;
+    if (stat(master_file_table, &st) != 0)
+    {
+        return -1;
+    }
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, MFT_LOG_MAGIC, sizeof(header->magic));
+    header->version = MFT_V2;
+    header->base_dev = st.st_dev;
+    header->base_ino = st.st_ino;
+    header->base_size = st.st_size;
+    header->base_mtime_sec = st.st_mtim.tv_sec;
+    header->base_mtime_nsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+long mft_log_append(const char *master_file_table, const char *records, size_t len, uint32_t count)
+{
+    struct mft_log_header want;
+    if (mft_log_identify(master_file_table, &want) != 0)
+    {
+        return -1;
+    }
+    char *name = mft_log_name(master_file_table);
+    if (name == NULL)
+    {
+        return -1;
+    }
+    int fd = open(name, O_RDWR | O_CREAT, 0644);
+    free(name);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    struct mft_log_header have;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0)
+    {
+        if (write_all(fd, (const char *)&want, sizeof(want)) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        st.st_size = sizeof(want);
+    }
+    else if (pread(fd, &have, sizeof(have), 0) != sizeof(have) || memcmp(&have, &want, sizeof(want)) != 0)
+    {
+        close(fd);
+        return -2;
+    }
+
+    struct mft_log_batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.count = count;
+    batch.len = len;
+    batch.checksum = mft_hash(records, len, MFT_HASH_SEED);
+
+    // the batch goes after the last complete one, over anything a crash left behind
+    off_t end = st.st_size;
+    if (lseek(fd, end, SEEK_SET) != end
+        || write_all(fd, (const char *)&batch, sizeof(batch)) != 0
+        || write_all(fd, records, len) != 0
+        || fsync(fd) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return end + sizeof(batch) + len;
+}
+
+long mft_log_replay(const char *master_file_table, int (*apply)(const struct mft_record *rec, void *arg), void *arg)
+{
+    struct mft_log_header want;
+    char *name = mft_log_name(master_file_table);
+    if (name == NULL || mft_log_identify(master_file_table, &want) != 0)
+    {
+        free(name);
+        return -1;
+    }
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+    {
+        free(name);
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(want))
+    {
+        close(fd);
+        free(name);
+        return 0;
+    }
+    char *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        free(name);
+        return -1;
+    }
+    if (memcmp(addr, &want, sizeof(want)) != 0)
+    {
+        fprintf(stderr, "Ignoring %s, it belongs to an older %s\n", name, master_file_table);
+        munmap(addr, st.st_size);
+        free(name);
+        return 0;
+    }
+
+    long num = 0;
+    struct mft_cursor cur = { addr, st.st_size, sizeof(want), NULL };
+    for (;;)
+    {
+        struct mft_log_batch batch;
+        const char *p = mft_take(&cur, sizeof(batch));
+        if (p == NULL)
+            break;
+        memcpy(&batch, p, sizeof(batch));
+        const char *records = mft_take(&cur, batch.len);
+        if (records == NULL || mft_hash(records, batch.len, MFT_HASH_SEED) != batch.checksum)
+        {
+            fprintf(stderr, "%s ends in an incomplete batch, which is ignored\n", name);
+            break;
+        }
+
+        struct mft_cursor rc = { records, batch.len, 0, NULL };
+        for (uint32_t i = 0; i < batch.count; i++)
+        {
+            struct mft_record rec;
+            if (mft_decode_record(&rc, MFT_V2, &rec) != 0 || apply(&rec, arg) != 0)
+            {
+                munmap(addr, st.st_size);
+                free(name);
+                return -1;
+            }
+            num++;
+        }
+    }
+
+    munmap(addr, st.st_size);
+    free(name);
+    return num;
+}
+
+int mft_log_exists(const char *master_file_table)
+{
+    struct mft_log_header want, have;
+    char *name = mft_log_name(master_file_table);
+    if (name == NULL || mft_log_identify(master_file_table, &want) != 0)
+    {
+        free(name);
+        return 0;
+    }
+    int fd = open(name, O_RDONLY);
+    free(name);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    int exists = pread(fd, &have, sizeof(have), 0) == sizeof(have) && memcmp(&have, &want, sizeof(want)) == 0;
+    close(fd);
+    return exists;
+}
+
+void mft_log_remove(const char *master_file_table)
+{
+    char *name = mft_log_name(master_file_table);
+    if (name != NULL)
+    {
+        unlink(name);
+        free(name);
+    }
+}
+
+/* The locks this process holds. flock() locks belong to an open file,
+ * so a second open of the lock file would wait for the first one; all
+ * threads of the process share one open lock file per table, and this
+ * list counts their holds like a read-write lock: shared holds wait for
+ * an exclusive one of another thread, and an exclusive hold waits until
+ * the other threads' holds are gone and then turns the flock exclusive.
+ * The thread that holds the table exclusively may lock it again, either
+ * way.
+ */
+struct held_lock
+{
+    char *name;
+    int fd;
+    int readers;      // shared holds
+    int writers;      // exclusive holds, all by writer
+    pthread_t writer;
+    int busy;         // the flock is being taken or changed
+    struct held_lock *next;
+};
+
+static struct held_lock *held_locks = NULL;
+static pthread_mutex_t held_locks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t held_locks_changed = PTHREAD_COND_INITIALIZER;
+
+/* Takes or changes the flock of fd, without held_locks_lock. */
+static int set_flock(int fd, int operation)
+{
+    while (flock(fd, operation) != 0)
+    {
+        if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Removes h from the list and closes its file, which releases the lock.
+ * held_locks_lock must be held.
+ */
+static void forget_lock(struct held_lock *h)
+{
+    for (struct held_lock **p = &held_locks; *p != NULL; p = &(*p)->next)
+    {
+        if (*p == h)
+        {
+            *p = h->next;
+            break;
+        }
+    }
+    if (h->fd >= 0)
+    {
+        close(h->fd);
+    }
+    free(h->name);
+    free(h);
+}
+
+int mft_lock(const char *master_file_table, int exclusive)
+{
+    char *name = suffixed_name(master_file_table, ".lock");
+    if (name == NULL)
+    {
+        return -1;
+    }
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&held_locks_lock);
+    for (;;)
+    {
+        struct held_lock *h = held_locks;
+        while (h != NULL && strcmp(h->name, name) != 0)
+        {
+            h = h->next;
+        }
+
+        if (h == NULL)
+        {
+            h = calloc(1, sizeof(struct held_lock));
+            if (h == NULL)
+            {
+                pthread_mutex_unlock(&held_locks_lock);
+                free(name);
+                return -1;
+            }
+            h->name = name;
+            h->fd = -1;
+            h->busy = 1;
+            h->next = held_locks;
+            held_locks = h;
+            pthread_mutex_unlock(&held_locks_lock);
+
+            int fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+            if (fd < 0)
+            {
+                fd = open(name, O_RDONLY | O_CLOEXEC); // a reader may not be allowed to create it
+            }
+            if (fd >= 0 && set_flock(fd, exclusive ? LOCK_EX : LOCK_SH) != 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+
+            pthread_mutex_lock(&held_locks_lock);
+            h->busy = 0;
+            pthread_cond_broadcast(&held_locks_changed);
+            if (fd < 0)
+            {
+                forget_lock(h);
+                pthread_mutex_unlock(&held_locks_lock);
+                return -1;
+            }
+            h->fd = fd;
+            if (exclusive)
+            {
+                h->writers = 1;
+                h->writer = self;
+            }
+            else
+            {
+                h->readers = 1;
+            }
+            pthread_mutex_unlock(&held_locks_lock);
+            return fd;
+        }
+
+        int mine = h->writers > 0 && pthread_equal(h->writer, self);
+        if (!h->busy && (mine || (h->writers == 0 && (!exclusive || h->readers == 0))))
+        {
+            free(name);
+            int fd = h->fd;
+            if (!exclusive || h->writers > 0)
+            {
+                // a shared hold, or the writer locking again
+                if (exclusive)
+                    h->writers++;
+                else
+                    h->readers++;
+                pthread_mutex_unlock(&held_locks_lock);
+                return fd;
+            }
+            // no other hold is left, so the flock may turn exclusive
+            h->writers = 1;
+            h->writer = self;
+            h->busy = 1;
+            pthread_mutex_unlock(&held_locks_lock);
+            int retval = set_flock(h->fd, LOCK_EX);
+            pthread_mutex_lock(&held_locks_lock);
+            h->busy = 0;
+            pthread_cond_broadcast(&held_locks_changed);
+            if (retval != 0)
+            {
+                h->writers = 0;
+                if (h->readers == 0)
+                {
+                    forget_lock(h);
+                }
+                pthread_mutex_unlock(&held_locks_lock);
+                return -1;
+            }
+            pthread_mutex_unlock(&held_locks_lock);
+            return fd;
+        }
+        pthread_cond_wait(&held_locks_changed, &held_locks_lock);
+    }
+}
+
+void mft_unlock(int fd, int exclusive)
+{
+    if (fd < 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&held_locks_lock);
+    for (struct held_lock *h = held_locks; h != NULL; h = h->next)
+    {
+        if (h->fd != fd)
+        {
+            continue;
+        }
+        if (exclusive ? h->writers == 0 : h->readers == 0)
+        {
+            break; // not held that way
+        }
+        if (exclusive)
+        {
+            h->writers--;
+        }
+        else
+        {
+            h->readers--;
+        }
+        if (h->readers == 0 && h->writers == 0)
+        {
+            forget_lock(h);
+        }
+        else if (exclusive && h->writers == 0)
+        {
+            // the writer still has shared holds; other processes may read now
+            set_flock(fd, LOCK_SH);
+        }
+        pthread_cond_broadcast(&held_locks_changed);
+        break;
+    }
+    pthread_mutex_unlock(&held_locks_lock);
+}
+
+uint64_t mft_generation(const char *master_file_table, int fd)
+{
+    int own = -1;
+    if (fd < 0)
+    {
+        char *name = suffixed_name(master_file_table, ".lock");
+        fd = own = name != NULL ? open(name, O_RDONLY | O_CLOEXEC) : -1;
+        free(name);
+    }
+    uint64_t generation;
+    if (fd < 0 || pread(fd, &generation, sizeof(generation), 0) != sizeof(generation))
+    {
+        generation = 0;
+    }
+    if (own >= 0)
+    {
+        close(own);
+    }
+    return generation;
+}
+
+uint64_t mft_next_generation(int fd)
+{
+    if (fd < 0)
+    {
+        return 0;
+    }
+    uint64_t generation = mft_generation(NULL, fd) + 1;
+    return pwrite(fd, &generation, sizeof(generation), 0) == sizeof(generation) ? generation : 0;
+}
+
+struct mft_index
+{
+    const char *addr; // the index file
+    size_t len;
+    const struct mft_index_slot *slots;
+    uint64_t mask;    // num_slots - 1
+    const char *base; // the table
+    size_t base_len;
+    int version;
+};
+
+char *mft_index_name(const char *master_file_table)
+{
+    return suffixed_name(master_file_table, ".idx");
+}
+
+void mft_index_remove(const char *master_file_table)
+{
+    char *name = mft_index_name(master_file_table);
+    if (name != NULL)
+    {
+        unlink(name);
+        free(name);
+    }
+}
+
+/* A directory whose records are still coming while the index is
+ * built: the length of its path, its entry and the number of children
+ * to go.
+ */
+struct index_dir
+{
+    size_t path_len;
+    size_t entry;
+    long remaining;
+};
+
+int mft_index_write(const char *master_file_table, const char *table, size_t len)
+{
+    int version = mft_read_header(table, len, NULL);
+    if (version != MFT_V1 && version != MFT_V2)
+    {
+        // a version 3 record cannot be decoded without the ones before it
+        mft_index_remove(master_file_table);
+        return version < 0 ? -1 : 0;
+    }
+
+    struct mft_index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MFT_INDEX_MAGIC, sizeof(header.magic));
+    header.version = 2;
+    if (mft_log_identify(master_file_table, &header.base) != 0)
+    {
+        return -1;
+    }
+
+    struct mft_index_slot *entries = NULL;
+    size_t num_entries = 0, entries_cap = 0;
+    struct index_dir *dirs = NULL;
+    size_t depth = 0, dirs_cap = 0;
+    char *path = NULL;
+    size_t path_cap = 0;
+    uint64_t *slot_of = NULL;
+    int retval = -1;
+
+    struct mft_cursor cur = { table, len, mft_first_record(version), NULL };
+    for (;;)
+    {
+        // the parent of this record is the innermost directory with children to go
+        while (depth > 0 && dirs[depth - 1].remaining == 0)
+            depth--;
+        if (depth == 0 && num_entries > 0)
+            break; // the whole tree of the root is done
+        size_t offset = cur.pos;
+        struct mft_record rec;
+        if (mft_decode_record(&cur, version, &rec) != 0)
+            goto out;
+
+        // the root is "/", everything else its parent's path, a "/" unless that is the root, and its name
+        size_t parent_len = depth > 0 ? dirs[depth - 1].path_len : 0;
+        size_t path_len = depth == 0 ? 1 : parent_len + (depth > 1) + rec.name_len;
+        if (grow_scratch((void **)&path, &path_cap, path_len + 1, 1) != 0)
+            goto out;
+        if (depth == 0)
+        {
+            path[0] = '/';
+        }
+        else
+        {
+            if (depth > 1)
+                path[parent_len] = '/';
+            memcpy(path + path_len - rec.name_len, rec.name, rec.name_len);
+            dirs[depth - 1].remaining--;
+        }
+
+        if (grow_scratch((void **)&entries, &entries_cap, num_entries + 1, sizeof(*entries)) != 0)
+            goto out;
+        entries[num_entries].hash = mft_hash(path, path_len, MFT_HASH_SEED);
+        entries[num_entries].offset = offset + 1;
+        entries[num_entries].parent = depth > 0 ? dirs[depth - 1].entry + 1 : 0; // an entry until the slots are known
+        num_entries++;
+
+        if (rec.is_directory && rec.num_children > 0)
+        {
+            if (grow_scratch((void **)&dirs, &dirs_cap, depth + 1, sizeof(*dirs)) != 0)
+                goto out;
+            dirs[depth].path_len = path_len;
+            dirs[depth].entry = num_entries - 1;
+            dirs[depth].remaining = rec.num_children;
+            depth++;
+        }
+    }
+
+    // at most half full, so that a miss ends after a few slots
+    uint64_t num_slots = 1;
+    while (num_slots < 2 * num_entries)
+        num_slots *= 2;
+    header.num_slots = num_slots;
+    header.num_entries = num_entries;
+
+    size_t size = sizeof(header) + num_slots * sizeof(struct mft_index_slot);
+    char *data = calloc(1, size);
+    slot_of = malloc(num_entries * sizeof(*slot_of));
+    if (data == NULL || slot_of == NULL)
+    {
+        free(data);
+        goto out;
+    }
+    memcpy(data, &header, sizeof(header));
+    struct mft_index_slot *slots = (struct mft_index_slot *)(data + sizeof(header));
+    for (size_t i = 0; i < num_entries; i++)
+    {
+        uint64_t slot = entries[i].hash & (num_slots - 1);
+        while (slots[slot].offset != 0)
+            slot = (slot + 1) & (num_slots - 1);
+        slots[slot] = entries[i];
+        slot_of[i] = slot;
+    }
+    // parents come before their children, so each has its slot by now
+    for (size_t i = 0; i < num_entries; i++)
+    {
+        if (entries[i].parent != 0)
+            slots[slot_of[i]].parent = slot_of[entries[i].parent - 1] + 1;
+    }
+
+    char *name = mft_index_name(master_file_table);
+    if (name != NULL)
+    {
+        retval = mft_replace_file(name, data, size);
+        free(name);
+    }
+    free(data);
+
+out:
+    free(entries);
+    free(dirs);
+    free(path);
+    free(slot_of);
+    return retval;
+}
+
+struct mft_index *mft_index_open(const char *master_file_table)
+{
+    struct mft_log_header base;
+    if (mft_log_identify(master_file_table, &base) != 0 || mft_log_exists(master_file_table)
+        || wal_exists(master_file_table))
+    {
+        return NULL; // the table has changed since its last full save
+    }
+    char *name = mft_index_name(master_file_table);
+    if (name == NULL)
+    {
+        return NULL;
+    }
+    int fd = open(name, O_RDONLY);
+    free(name);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    struct mft_index *index = calloc(1, sizeof(struct mft_index));
+    struct stat st;
+    if (index == NULL || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct mft_index_header))
+    {
+        close(fd);
+        free(index);
+        return NULL;
+    }
+    index->len = st.st_size;
+    index->addr = mmap(NULL, index->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (index->addr == MAP_FAILED)
+    {
+        free(index);
+        return NULL;
+    }
+
+    struct mft_index_header header;
+    memcpy(&header, index->addr, sizeof(header));
+    if (memcmp(header.magic, MFT_INDEX_MAGIC, sizeof(header.magic)) != 0 || header.version != 2
+        || memcmp(&header.base, &base, sizeof(base)) != 0
+        || header.num_slots == 0 || (header.num_slots & (header.num_slots - 1)) != 0
+        || header.num_slots > (index->len - sizeof(header)) / sizeof(struct mft_index_slot)
+        || index->len != sizeof(header) + header.num_slots * sizeof(struct mft_index_slot))
+    {
+        munmap((void *)index->addr, index->len);
+        free(index);
+        return NULL;
+    }
+    index->slots = (const struct mft_index_slot *)(index->addr + sizeof(header));
+    index->mask = header.num_slots - 1;
+
+    fd = open(master_file_table, O_RDONLY);
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        index->base_len = st.st_size;
+        index->base = mmap(NULL, index->base_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (index->base == NULL || index->base == MAP_FAILED
+        || (index->version = mft_read_header(index->base, index->base_len, NULL)) < 0
+        || index->version == MFT_V3)
+    {
+        if (index->base != NULL && index->base != MAP_FAILED)
+            munmap((void *)index->base, index->base_len);
+        munmap((void *)index->addr, index->len);
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+/* Returns 1 if the record in slot, decoded into rec, is the one of the
+ * first path_len bytes of path: its name is the last one of the path,
+ * and so on up the parents to the root. Returns 0 if it is some other
+ * record and -1 if the index or the table is not valid.
+ */
+static int index_path_is(const struct mft_index *index, uint64_t slot, const struct mft_record *rec,
+                         const char *path, size_t path_len)
+{
+    struct mft_record parent;
+    size_t end = path_len; // what is left of the path to match
+    for (;;)
+    {
+        struct mft_index_slot entry;
+        memcpy(&entry, &index->slots[slot], sizeof(entry));
+        if (entry.parent == 0)
+        {
+            return end == 1 && path[0] == '/'; // the root
+        }
+        if (end <= 1 || entry.parent - 1 > index->mask)
+        {
+            return end <= 1 ? 0 : -1;
+        }
+        const char *name = path + end;
+        while (name > path && name[-1] != '/')
+            name--;
+        if (name == path)
+        {
+            return 0;
+        }
+        if ((size_t)rec->name_len != (size_t)(path + end - name) || memcmp(rec->name, name, rec->name_len) != 0)
+        {
+            return 0;
+        }
+        // "/a" leaves the root, "/"
+        end = name - 1 - path > 0 ? (size_t)(name - 1 - path) : 1;
+
+        slot = entry.parent - 1;
+        memcpy(&entry, &index->slots[slot], sizeof(entry));
+        if (entry.offset == 0 || entry.offset - 1 >= index->base_len)
+        {
+            return -1;
+        }
+        struct mft_cursor cur = { index->base, index->base_len, entry.offset - 1, NULL };
+        if (mft_decode_record(&cur, index->version, &parent) != 0)
+        {
+            return -1;
+        }
+        rec = &parent;
+    }
+}
+
+int mft_index_find(const struct mft_index *index, const char *path, struct mft_record *rec)
+{
+    size_t path_len = strlen(path);
+    uint64_t hash = mft_hash(path, path_len, MFT_HASH_SEED);
+
+    uint64_t slot = hash & index->mask;
+    for (uint64_t probes = 0; probes <= index->mask; probes++, slot = (slot + 1) & index->mask)
+    {
+        struct mft_index_slot entry;
+        memcpy(&entry, &index->slots[slot], sizeof(entry));
+        if (entry.offset == 0)
+        {
+            return 1;
+        }
+        if (entry.hash != hash || entry.offset - 1 >= index->base_len)
+        {
+            continue;
+        }
+        struct mft_cursor cur = { index->base, index->base_len, entry.offset - 1, NULL };
+        if (mft_decode_record(&cur, index->version, rec) != 0)
+        {
+            return -1;
+        }
+        // a different path with the same hash differs in some name on the way up
+        int is = index_path_is(index, slot, rec, path, path_len);
+        if (is != 0)
+        {
+            return is > 0 ? 0 : -1;
+        }
+    }
+    return 1;
+}
+
+void mft_index_close(struct mft_index *index)
+{
+    if (index != NULL)
+    {
+        munmap((void *)index->addr, index->len);
+        munmap((void *)index->base, index->base_len);
+        free(index);
+    }
+}
@@ -0,0 +1,378 @@
+#ifndef MFT_H
+#define MFT_H
+
+#include "inode.h"
+
+#include <stdint.h>
+
+/* On-disk formats of the master file table.
+ *
+ * Version 1 is the layout from the assignment. There is no header;
+ * the file is the records of all inodes in depth-first order, starting
+ * with the root. A record is
+ *     int id, int name length (with the 0), the name, char is_directory,
+ * followed for a directory by
+ *     int number of children, a size_t ID per child,
+ * and for a file by
+ *     int filesize, int number of blocks, a size_t per block.
+ *
+ * Version 2 starts with struct mft_header. The records follow in the
+ * same order, with fixed-width fields: IDs and block numbers take 4
+ * bytes, and a directory record also holds the totals of its subtree.
+ *     int32 id, uint32 name length (with the 0), the name, uint8 is_directory,
+ * then for a directory
+ *     uint32 number of children, an int32 ID per child,
+ *     uint32 files, uint32 dirs, uint32 blocks, uint64 bytes,
+ * and for a file
+ *     int32 filesize, uint32 number of blocks, a uint32 per block.
+ * After the records comes the offset table: max_id + 1 offsets of the
+ * record of every ID, 0 for IDs that are not in use. The offsets take
+ * 4 bytes while the records fit in 4 GB, and 8 bytes after that.
+ *
+ * Version 3 is the compact encoding. It starts with struct mft_header
+ * too, with no offset table (table_offset and offset_size are 0), so
+ * it can only be read from the start. The records come in the same
+ * order, with numbers as varints: 7 bits per byte, low bits first, the
+ * top bit set on all bytes but the last. Signed differences are
+ * zigzag coded (0, -1, 1, -2, ... as 0, 1, 2, 3, ...). A record is
+ *     id minus the id of the record before it,
+ *     the length of the prefix the name shares with the previous
+ *     name in the same directory, the length of the rest, the rest
+ *     (without a 0), uint8 is_directory,
+ * then for a directory
+ *     number of children, each child ID minus the one before it
+ *     (the first minus the directory's own ID),
+ * and for a file
+ *     filesize, number of blocks, number of runs of consecutive
+ *     blocks, and per run its first block minus the end of the run
+ *     before it, and its length.
+ * Directory totals are not stored; the loader sums them up.
+ *
+ * All numbers are in host byte order.
+ */
+#define MFT_V1 1
+#define MFT_V2 2
+#define MFT_V3 3
+
+#define MFT_MAGIC "MFT\x02"
+#define MFT_MAGIC_V3 "MFT\x03"
+
+struct mft_header
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t num_inodes;
+	int32_t max_id;
+	uint64_t table_offset;
+	uint32_t offset_size;
+	uint32_t reserved;
+};
+
+/* What the version 3 encoding remembers from one record to the next:
+ * the ID of the last record, the directories that are still open with
+ * the number of their children yet to come, and the last name at each
+ * depth. It also holds the decoded name, child IDs and block numbers.
+ */
+struct mft_context;
+
+/* Returns a new context for reading or writing a version 3 table from
+ * its first record, or NULL if memory runs out.
+ */
+struct mft_context *mft_context_new(void);
+
+void mft_context_free(struct mft_context *ctx);
+
+/* A read position in a master file table held in memory. A version 3
+ * table needs a context, which the cursor reads from the start.
+ */
+struct mft_cursor
+{
+	const char *base;
+	size_t len;
+	size_t pos;
+	struct mft_context *ctx;
+};
+
+/* One inode record. After mft_decode_record() the pointers point into
+ * the table that was decoded. The child IDs and block numbers are kept
+ * as stored, child_id_size and block_size bytes each; read them with
+ * mft_child_id() and mft_block().
+ */
+struct mft_record
+{
+	int id;
+	const char *name; // 0-terminated
+	int name_len;     // without the 0
+	char is_directory;
+
+	int num_children;
+	const void *child_ids;
+	int child_id_size;
+
+	int filesize;
+	int num_blocks;
+	const void *blocks;
+	int block_size;
+
+	int has_usage; // whether usage holds the stored totals of a directory
+	struct fs_usage usage;
+
+	/* Set when name, child_ids and blocks point into the context of
+	 * the cursor rather than into the table, so they change with the
+	 * next record.
+	 */
+	int transient;
+};
+
+/* Returns a pointer to the next n bytes and moves past them, or NULL
+ * if the table ends before that.
+ */
+const char *mft_take(struct mft_cursor *cur, size_t n);
+
+/* Looks at the start of a table and returns its version, MFT_V1 when
+ * there is no header. For version 2 and 3 the header is copied to
+ * *header if header is not NULL. Returns -1 for a header that is cut short
+ * or has an unknown version.
+ */
+int mft_read_header(const char *base, size_t len, struct mft_header *header);
+
+/* Returns entry id of the offset table that starts at table in a
+ * version 2 table.
+ */
+uint64_t mft_table_entry(const struct mft_header *header, const char *table, int id);
+
+/* Returns the offset of the first record for the given version. */
+size_t mft_first_record(int version);
+
+/* Decodes the record at the cursor and moves past it. For a directory
+ * that is the record alone: the children are the records that follow.
+ * Returns 0 on success and -1 if the record is cut short or invalid.
+ */
+int mft_decode_record(struct mft_cursor *cur, int version, struct mft_record *rec);
+
+int mft_child_id(const struct mft_record *rec, int i);
+size_t mft_block(const struct mft_record *rec, int i);
+
+/* A growable buffer that a table is built in before it is written.
+ * Writing a version 3 table needs a context, like reading one.
+ */
+struct mft_buffer
+{
+	char *data;
+	size_t len;
+	size_t cap;
+	int failed;
+	struct mft_context *ctx;
+};
+
+/* Makes room for n more bytes. Returns a pointer to them, or NULL if
+ * memory runs out, which also marks the buffer as failed.
+ */
+char *mft_reserve(struct mft_buffer *buf, size_t n);
+
+void mft_put(struct mft_buffer *buf, const void *src, size_t n);
+
+/* Appends rec in the given version. For version 2 a directory record
+ * needs has_usage set.
+ */
+void mft_encode_record(struct mft_buffer *buf, int version, const struct mft_record *rec);
+
+/* Replaces the file path by the len bytes in data. They are written to
+ * a temporary file next to it, which is synced and then renamed over
+ * path, so a crash leaves either the old or the new file, never a
+ * mix. Returns 0 on success and -1 on failure.
+ */
+int mft_replace_file(const char *path, const char *data, size_t len);
+
+/* The size of the buffer mft_scan() reads the table through. */
+#define MFT_SCAN_BUFSIZE (64 * 1024)
+
+/* Called by mft_scan() for every record, with the depth of the inode
+ * (0 for the root) and the ID of the directory that holds it (-1 for
+ * the root). rec and what it points to are only valid during the call.
+ * Returning non-zero stops the scan.
+ */
+typedef int (*mft_visitor)(const struct mft_record *rec, int depth, int parent_id, void *arg);
+
+/* Reads master_file_table from start to end through a buffer of
+ * MFT_SCAN_BUFSIZE bytes and calls visit for every record, in the
+ * order they are stored, without building any inodes. Besides the
+ * buffer it keeps only the chain of open directories. The buffer only
+ * grows for a single record that does not fit into it, such as a
+ * directory with many thousands of children.
+ * Any version can be read; the delta log is not.
+ * Returns 0 after the last record, what visit returned if it stopped
+ * the scan, and -1 if the file cannot be read or is not valid.
+ */
+int mft_scan(const char *master_file_table, mft_visitor visit, void *arg);
+
+/* The delta log of a master file table is the file <table>.log. It
+ * lets save_inodes_incremental() append only what changed instead of
+ * rewriting the table.
+ *
+ * The log starts with struct mft_log_header, which names the table it
+ * belongs to by device, inode number, size and modification time. A
+ * log left over from any other file is ignored. Then come batches, one
+ * per save: struct mft_log_batch and count version 2 records of inodes
+ * that were created or changed. A directory record lists the children
+ * it has after the save, so a deleted inode is one that no directory
+ * lists any more. A batch whose checksum does not match, such as one
+ * cut short by a crash, ends the log.
+ */
+#define MFT_LOG_MAGIC "MFTL"
+
+struct mft_log_header
+{
+	char magic[4];
+	uint32_t version;
+	uint64_t base_dev;
+	uint64_t base_ino;
+	uint64_t base_size;
+	int64_t base_mtime_sec;
+	int64_t base_mtime_nsec;
+};
+
+struct mft_log_batch
+{
+	uint32_t count;
+	uint32_t reserved;
+	uint64_t len;
+	uint64_t checksum;
+};
+
+/* Fills in a log header for master_file_table as the file is now.
+ * Returns -1 if the file cannot be found.
+ */
+int mft_log_identify(const char *master_file_table, struct mft_log_header *header);
+
+/* Returns the name of the log of master_file_table in a new string. */
+char *mft_log_name(const char *master_file_table);
+
+/* Appends a batch of count version 2 records, len bytes at records, to
+ * the log of master_file_table and syncs it. The log is created if it
+ * does not exist. Returns the size of the log afterwards, -1 on
+ * failure and -2 if the log belongs to a different table.
+ */
+long mft_log_append(const char *master_file_table, const char *records, size_t len, uint32_t count);
+
+/* Calls apply for every record in the log of master_file_table, in the
+ * order they were written, until apply returns non-zero. The record
+ * points into memory that is only valid during the call.
+ * Returns the number of records, 0 if there is no log for the table as
+ * it is now, and -1 on failure.
+ */
+long mft_log_replay(const char *master_file_table, int (*apply)(const struct mft_record *rec, void *arg), void *arg);
+
+/* Returns 1 if master_file_table has a log that belongs to it. */
+int mft_log_exists(const char *master_file_table);
+
+/* Removes the log of master_file_table, if there is one. */
+void mft_log_remove(const char *master_file_table);
+
+/* The path index of a master file table is the file <table>.idx. It
+ * lets a single inode be looked up by its path without reading the
+ * rest of the table. save_inodes() writes it after every full save of
+ * a version 1 or 2 table; version 3 records cannot be decoded on their
+ * own, so those tables have no index.
+ *
+ * The index starts with struct mft_index_header, which names the table
+ * like a log header does, so an index left over from any other file is
+ * ignored. Then come num_slots slots, a power of two, of an open
+ * addressing hash table with linear probing. A slot holds the hash of
+ * a full path, such as "/etc/hosts" ("/" for the root), the offset of
+ * its record in the table plus 1, 0 marking an empty slot, and the slot
+ * of its parent directory plus 1, 0 for the root. A lookup follows the
+ * parents to compare every name of the path, so two paths with the same
+ * hash are told apart.
+ */
+#define MFT_INDEX_MAGIC "MFTI"
+
+struct mft_index_header
+{
+	char magic[4];
+	uint32_t version;
+	uint64_t num_slots;
+	uint64_t num_entries;
+	struct mft_log_header base;
+};
+
+struct mft_index_slot
+{
+	uint64_t hash;
+	uint64_t offset;
+	uint64_t parent;
+};
+
+/* Returns the name of the index of master_file_table in a new string. */
+char *mft_index_name(const char *master_file_table);
+
+/* Writes the index of master_file_table, which must just have been
+ * written from the len bytes at table. For a version 3 table, any old
+ * index is removed instead. Returns 0 on success and -1 on failure.
+ */
+int mft_index_write(const char *master_file_table, const char *table, size_t len);
+
+/* Removes the index of master_file_table, if there is one. */
+void mft_index_remove(const char *master_file_table);
+
+/* An open index, with the index and the table mapped. */
+struct mft_index;
+
+/* Maps the index of master_file_table and the table itself. Only the
+ * pages that lookups touch are read. Returns NULL if there is no index
+ * that belongs to the table as it is now, which includes a table with
+ * a delta log or a write-ahead log.
+ */
+struct mft_index *mft_index_open(const char *master_file_table);
+
+/* Finds the record of path and decodes it into rec, which points into
+ * the mapped table until the index is closed. Returns 0 if it is found,
+ * 1 if there is no such path and -1 if the table is not valid.
+ */
+int mft_index_find(const struct mft_index *index, const char *path, struct mft_record *rec);
+
+void mft_index_close(struct mft_index *index);
+
+/* The lock file of a master file table is <table>.lock. Processes
+ * that share a table hold a flock() on it: an exclusive one while they
+ * save the table, its delta log and its index, and a shared one while
+ * they load them, so a load never sees a new table with an old log.
+ * The file holds a uint64 generation, which every save increments, so
+ * a reader can tell cheaply whether the table changed since it loaded
+ * it. A table that was never saved with a lock is at generation 0.
+ */
+
+/* Locks the table, exclusive or shared, and returns the descriptor of
+ * the lock file, or -1 if it cannot be opened or locked, for example in
+ * a directory without write permission; the caller then goes on
+ * without the lock.
+ * The threads of a process share one lock file per table, by name, and
+ * their locks work like a read-write lock: a shared lock waits while
+ * another thread has the table exclusively, and an exclusive lock waits
+ * until the other threads' locks are gone before it takes the file
+ * exclusively. The thread with the exclusive lock may lock the table
+ * again either way. The file is unlocked by the last mft_unlock().
+ */
+int mft_lock(const char *master_file_table, int exclusive);
+
+/* Releases one lock that mft_lock() returned, of the same kind. */
+void mft_unlock(int fd, int exclusive);
+
+/* Returns the generation of the table, through an open lock file if fd
+ * is not -1 and from the name otherwise.
+ */
+uint64_t mft_generation(const char *master_file_table, int fd);
+
+/* Increments the generation in the lock file fd, which must be locked
+ * exclusively, and returns the new one, 0 on failure.
+ */
+uint64_t mft_next_generation(int fd);
+
+/* A 64-bit FNV-1a hash, used as checksum of log batches and for the
+ * paths in the index.
+ */
+uint64_t mft_hash(const void *data, size_t len, uint64_t seed);
+
+#define MFT_HASH_SEED 14695981039346656037ULL
+
+#endif
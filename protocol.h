@@ -0,0 +1,85 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+/* The protocol between serve_fs, which keeps one file system in memory,
+ * and its clients, over a Unix domain socket. All numbers are in the
+ * byte order of the host, since both ends run on it.
+ *
+ * A request is struct fs_request followed by path_len bytes of its
+ * path, without a 0. A client may send any number of requests without
+ * waiting; the server answers them in order, each with struct
+ * fs_response followed by length bytes of payload. The tag of a request
+ * is returned in its response and means nothing to the server.
+ */
+#define FS_PATH_MAX 4096
+
+enum fs_request_op
+{
+	FS_REQ_CREATE = 1, // create a file of arg bytes
+	FS_REQ_MKDIR,
+	FS_REQ_DELETE,     // delete a file
+	FS_REQ_RMDIR,      // delete an empty directory
+	FS_REQ_LOOKUP,     // payload: struct fs_entry without a name
+	FS_REQ_STAT,       // payload: struct fs_stat
+	FS_REQ_LIST,       // payload: a struct fs_entry and name per child
+	FS_REQ_SAVE,       // checkpoint now; no path
+	FS_REQ_STOP,       // checkpoint and exit once this is answered; no path
+	FS_NUM_REQUEST_OPS
+};
+
+enum fs_status
+{
+	FS_STATUS_OK,
+	FS_STATUS_NOT_FOUND, // the path or the directory it is in
+	FS_STATUS_EXISTS,
+	FS_STATUS_NOT_DIR,   // a part of the path, or the rmdir/list target, is a file
+	FS_STATUS_IS_DIR,    // delete of a directory
+	FS_STATUS_NOT_EMPTY,
+	FS_STATUS_NO_SPACE,  // no free blocks, or no memory
+	FS_STATUS_BAD_REQUEST,
+	FS_STATUS_FAILED,
+	FS_NUM_STATUS
+};
+
+struct fs_request
+{
+	uint32_t tag;
+	uint8_t op;
+	uint8_t pad;
+	uint16_t path_len;
+	int32_t arg;
+};
+
+struct fs_response
+{
+	uint32_t tag;
+	int16_t status;
+	uint16_t pad;
+	uint32_t length;
+};
+
+struct fs_entry
+{
+	int32_t id;
+	uint8_t is_directory;
+	uint8_t pad;
+	uint16_t name_len; // the name follows, without a 0
+};
+
+struct fs_stat
+{
+	int32_t id;
+	int32_t filesize;
+	int32_t num_blocks;
+	int32_t num_children;
+	uint8_t is_directory;
+	uint8_t pad[7];
+	int64_t tree_files; // the totals of the subtree, as fs_usage() gives them
+	int64_t tree_dirs;
+	int64_t tree_bytes;
+	int64_t tree_blocks;
+};
+
+#endif
@@ -0,0 +1,704 @@
+#include "inode.h"
+#include "allocation.h"
+#include "async.h"
+#include "data.h"
+#include "mft.h"
+#include "stats.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define PATH_LEN 4096
+
+/* A script is a list of operations on one file system, either as text
+ * with one operation per line, or in the binary form that -c writes,
+ * which is quicker to read for traces of millions of operations.
+ */
+enum script_opcode
+{
+    OP_FORMAT,  // format [BLOCKS]: an empty disk with a new root
+    OP_LOAD,    // load [lazy|parallel [THREADS]]: the tree from MFT
+    OP_MKDIR,   // mkdir PATH
+    OP_CREATE,  // create PATH SIZE
+    OP_DELETE,  // delete PATH
+    OP_RMDIR,   // rmdir PATH
+    OP_LOOKUP,  // lookup PATH
+    OP_SAVE,    // save [incremental]: the tree to MFT
+    OP_DEBUG,   // debug: debug_fs and debug_disk
+    OP_WRITE,   // write PATH [N]: fills the file with its pattern number N
+    OP_READ,    // read PATH [N]: checks that the file holds its pattern N
+    OP_SNAPSHOT,   // snapshot: takes a snapshot of the tree, one at a time
+    OP_SNAPLOOKUP, // snaplookup PATH: lookup in the snapshot
+    OP_SNAPSAVE,   // snapsave: the snapshot to MFT.snap
+    OP_SNAPDROP,   // snapdrop: drops the snapshot
+    OP_SNAPREAD,   // snapread PATH [N]: read in the snapshot
+    OP_LOCK,       // lock: fs_lock_table on MFT
+    OP_UNLOCK,     // unlock
+    OP_REFRESH,    // refresh: fs_refresh, loads MFT if another process saved it
+    OP_FIND,       // find PATH: lookup_inode in MFT, checked against the tree
+    NUM_SCRIPT_OPS
+};
+
+static const char* opcode_names[NUM_SCRIPT_OPS] =
+{
+    "format", "load", "mkdir", "create", "delete", "rmdir", "lookup", "save", "debug", "write", "read",
+    "snapshot", "snaplookup", "snapsave", "snapdrop", "snapread", "lock", "unlock", "refresh",
+    "find"
+};
+
+/* What an operation is expected to do, from "= ok" or "= fail" at the
+ * end of its line. lookup is ok if the path exists.
+ */
+#define EXPECT_NOTHING 0
+#define EXPECT_OK      1
+#define EXPECT_FAIL    2
+
+#define SCRIPT_MAGIC "FSOP"
+
+/* A binary script is the magic, a uint32 version and then the
+ * operations, each a struct script_record followed by word_len bytes
+ * of its path or mode word, without a 0.
+ */
+struct script_record
+{
+    uint8_t op;
+    uint8_t expect;
+    uint16_t word_len;
+    uint32_t arg;
+};
+
+struct script_op
+{
+    int op;
+    int expect;
+    long arg;   // the size, number of blocks, threads or pattern
+    char* word; // the path, or lazy, parallel or incremental
+};
+
+struct script
+{
+    FILE* f;
+    int binary;
+    long line;
+    char* buf;
+    size_t cap;
+};
+
+static int parse_opcode( const char* word )
+{
+    for( int op = 0; op < NUM_SCRIPT_OPS; op++ )
+    {
+        if( strcmp( word, opcode_names[op] ) == 0 )
+            return op;
+    }
+    return -1;
+}
+
+/* Reads the next operation into op; op->word points into the script
+ * until the next call. Returns 1 for an operation, 0 at the end and -1
+ * for a line that is not an operation.
+ */
+static int next_op( struct script* s, struct script_op* op )
+{
+    if( s->binary )
+    {
+        struct script_record rec;
+        if( fread( &rec, sizeof(rec), 1, s->f ) != 1 )
+            return 0;
+        s->line++;
+        if( rec.op >= NUM_SCRIPT_OPS || rec.expect > EXPECT_FAIL || rec.word_len >= PATH_LEN )
+            return -1;
+        if( s->cap < PATH_LEN )
+        {
+            s->buf = realloc( s->buf, PATH_LEN );
+            s->cap = PATH_LEN;
+            if( s->buf == NULL )
+                return -1;
+        }
+        if( fread( s->buf, 1, rec.word_len, s->f ) != rec.word_len )
+            return -1;
+        s->buf[rec.word_len] = 0;
+        op->op = rec.op;
+        op->expect = rec.expect;
+        op->arg = rec.arg;
+        op->word = s->buf;
+        return 1;
+    }
+
+    for( ;; )
+    {
+        if( getline( &s->buf, &s->cap, s->f ) < 0 )
+            return 0;
+        s->line++;
+        char* hash = strchr( s->buf, '#' );
+        if( hash != NULL )
+            *hash = 0;
+
+        char* saveptr = NULL;
+        char* words[5];
+        int n = 0;
+        for( char* w = strtok_r( s->buf, " \t\r\n", &saveptr ); w != NULL; w = strtok_r( NULL, " \t\r\n", &saveptr ) )
+        {
+            if( n == 5 )
+                return -1;
+            words[n++] = w;
+        }
+        if( n == 0 )
+            continue;
+
+        op->expect = EXPECT_NOTHING;
+        if( n >= 3 && strcmp( words[n - 2], "=" ) == 0 )
+        {
+            if( strcmp( words[n - 1], "ok" ) == 0 )
+                op->expect = EXPECT_OK;
+            else if( strcmp( words[n - 1], "fail" ) == 0 )
+                op->expect = EXPECT_FAIL;
+            else
+                return -1;
+            n -= 2;
+        }
+
+        op->op = parse_opcode( words[0] );
+        op->word = n > 1 ? words[1] : "";
+        op->arg = 0;
+        if( strlen( op->word ) >= PATH_LEN )
+            return -1;
+        switch( op->op )
+        {
+        case OP_FORMAT:
+            if( n > 2 )
+                return -1;
+            op->arg = n == 2 ? atol( words[1] ) : 0;
+            op->word = "";
+            return op->arg >= 0 ? 1 : -1;
+        case OP_LOAD:
+            if( n > 3 || ( n >= 2 && strcmp( words[1], "lazy" ) != 0 && strcmp( words[1], "parallel" ) != 0 ) )
+                return -1;
+            op->arg = n == 3 ? atol( words[2] ) : 0;
+            return 1;
+        case OP_SAVE:
+            return n == 1 || ( n == 2 && strcmp( words[1], "incremental" ) == 0 ) ? 1 : -1;
+        case OP_CREATE:
+            if( n != 3 )
+                return -1;
+            op->arg = atol( words[2] );
+            return op->word[0] == '/' && op->arg >= 0 ? 1 : -1;
+        case OP_MKDIR:
+        case OP_DELETE:
+        case OP_RMDIR:
+        case OP_WRITE:
+        case OP_READ:
+        case OP_SNAPREAD:
+            op->arg = n == 3 ? atol( words[2] ) : 0;
+            return ( n == 2 || n == 3 ) && op->word[0] == '/' && op->arg >= 0 ? 1 : -1;
+        case OP_LOOKUP:
+        case OP_SNAPLOOKUP:
+        case OP_FIND:
+            return n == 2 && op->word[0] == '/' ? 1 : -1;
+        case OP_DEBUG:
+        case OP_SNAPSHOT:
+        case OP_SNAPSAVE:
+        case OP_SNAPDROP:
+        case OP_LOCK:
+        case OP_UNLOCK:
+        case OP_REFRESH:
+            return n == 1 ? 1 : -1;
+        default:
+            return -1;
+        }
+    }
+}
+
+static int write_op( FILE* f, const struct script_op* op )
+{
+    struct script_record rec;
+    memset( &rec, 0, sizeof(rec) );
+    rec.op = op->op;
+    rec.expect = op->expect;
+    rec.word_len = strlen( op->word );
+    rec.arg = op->arg;
+    return fwrite( &rec, sizeof(rec), 1, f ) == 1 && fwrite( op->word, 1, rec.word_len, f ) == rec.word_len ? 0 : -1;
+}
+
+/* The state of the replay. The directory of the last path is kept, as
+ * traces tend to work in one directory for a while.
+ */
+struct replay
+{
+    char* mft;
+    const char* data_file;
+    int data;   // whether data_file is open
+    struct fs_io* io; // for read and write, or NULL to use fs_read() and fs_write()
+    struct inode* root;
+    struct inode* snapshot; // of root, or NULL
+    char* snapshot_mft;     // MFT.snap
+    int lock;               // from fs_lock_table, or -1
+    char last_dir[PATH_LEN];
+    struct inode* last_dir_node;
+};
+
+/* The contents that write gives a file and read expects: a byte that
+ * depends on the file, the offset and the number of the pattern, so
+ * that data written to the wrong block or the wrong file, or an older
+ * pattern, is found.
+ */
+static unsigned char pattern( int id, size_t offset, long number )
+{
+    return ( id * 31 + offset * 7 + ( offset >> 12 ) + number * 101 ) & 0xff;
+}
+
+/* Writes or checks pattern number of file, a megabyte per call.
+ * Returns 1 if all of it was written or matched and 0 if not.
+ */
+static int write_or_check( struct fs_io* io, struct inode* file, int check, long number )
+{
+    static unsigned char buf[1 << 20];
+    if( file == NULL || file->is_directory )
+        return 0;
+    for( size_t offset = 0; offset < (size_t)file->filesize; offset += sizeof(buf) )
+    {
+        size_t len = file->filesize - offset < sizeof(buf) ? file->filesize - offset : sizeof(buf);
+        if( !check )
+        {
+            for( size_t i = 0; i < len; i++ )
+                buf[i] = pattern( file->id, offset + i, number );
+            ssize_t n = io != NULL ? fs_io_write_file( io, file, offset, buf, len ) : fs_write( file, offset, buf, len );
+            if( n != (ssize_t)len )
+                return 0;
+            continue;
+        }
+        ssize_t n = io != NULL ? fs_io_read_file( io, file, offset, buf, len ) : fs_read( file, offset, buf, len );
+        if( n != (ssize_t)len )
+            return 0;
+        for( size_t i = 0; i < len; i++ )
+        {
+            if( buf[i] != pattern( file->id, offset + i, number ) )
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/* Returns the inode of path, following it from the root, or NULL. */
+static struct inode* resolve( struct inode* root, const char* path, size_t len )
+{
+    struct inode* node = root;
+    char name[PATH_LEN];
+    size_t pos = 1;
+    while( node != NULL && pos < len )
+    {
+        const char* end = memchr( path + pos, '/', len - pos );
+        size_t n = ( end != NULL ? (size_t)( end - path ) : len ) - pos;
+        if( n > 0 )
+        {
+            memcpy( name, path + pos, n );
+            name[n] = 0;
+            node = find_inode_by_name( node, name );
+        }
+        pos += n + 1;
+    }
+    return node;
+}
+
+/* Finds the directory that path is in and returns it, with *name set
+ * to the last part of path. Returns NULL if there is no such directory.
+ */
+static struct inode* parent_of( struct replay* r, char* path, char** name )
+{
+    char* slash = strrchr( path, '/' );
+    size_t len = slash - path;
+    *name = slash + 1;
+    if( r->last_dir_node != NULL && strlen( r->last_dir ) == len && memcmp( r->last_dir, path, len ) == 0 )
+    {
+        return r->last_dir_node;
+    }
+    struct inode* dir = resolve( r->root, path, len );
+    if( dir != NULL && dir->is_directory )
+    {
+        memcpy( r->last_dir, path, len );
+        r->last_dir[len] = 0;
+        r->last_dir_node = dir;
+        return dir;
+    }
+    return NULL;
+}
+
+/* Looks path up in MFT with lookup_inode and returns 1 if it finds an
+ * inode that is the one of path in the tree, with the same ID, size and
+ * blocks, or that the tree does not have, and 0 if it finds nothing or
+ * another inode. So "= ok" catches a miss or a wrong inode, and "= fail"
+ * catches a path that lookup_inode finds but should not.
+ */
+static int find_in_table( struct replay* r, char* path )
+{
+    struct inode* found = lookup_inode( r->mft, path );
+    struct inode* node = resolve( r->root, path, strlen( path ) );
+    int ok = found != NULL
+             && ( node == NULL
+                  || ( found->id == node->id && found->is_directory == node->is_directory
+                       && found->filesize == node->filesize && found->num_blocks == node->num_blocks
+                       && ( node->num_blocks == 0
+                            || memcmp( found->blocks, node->blocks, node->num_blocks * sizeof(size_t) ) == 0 ) ) );
+    fs_shutdown( found );
+    return ok;
+}
+
+/* Carries out op. Returns 1 if it succeeded, 0 if it failed as an
+ * operation on the file system can, and -1 if it could not be tried.
+ */
+static int run_op( struct replay* r, const struct script_op* op )
+{
+    if( op->op == OP_LOCK || op->op == OP_UNLOCK )
+    {
+        if( ( r->lock >= 0 ) == ( op->op == OP_LOCK ) )
+            return 0;
+        if( op->op == OP_LOCK )
+            return ( r->lock = fs_lock_table( r->mft ) ) >= 0;
+        fs_unlock_table( r->lock );
+        r->lock = -1;
+        return 1;
+    }
+    if( r->root == NULL && op->op != OP_FORMAT && op->op != OP_LOAD )
+    {
+        return -1;
+    }
+
+    struct inode* dir;
+    struct inode* node;
+    char* name;
+    switch( op->op )
+    {
+    case OP_FORMAT:
+        fs_shutdown( r->root ); // and the snapshot, whose blocks stay used
+        r->snapshot = NULL;
+        r->last_dir_node = NULL;
+        if( op->arg > 0 )
+            set_disk_num_blocks( op->arg );
+        r->root = format_disk( ) == 0 ? create_dir( NULL, "/" ) : NULL;
+        if( r->data && fs_data_open( r->data_file ) != 0 )
+            r->data = 0;
+        return r->root != NULL;
+    case OP_LOAD:
+        fs_shutdown( r->root );
+        r->snapshot = NULL;
+        r->last_dir_node = NULL;
+        if( strcmp( op->word, "lazy" ) == 0 )
+            r->root = load_inodes_lazy( r->mft );
+        else if( strcmp( op->word, "parallel" ) == 0 )
+            r->root = load_inodes_parallel( r->mft, op->arg );
+        else
+            r->root = load_inodes( r->mft );
+        return r->root != NULL;
+    case OP_REFRESH:
+        node = fs_refresh( r->mft, r->root );
+        if( node != r->root && node != NULL )
+        {
+            r->root = node;
+            r->snapshot = NULL;
+            r->last_dir_node = NULL;
+        }
+        return node != NULL;
+    case OP_SAVE:
+        if( strcmp( op->word, "incremental" ) == 0 )
+            save_inodes_incremental( r->mft, r->root );
+        else
+            save_inodes( r->mft, r->root );
+        return 1;
+    case OP_DEBUG:
+        debug_fs( r->root );
+        debug_disk( );
+        return 1;
+    case OP_LOOKUP:
+        return resolve( r->root, op->word, strlen( op->word ) ) != NULL;
+    case OP_FIND:
+        return find_in_table( r, op->word );
+    case OP_WRITE:
+    case OP_READ:
+        if( !r->data )
+            return -1;
+        return write_or_check( r->io, resolve( r->root, op->word, strlen( op->word ) ), op->op == OP_READ, op->arg );
+    case OP_SNAPREAD:
+        if( !r->data )
+            return -1;
+        return r->snapshot != NULL
+               && write_or_check( r->io, resolve( r->snapshot, op->word, strlen( op->word ) ), 1, op->arg );
+    case OP_SNAPSHOT:
+        if( r->snapshot != NULL )
+            return 0;
+        r->snapshot = fs_snapshot( r->root );
+        return r->snapshot != NULL;
+    case OP_SNAPLOOKUP:
+        return r->snapshot != NULL && resolve( r->snapshot, op->word, strlen( op->word ) ) != NULL;
+    case OP_SNAPSAVE:
+        if( r->snapshot == NULL )
+            return 0;
+        save_inodes( r->snapshot_mft, r->snapshot );
+        return 1;
+    case OP_SNAPDROP:
+        if( r->snapshot == NULL )
+            return 0;
+        fs_snapshot_drop( r->snapshot );
+        r->snapshot = NULL;
+        return 1;
+    }
+
+    dir = parent_of( r, op->word, &name );
+    if( dir == NULL || *name == 0 )
+    {
+        return 0;
+    }
+    switch( op->op )
+    {
+    case OP_MKDIR:
+        return create_dir( dir, name ) != NULL;
+    case OP_CREATE:
+        return create_file( dir, name, op->arg ) != NULL;
+    case OP_DELETE:
+        node = find_inode_by_name( dir, name );
+        return node != NULL && !node->is_directory && delete_file( dir, node ) == 0;
+    case OP_RMDIR:
+        node = find_inode_by_name( dir, name );
+        if( node == NULL || !node->is_directory || delete_dir( dir, node ) != 0 )
+            return 0;
+        // the cached directory may have been this one or below it
+        r->last_dir_node = NULL;
+        return 1;
+    }
+    return -1;
+}
+
+static void usage( const char* prog )
+{
+    fprintf( stderr, "This programs runs a script of operations against one file system.\n"
+                     "A text script has one operation per line:\n"
+                     "    format [BLOCKS]                    empty disk and a new root\n"
+                     "    load [lazy | parallel [THREADS]]   the tree from MFT\n"
+                     "    mkdir PATH\n"
+                     "    create PATH SIZE\n"
+                     "    delete PATH\n"
+                     "    rmdir PATH\n"
+                     "    lookup PATH\n"
+                     "    save [incremental]                 the tree to MFT\n"
+                     "    debug                              print the tree and the disk\n"
+                     "    write PATH [N]                     fill a file with pattern N (0)\n"
+                     "    read PATH [N]                      check that a file holds it\n"
+                     "    snapshot                           take a snapshot of the tree\n"
+                     "    snaplookup PATH                    lookup in the snapshot\n"
+                     "    snapsave                           the snapshot to MFT.snap\n"
+                     "    snapdrop                           drop the snapshot\n"
+                     "    snapread PATH [N]                  read in the snapshot\n"
+                     "    lock                               keep other processes off MFT\n"
+                     "    unlock\n"
+                     "    refresh                            load MFT if another process\n"
+                     "                                       saved it since\n"
+                     "    find PATH                          lookup_inode in MFT, ok if it\n"
+                     "                                       finds PATH as the tree has it\n"
+                     "Paths start with /. A line may end in \"= ok\" or \"= fail\" to say\n"
+                     "what the operation must do; lookup is ok if the path exists.\n"
+                     "Everything after # is a comment. Binary scripts, as written by -c,\n"
+                     "are recognised by their first byte.\n"
+                     "It exits with 0 if every operation did what was expected and 1 if\n"
+                     "one did not.\n"
+                     "\n"
+                     "Usage: %s [-q] [-t] [-f VERSION] [-d DATA] [-a ENGINE] [-c OUT] SCRIPT MFT BAT\n"
+                     "       where\n"
+                     "       -q      prints nothing but failed expectations\n"
+                     "       -t      prints the number of calls and latency percentiles\n"
+                     "               of every operation at the end\n"
+                     "       -f VERSION makes save write MFT in format 1 (the default), 2 or 3\n"
+                     "       -d DATA is the data file that read and write use\n"
+                     "       -a ENGINE makes read and write submit a request per run of\n"
+                     "               blocks at once, with ENGINE uring, threads or any\n"
+                     "       -c OUT  writes SCRIPT to OUT as a binary script, and runs nothing\n"
+                     "       SCRIPT  is the script, - for standard input\n"
+                     "       MFT     is the name of the master file table\n"
+                     "       BAT     is the name of the block allocation table\n"
+                     , prog );
+    exit( -1 );
+}
+
+int main( int argc, char* argv[] )
+{
+    int quiet = 0;
+    int timing = 0;
+    const char* convert = NULL;
+    const char* data_file = NULL;
+    const char* engine = NULL;
+    int format = MFT_V1;
+    int opt;
+    while( ( opt = getopt( argc, argv, "qtf:d:a:c:" ) ) != -1 )
+    {
+        switch( opt )
+        {
+        case 'q': quiet = 1; break;
+        case 't': timing = 1; break;
+        case 'f': format = atoi( optarg ); break;
+        case 'd': data_file = optarg; break;
+        case 'a': engine = optarg; break;
+        case 'c': convert = optarg; break;
+        default: usage( argv[0] );
+        }
+    }
+    if( ( argc - optind != 3 && !( convert != NULL && argc - optind == 1 ) )
+        || ( engine != NULL && strcmp( engine, "uring" ) != 0 && strcmp( engine, "threads" ) != 0
+             && strcmp( engine, "any" ) != 0 )
+        || ( format != MFT_V1 && format != MFT_V2 && format != MFT_V3 ) )
+    {
+        usage( argv[0] );
+    }
+
+    struct script s;
+    memset( &s, 0, sizeof(s) );
+    s.f = strcmp( argv[optind], "-" ) == 0 ? stdin : fopen( argv[optind], "r" );
+    if( s.f == NULL )
+    {
+        fprintf( stderr, "Failed to open file %s for reading\n", argv[optind] );
+        exit( -1 );
+    }
+    // no text line starts with the F of the magic, so one character tells them apart
+    char magic[4];
+    uint32_t version = 0;
+    int c = getc( s.f );
+    ungetc( c, s.f );
+    if( c == SCRIPT_MAGIC[0] )
+    {
+        s.binary = 1;
+        if( fread( magic, sizeof(magic), 1, s.f ) != 1 || memcmp( magic, SCRIPT_MAGIC, sizeof(magic) ) != 0
+            || fread( &version, sizeof(version), 1, s.f ) != 1 || version != 1 )
+        {
+            fprintf( stderr, "Script %s is not a script of a known version\n", argv[optind] );
+            exit( -1 );
+        }
+    }
+
+    struct script_op op;
+    int retval;
+    if( convert != NULL )
+    {
+        FILE* out = fopen( convert, "w" );
+        version = 1;
+        if( out == NULL || fwrite( SCRIPT_MAGIC, 4, 1, out ) != 1 || fwrite( &version, sizeof(version), 1, out ) != 1 )
+        {
+            fprintf( stderr, "Failed to write file %s\n", convert );
+            exit( -1 );
+        }
+        while( ( retval = next_op( &s, &op ) ) > 0 && write_op( out, &op ) == 0 )
+            ;
+        if( retval != 0 || fclose( out ) != 0 )
+        {
+            fprintf( stderr, "Failed to convert %s at operation %ld\n", argv[optind], s.line );
+            exit( -1 );
+        }
+        free( s.buf );
+        fclose( s.f );
+        return 0;
+    }
+
+    struct replay r;
+    memset( &r, 0, sizeof(r) );
+    r.mft = argv[optind + 1];
+    r.lock = -1;
+    r.snapshot_mft = malloc( strlen( r.mft ) + 6 );
+    if( r.snapshot_mft == NULL )
+    {
+        fprintf( stderr, "Failed to allocate memory for the file names\n" );
+        exit( -1 );
+    }
+    sprintf( r.snapshot_mft, "%s.snap", r.mft );
+    r.data_file = data_file;
+    set_mft_format( format );
+    set_block_allocation_table_name( argv[optind + 2] );
+    if( data_file != NULL )
+    {
+        if( fs_data_open( data_file ) != 0 )
+            exit( -1 );
+        r.data = 1;
+    }
+    if( engine != NULL )
+    {
+        enum fs_io_kind kind = strcmp( engine, "uring" ) == 0 ? FS_IO_URING
+                             : strcmp( engine, "threads" ) == 0 ? FS_IO_THREADS : FS_IO_ANY;
+        r.io = fs_io_new( kind, 64 );
+        if( r.io == NULL )
+        {
+            fprintf( stderr, "Failed to set up the %s I/O engine\n", engine );
+            exit( -1 );
+        }
+    }
+
+    struct fs_histogram* histograms = timing ? calloc( NUM_SCRIPT_OPS, sizeof(struct fs_histogram) ) : NULL;
+    if( timing && histograms == NULL )
+    {
+        fprintf( stderr, "Failed to allocate memory for the histograms\n" );
+        exit( -1 );
+    }
+
+    long num_ops = 0;
+    long mismatches = 0;
+    uint64_t first = fs_now_ns( );
+    while( ( retval = next_op( &s, &op ) ) > 0 )
+    {
+        uint64_t start = fs_now_ns( );
+        int ok = run_op( &r, &op );
+        if( histograms != NULL )
+        {
+            histograms[op.op].buckets[fs_hist_bucket( fs_now_ns( ) - start )]++;
+            histograms[op.op].count++;
+        }
+        num_ops++;
+        if( ok < 0 )
+        {
+            fprintf( stderr, "%s:%ld: %s without a file system or a data file\n",
+                     argv[optind], s.line, opcode_names[op.op] );
+            break;
+        }
+
+        int failed = op.expect != EXPECT_NOTHING && ( op.expect == EXPECT_OK ) != ok;
+        if( failed )
+        {
+            mismatches++;
+            printf( "%s:%ld: %s %s %s, expected %s\n", argv[optind], s.line, opcode_names[op.op], op.word,
+                    ok ? "succeeded" : "failed", ok ? "it to fail" : "it to succeed" );
+        }
+        else if( !quiet && op.op != OP_DEBUG )
+        {
+            printf( "%s %s - %s\n", opcode_names[op.op], op.word, ok ? "ok" : "failed" );
+        }
+    }
+    double seconds = ( fs_now_ns( ) - first ) / 1e9;
+    if( retval < 0 )
+    {
+        fprintf( stderr, "%s:%ld: not an operation\n", argv[optind], s.line );
+        mismatches++;
+    }
+
+    if( histograms != NULL )
+    {
+        printf( "%ld operations in %.3f s, %.0f per second\n", num_ops, seconds, seconds > 0 ? num_ops / seconds : 0.0 );
+        for( int i = 0; i < NUM_SCRIPT_OPS; i++ )
+        {
+            struct fs_histogram* h = &histograms[i];
+            if( h->count > 0 )
+            {
+                printf( "%-7s calls %llu p50_us %.3f p99_us %.3f max_us %.3f\n", opcode_names[i],
+                        (unsigned long long)h->count, fs_histogram_quantile( h, 0.5 ) / 1e3,
+                        fs_histogram_quantile( h, 0.99 ) / 1e3, fs_histogram_quantile( h, 1.0 ) / 1e3 );
+            }
+        }
+        free( histograms );
+    }
+
+    fs_shutdown( r.root );
+    fs_unlock_table( r.lock );
+    free( r.snapshot_mft );
+    fs_io_free( r.io );
+    fs_data_close( );
+    release_block_allocation_table_name( );
+    free( s.buf );
+    if( s.f != stdin )
+    {
+        fclose( s.f );
+    }
+    return mismatches == 0 && retval == 0 ? 0 : 1;
+}
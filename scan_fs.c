@@ -0,0 +1,65 @@
+#include "mft.h"
+
+#include <stdio.h>
+
+struct scan_totals
+{
+    long files;
+    long dirs;
+    long bytes;
+    long blocks;
+    int max_depth;
+};
+
+static int print_record( const struct mft_record* rec, int depth, int parent_id, void* arg )
+{
+    struct scan_totals* totals = arg;
+
+    printf( "%*s%s (id %d parent %d", 2 * depth, "", rec->name, rec->id, parent_id );
+    if( rec->is_directory )
+    {
+        printf( " children %d)\n", rec->num_children );
+        totals->dirs++;
+    }
+    else
+    {
+        printf( " size %db blocks ", rec->filesize );
+        for( int i = 0; i < rec->num_blocks; i++ )
+        {
+            printf( "%d ", (int)mft_block( rec, i ) );
+        }
+        printf( ")\n" );
+        totals->files++;
+        totals->bytes += rec->filesize;
+        totals->blocks += rec->num_blocks;
+    }
+    if( depth > totals->max_depth )
+    {
+        totals->max_depth = depth;
+    }
+    return 0;
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 2 )
+    {
+        fprintf( stderr, "This programs reads the master file table (MFT) of a simulated disk\n"
+                         "record by record, without loading it into memory, and prints every\n"
+                         "inode with its depth and parent, followed by totals.\n"
+                         "\n"
+                         "Usage: %s MFT\n"
+                         "       where\n"
+                         "       MFT is the name of the master file table\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    struct scan_totals totals = { 0, 0, 0, 0, 0 };
+    if( mft_scan( argv[1], print_record, &totals ) != 0 )
+    {
+        exit( -1 );
+    }
+    printf( "total: %ld bytes in %ld blocks, %ld files, %ld directories, depth %d\n",
+            totals.bytes, totals.blocks, totals.files, totals.dirs, totals.max_depth );
+}
@@ -0,0 +1,644 @@
+#include "inode.h"
+#include "allocation.h"
+#include "protocol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#define MAX_EVENTS 64
+#define READ_CHUNK 65536
+
+/* A client that sends requests without reading the answers is dropped
+ * once this much is waiting for it.
+ */
+#define MAX_PENDING_OUTPUT ( 64 << 20 )
+
+struct buffer
+{
+    char* data;
+    size_t len;
+    size_t cap;
+};
+
+struct conn
+{
+    int fd;
+    struct buffer in;
+    size_t in_off;   // where the next request starts in in
+    struct buffer out;
+    size_t out_off;  // what of out was sent already
+    int want_write;  // whether epoll is told about EPOLLOUT
+    struct conn* next;
+};
+
+struct server
+{
+    char* mft;
+    struct inode* root;
+    int wal;
+    long changes;    // create_* and delete_* since the last checkpoint
+    int stopping;
+    int epfd;
+    int listen_fd;
+    int timer_fd;
+    int signal_fd;
+    struct conn* conns;
+    struct conn* dropped; // freed once the events that may name them are handled
+};
+
+static int reserve( struct buffer* b, size_t more )
+{
+    if( b->len + more <= b->cap )
+        return 0;
+    size_t cap = b->cap > 0 ? b->cap : 4096;
+    while( cap < b->len + more )
+        cap *= 2;
+    char* data = realloc( b->data, cap );
+    if( data == NULL )
+        return -1;
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+static void checkpoint( struct server* s )
+{
+    if( s->wal )
+    {
+        if( fs_checkpoint( s->mft, s->root ) != 0 )
+        {
+            fprintf( stderr, "Failed to checkpoint %s\n", s->mft );
+            return;
+        }
+    }
+    else
+    {
+        save_inodes_incremental( s->mft, s->root );
+    }
+    s->changes = 0;
+}
+
+/* Returns the inode of path, following it from the root, or NULL.
+ * *status tells why not.
+ */
+static struct inode* resolve( struct inode* root, const char* path, size_t len, int* status )
+{
+    struct inode* node = root;
+    char name[FS_PATH_MAX];
+    size_t pos = 1;
+    *status = FS_STATUS_OK;
+    while( pos < len )
+    {
+        const char* end = memchr( path + pos, '/', len - pos );
+        size_t n = ( end != NULL ? (size_t)( end - path ) : len ) - pos;
+        if( n > 0 )
+        {
+            if( !node->is_directory )
+            {
+                *status = FS_STATUS_NOT_DIR;
+                return NULL;
+            }
+            memcpy( name, path + pos, n );
+            name[n] = 0;
+            node = find_inode_by_name( node, name );
+            if( node == NULL )
+            {
+                *status = FS_STATUS_NOT_FOUND;
+                return NULL;
+            }
+        }
+        pos += n + 1;
+    }
+    return node;
+}
+
+/* Finds the directory that path is in, with *name set to the last part
+ * of path, which is copied to buf.
+ */
+static struct inode* parent_of( struct inode* root, const char* path, size_t len, char* buf, char** name, int* status )
+{
+    const char* slash = path + len;
+    while( slash > path && slash[-1] != '/' )
+        slash--;
+    size_t n = path + len - slash;
+    memcpy( buf, slash, n );
+    buf[n] = 0;
+    *name = buf;
+    if( n == 0 )
+    {
+        *status = FS_STATUS_BAD_REQUEST;
+        return NULL;
+    }
+    struct inode* dir = resolve( root, path, slash - path, status );
+    if( dir != NULL && !dir->is_directory )
+    {
+        *status = FS_STATUS_NOT_DIR;
+        return NULL;
+    }
+    return dir;
+}
+
+static int do_change( struct server* s, const struct fs_request* req, const char* path )
+{
+    char buf[FS_PATH_MAX];
+    char* name;
+    int status;
+    struct inode* dir = parent_of( s->root, path, req->path_len, buf, &name, &status );
+    if( dir == NULL )
+        return status;
+
+    struct inode* node = find_inode_by_name( dir, name );
+    switch( req->op )
+    {
+    case FS_REQ_CREATE:
+        if( node != NULL )
+            return FS_STATUS_EXISTS;
+        if( req->arg < 0 )
+            return FS_STATUS_BAD_REQUEST;
+        if( create_file( dir, name, req->arg ) == NULL )
+            return FS_STATUS_NO_SPACE;
+        break;
+    case FS_REQ_MKDIR:
+        if( node != NULL )
+            return FS_STATUS_EXISTS;
+        if( create_dir( dir, name ) == NULL )
+            return FS_STATUS_NO_SPACE;
+        break;
+    case FS_REQ_DELETE:
+        if( node == NULL )
+            return FS_STATUS_NOT_FOUND;
+        if( node->is_directory )
+            return FS_STATUS_IS_DIR;
+        if( delete_file( dir, node ) != 0 )
+            return FS_STATUS_FAILED;
+        break;
+    case FS_REQ_RMDIR:
+        if( node == NULL )
+            return FS_STATUS_NOT_FOUND;
+        if( !node->is_directory )
+            return FS_STATUS_NOT_DIR;
+        if( fs_load_children( node ) != 0 )
+            return FS_STATUS_FAILED;
+        if( node->num_children > 0 )
+            return FS_STATUS_NOT_EMPTY;
+        if( delete_dir( dir, node ) != 0 )
+            return FS_STATUS_FAILED;
+        break;
+    }
+    s->changes++;
+    return FS_STATUS_OK;
+}
+
+/* Appends the payload of a lookup, stat or list of path to out. */
+static int do_read( struct server* s, const struct fs_request* req, const char* path, struct buffer* out )
+{
+    int status;
+    struct inode* node = resolve( s->root, path, req->path_len, &status );
+    if( node == NULL )
+        return status;
+
+    if( req->op == FS_REQ_LOOKUP )
+    {
+        struct fs_entry e;
+        memset( &e, 0, sizeof(e) );
+        e.id = node->id;
+        e.is_directory = node->is_directory;
+        if( reserve( out, sizeof(e) ) != 0 )
+            return FS_STATUS_NO_SPACE;
+        memcpy( out->data + out->len, &e, sizeof(e) );
+        out->len += sizeof(e);
+        return FS_STATUS_OK;
+    }
+
+    if( node->is_directory && fs_load_children( node ) != 0 )
+        return FS_STATUS_FAILED;
+
+    if( req->op == FS_REQ_STAT )
+    {
+        struct fs_usage usage;
+        struct fs_stat st;
+        fs_usage( node, &usage );
+        memset( &st, 0, sizeof(st) );
+        st.id = node->id;
+        st.filesize = node->filesize;
+        st.num_blocks = node->num_blocks;
+        st.num_children = node->is_directory ? node->num_children : 0;
+        st.is_directory = node->is_directory;
+        st.tree_files = usage.files;
+        st.tree_dirs = usage.dirs;
+        st.tree_bytes = usage.bytes;
+        st.tree_blocks = usage.blocks;
+        if( reserve( out, sizeof(st) ) != 0 )
+            return FS_STATUS_NO_SPACE;
+        memcpy( out->data + out->len, &st, sizeof(st) );
+        out->len += sizeof(st);
+        return FS_STATUS_OK;
+    }
+
+    if( !node->is_directory )
+        return FS_STATUS_NOT_DIR;
+    for( int i = 0; i < node->num_children; i++ )
+    {
+        struct inode* child = node->children[i];
+        size_t name_len = strlen( child->name );
+        struct fs_entry e;
+        memset( &e, 0, sizeof(e) );
+        e.id = child->id;
+        e.is_directory = child->is_directory;
+        e.name_len = name_len;
+        if( name_len > UINT16_MAX || reserve( out, sizeof(e) + name_len ) != 0 )
+            return FS_STATUS_NO_SPACE;
+        memcpy( out->data + out->len, &e, sizeof(e) );
+        memcpy( out->data + out->len + sizeof(e), child->name, name_len );
+        out->len += sizeof(e) + name_len;
+    }
+    return FS_STATUS_OK;
+}
+
+/* Answers one request: appends its response to out. */
+static int handle( struct server* s, const struct fs_request* req, const char* path, struct buffer* out )
+{
+    struct fs_response res;
+    if( reserve( out, sizeof(res) ) != 0 )
+        return -1;
+    size_t at = out->len;
+    out->len += sizeof(res);
+
+    int status;
+    if( req->op != FS_REQ_SAVE && req->op != FS_REQ_STOP
+        && ( req->path_len == 0 || req->path_len >= FS_PATH_MAX || path[0] != '/' ) )
+    {
+        status = FS_STATUS_BAD_REQUEST;
+    }
+    else
+    {
+        switch( req->op )
+        {
+        case FS_REQ_CREATE:
+        case FS_REQ_MKDIR:
+        case FS_REQ_DELETE:
+        case FS_REQ_RMDIR:
+            status = do_change( s, req, path );
+            break;
+        case FS_REQ_LOOKUP:
+        case FS_REQ_STAT:
+        case FS_REQ_LIST:
+            status = do_read( s, req, path, out );
+            break;
+        case FS_REQ_STOP:
+            s->stopping = 1;
+            // fall through
+        case FS_REQ_SAVE:
+            checkpoint( s );
+            status = FS_STATUS_OK;
+            break;
+        default:
+            status = FS_STATUS_BAD_REQUEST;
+        }
+    }
+    if( status != FS_STATUS_OK )
+        out->len = at + sizeof(res);
+
+    memset( &res, 0, sizeof(res) );
+    res.tag = req->tag;
+    res.status = status;
+    res.length = out->len - at - sizeof(res);
+    memcpy( out->data + at, &res, sizeof(res) );
+    return 0;
+}
+
+static void drop( struct server* s, struct conn* c )
+{
+    for( struct conn** p = &s->conns; *p != NULL; p = &(*p)->next )
+    {
+        if( *p == c )
+        {
+            *p = c->next;
+            break;
+        }
+    }
+    close( c->fd );
+    c->fd = -1;
+    c->next = s->dropped;
+    s->dropped = c;
+}
+
+static void free_dropped( struct server* s )
+{
+    while( s->dropped != NULL )
+    {
+        struct conn* c = s->dropped;
+        s->dropped = c->next;
+        free( c->in.data );
+        free( c->out.data );
+        free( c );
+    }
+}
+
+/* Sends what is waiting in out, as far as the socket takes it. Returns
+ * -1 if the connection is gone.
+ */
+static int flush( struct server* s, struct conn* c )
+{
+    while( c->out_off < c->out.len )
+    {
+        ssize_t n = send( c->fd, c->out.data + c->out_off, c->out.len - c->out_off, MSG_NOSIGNAL );
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+            break;
+        if( n <= 0 )
+            return -1;
+        c->out_off += n;
+    }
+    if( c->out_off == c->out.len )
+    {
+        c->out.len = 0;
+        c->out_off = 0;
+    }
+
+    int want_write = c->out_off < c->out.len;
+    if( want_write != c->want_write )
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | ( want_write ? EPOLLOUT : 0 );
+        ev.data.ptr = c;
+        epoll_ctl( s->epfd, EPOLL_CTL_MOD, c->fd, &ev );
+        c->want_write = want_write;
+    }
+    return 0;
+}
+
+/* Reads what the client sent and answers every request that is complete.
+ * Returns -1 if the connection is to be dropped.
+ */
+static int serve( struct server* s, struct conn* c )
+{
+    for( ;; )
+    {
+        if( reserve( &c->in, READ_CHUNK ) != 0 )
+            return -1;
+        ssize_t n = recv( c->fd, c->in.data + c->in.len, READ_CHUNK, 0 );
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+            break;
+        if( n <= 0 )
+            return -1;
+        c->in.len += n;
+    }
+
+    struct fs_request req;
+    while( c->in.len - c->in_off >= sizeof(req) )
+    {
+        memcpy( &req, c->in.data + c->in_off, sizeof(req) );
+        if( c->in.len - c->in_off < sizeof(req) + req.path_len )
+            break;
+        if( handle( s, &req, c->in.data + c->in_off + sizeof(req), &c->out ) != 0 )
+            return -1;
+        c->in_off += sizeof(req) + req.path_len;
+        if( s->stopping )
+            break;
+    }
+    memmove( c->in.data, c->in.data + c->in_off, c->in.len - c->in_off );
+    c->in.len -= c->in_off;
+    c->in_off = 0;
+
+    if( flush( s, c ) != 0 || c->out.len - c->out_off > MAX_PENDING_OUTPUT )
+        return -1;
+    return 0;
+}
+
+static void accept_all( struct server* s )
+{
+    for( ;; )
+    {
+        int fd = accept( s->listen_fd, NULL, NULL );
+        if( fd < 0 )
+        {
+            if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+                perror( "accept" );
+            if( errno == EINTR )
+                continue;
+            return;
+        }
+        fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+        fcntl( fd, F_SETFD, FD_CLOEXEC );
+        struct conn* c = calloc( 1, sizeof(struct conn) );
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if( c == NULL || epoll_ctl( s->epfd, EPOLL_CTL_ADD, fd, &ev ) != 0 )
+        {
+            free( c );
+            close( fd );
+            continue;
+        }
+        c->fd = fd;
+        c->next = s->conns;
+        s->conns = c;
+    }
+}
+
+static int listen_on( const char* path )
+{
+    // the socket gets its name once it listens, so a client never finds one it cannot connect to
+    struct sockaddr_un addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    if( snprintf( addr.sun_path, sizeof(addr.sun_path), "%s.%d", path, (int)getpid( ) ) >= (int)sizeof(addr.sun_path) )
+    {
+        fprintf( stderr, "Socket name %s is too long\n", path );
+        return -1;
+    }
+
+    int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( fd < 0 )
+    {
+        perror( "socket" );
+        return -1;
+    }
+    unlink( addr.sun_path );
+    if( bind( fd, (struct sockaddr*)&addr, sizeof(addr) ) != 0 || listen( fd, 128 ) != 0
+        || rename( addr.sun_path, path ) != 0 )
+    {
+        fprintf( stderr, "Failed to listen on %s\n", path );
+        perror( "reason:" );
+        unlink( addr.sun_path );
+        close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+static void usage( const char* prog )
+{
+    fprintf( stderr, "This programs keeps a file system in memory and serves create,\n"
+                     "mkdir, delete, rmdir, lookup, stat and list requests for it on a\n"
+                     "Unix domain socket (see protocol.h), so that a request costs a few\n"
+                     "microseconds instead of loading the master file table. The tree is\n"
+                     "saved every few seconds if it changed, and when the program gets\n"
+                     "SIGINT or SIGTERM or a stop request.\n"
+                     "\n"
+                     "Usage: %s [-i SECONDS] [-l] [-w] SOCKET MFT BAT\n"
+                     "       where\n"
+                     "       -i SECONDS  is the time between saves, 10 if not given,\n"
+                     "                   0 to save only on request and at the end\n"
+                     "       -l          loads the tree lazily, see load_inodes_lazy()\n"
+                     "       -w          makes every change durable through the\n"
+                     "                   write-ahead log, see fs_wal_open()\n"
+                     "       SOCKET      is the name of the socket to create\n"
+                     "       MFT         is the name of the master file table\n"
+                     "       BAT         is the name of the block allocation table\n"
+                     , prog );
+    exit( -1 );
+}
+
+int main( int argc, char* argv[] )
+{
+    int interval = 10;
+    int lazy = 0;
+    int wal = 0;
+    int opt;
+    while( ( opt = getopt( argc, argv, "i:lw" ) ) != -1 )
+    {
+        switch( opt )
+        {
+        case 'i': interval = atoi( optarg ); break;
+        case 'l': lazy = 1; break;
+        case 'w': wal = 1; break;
+        default: usage( argv[0] );
+        }
+    }
+    if( argc - optind != 3 || interval < 0 )
+    {
+        usage( argv[0] );
+    }
+    const char* socket_name = argv[optind];
+
+    struct server s;
+    memset( &s, 0, sizeof(s) );
+    s.mft = argv[optind + 1];
+    s.wal = wal;
+    set_block_allocation_table_name( argv[optind + 2] );
+
+    s.root = lazy ? load_inodes_lazy( s.mft ) : load_inodes( s.mft );
+    if( s.root == NULL )
+    {
+        fprintf( stderr, "Failed to load the master file table %s\n", s.mft );
+        exit( -1 );
+    }
+    if( wal && fs_wal_open( s.mft, s.root ) != 0 )
+    {
+        fprintf( stderr, "Failed to open the write-ahead log of %s\n", s.mft );
+        exit( -1 );
+    }
+
+    // the signals are read from a descriptor, so they end the loop between requests
+    sigset_t signals;
+    sigemptyset( &signals );
+    sigaddset( &signals, SIGINT );
+    sigaddset( &signals, SIGTERM );
+    sigprocmask( SIG_BLOCK, &signals, NULL );
+    s.signal_fd = signalfd( -1, &signals, SFD_NONBLOCK | SFD_CLOEXEC );
+
+    s.timer_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+    struct itimerspec period;
+    memset( &period, 0, sizeof(period) );
+    period.it_interval.tv_sec = interval;
+    period.it_value.tv_sec = interval;
+    s.listen_fd = listen_on( socket_name );
+    s.epfd = epoll_create1( EPOLL_CLOEXEC );
+    if( s.signal_fd < 0 || s.timer_fd < 0 || s.listen_fd < 0 || s.epfd < 0
+        || timerfd_settime( s.timer_fd, 0, &period, NULL ) != 0 )
+    {
+        fprintf( stderr, "Failed to set up the server\n" );
+        exit( -1 );
+    }
+    int fds[3] = { s.listen_fd, s.timer_fd, s.signal_fd };
+    for( int i = 0; i < 3; i++ )
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &fds[i];
+        epoll_ctl( s.epfd, EPOLL_CTL_ADD, fds[i], &ev );
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while( !s.stopping )
+    {
+        int n = epoll_wait( s.epfd, events, MAX_EVENTS, -1 );
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n < 0 )
+        {
+            perror( "epoll_wait" );
+            break;
+        }
+        for( int i = 0; i < n && !s.stopping; i++ )
+        {
+            void* ptr = events[i].data.ptr;
+            if( ptr == &fds[0] )
+            {
+                accept_all( &s );
+            }
+            else if( ptr == &fds[1] )
+            {
+                uint64_t expirations;
+                if( read( s.timer_fd, &expirations, sizeof(expirations) ) > 0 && s.changes > 0 )
+                    checkpoint( &s );
+            }
+            else if( ptr == &fds[2] )
+            {
+                s.stopping = 1;
+            }
+            else
+            {
+                struct conn* c = ptr;
+                int failed = 0;
+                if( c->fd < 0 )
+                    continue;
+                if( events[i].events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) )
+                    failed = serve( &s, c );
+                else if( events[i].events & EPOLLOUT )
+                    failed = flush( &s, c );
+                if( failed )
+                    drop( &s, c );
+            }
+        }
+        free_dropped( &s );
+    }
+
+    // the answer to a stop request is sent before the socket closes
+    while( s.conns != NULL )
+    {
+        struct conn* c = s.conns;
+        if( c->out_off < c->out.len )
+        {
+            fcntl( c->fd, F_SETFL, fcntl( c->fd, F_GETFL ) & ~O_NONBLOCK );
+            flush( &s, c );
+        }
+        drop( &s, c );
+    }
+    free_dropped( &s );
+    close( s.listen_fd );
+    unlink( socket_name );
+    close( s.epfd );
+    close( s.timer_fd );
+    close( s.signal_fd );
+
+    if( s.changes > 0 )
+        checkpoint( &s );
+    fs_shutdown( s.root );
+    release_block_allocation_table_name( );
+    return 0;
+}
@@ -0,0 +1,356 @@
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+_Thread_local struct fs_stats_slot *fs_stats_mine = NULL;
+
+/* The slots of the running threads. A thread that exits adds its counts
+ * to retired and gives its slot back, so that short-lived threads such
+ * as the workers of load_inodes_parallel() do not pile up.
+ */
+static struct fs_stats_slot *slots = NULL;
+static struct fs_stats retired;
+static uint64_t retired_histograms[FS_NUM_OPS][FS_HIST_BUCKETS];
+static int num_threads = 0;
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+static const char *counter_names[FS_NUM_COUNTERS] =
+{
+    "bat_reads", "bat_bytes_read", "bat_writes", "bat_bytes_written",
+    "blocks_allocated", "blocks_freed",
+    "find_calls", "name_compares", "children_reallocs",
+    "mft_records_read", "mft_bytes_read", "mft_records_written", "mft_bytes_written",
+    "loads", "load_ns", "saves", "save_ns",
+    "data_reads", "data_bytes_read", "data_writes", "data_bytes_written"
+};
+
+static const char *op_names[FS_NUM_OPS] =
+{
+    "create_file", "create_dir", "find_inode_by_name", "delete_file", "delete_dir",
+    "load_inodes", "load_inodes_parallel", "load_inodes_lazy", "lookup_inode",
+    "save_inodes", "save_inodes_incremental", "fs_snapshot", "fs_checkpoint", "fs_shutdown",
+    "allocate_block", "free_block", "format_disk", "fs_read", "fs_write"
+};
+
+/* The trace ring. Its size is a power of two, so an event's slot is
+ * its number masked. The ring is never freed, since a call may still
+ * be writing to it after the trace stopped.
+ */
+static struct fs_trace_event *trace_ring = NULL;
+static size_t trace_mask = 0;
+static atomic_uint_fast64_t trace_next = 0;
+static atomic_int tracing = 0;
+
+static void retire_slot(void *arg)
+{
+    struct fs_stats_slot *slot = arg;
+    pthread_mutex_lock(&slots_lock);
+    for (struct fs_stats_slot **p = &slots; *p != NULL; p = &(*p)->next)
+    {
+        if (*p == slot)
+        {
+            *p = slot->next;
+            break;
+        }
+    }
+    for (int c = 0; c < FS_NUM_COUNTERS; c++)
+    {
+        retired.counters[c] += atomic_load_explicit(&slot->counters[c], memory_order_relaxed);
+    }
+    for (int op = 0; op < FS_NUM_OPS; op++)
+    {
+        for (int b = 0; b < FS_HIST_BUCKETS; b++)
+        {
+            retired_histograms[op][b] += atomic_load_explicit(&slot->histograms[op][b], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&slots_lock);
+    fs_stats_mine = NULL;
+    free(slot);
+}
+
+static void create_slot_key(void)
+{
+    pthread_key_create(&slot_key, retire_slot);
+}
+
+struct fs_stats_slot *fs_stats_slot_new(void)
+{
+    struct fs_stats_slot *slot = calloc(1, sizeof(struct fs_stats_slot));
+    if (slot == NULL)
+    {
+        return NULL;
+    }
+    pthread_once(&slot_key_once, create_slot_key);
+    pthread_setspecific(slot_key, slot);
+
+    pthread_mutex_lock(&slots_lock);
+    slot->thread = num_threads++;
+    slot->next = slots;
+    slots = slot;
+    pthread_mutex_unlock(&slots_lock);
+    fs_stats_mine = slot;
+    return slot;
+}
+
+uint64_t fs_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void fs_stats(struct fs_stats *stats)
+{
+    pthread_mutex_lock(&slots_lock);
+    *stats = retired;
+    for (struct fs_stats_slot *slot = slots; slot != NULL; slot = slot->next)
+    {
+        for (int c = 0; c < FS_NUM_COUNTERS; c++)
+        {
+            stats->counters[c] += atomic_load_explicit(&slot->counters[c], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&slots_lock);
+}
+
+const char *fs_counter_name(enum fs_counter c)
+{
+    return c >= 0 && c < FS_NUM_COUNTERS ? counter_names[c] : NULL;
+}
+
+void fs_stats_print(FILE *f, const struct fs_stats *stats)
+{
+    for (int c = 0; c < FS_NUM_COUNTERS; c++)
+    {
+        fprintf(f, "%s %llu\n", counter_names[c], (unsigned long long)stats->counters[c]);
+    }
+}
+
+int fs_hist_bucket(uint64_t ns)
+{
+    if (ns < FS_HIST_SUB)
+    {
+        return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    return (msb - 2) * FS_HIST_SUB + (int)((ns >> (msb - 3)) & (FS_HIST_SUB - 1));
+}
+
+uint64_t fs_hist_bucket_start(int bucket)
+{
+    if (bucket < FS_HIST_SUB)
+    {
+        return bucket;
+    }
+    int msb = bucket / FS_HIST_SUB + 2;
+    return (uint64_t)(FS_HIST_SUB + bucket % FS_HIST_SUB) << (msb - 3);
+}
+
+void fs_op_done(enum fs_op op, uint64_t start, int id)
+{
+    uint64_t end = fs_now_ns();
+    struct fs_stats_slot *slot = fs_stats_mine;
+    if (slot == NULL && (slot = fs_stats_slot_new()) == NULL)
+    {
+        return;
+    }
+    _Atomic uint64_t *bucket = &slot->histograms[op][fs_hist_bucket(end - start)];
+    atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1, memory_order_relaxed);
+
+    // acquire, so that the ring fs_trace_start() made is seen
+    if (atomic_load_explicit(&tracing, memory_order_acquire))
+    {
+        uint64_t n = atomic_fetch_add_explicit(&trace_next, 1, memory_order_relaxed);
+        struct fs_trace_event *event = &trace_ring[n & trace_mask];
+        event->start_ns = start;
+        event->duration_ns = end - start;
+        event->id = id;
+        event->op = op;
+        event->thread = slot->thread;
+    }
+}
+
+void fs_histogram(enum fs_op op, struct fs_histogram *h)
+{
+    pthread_mutex_lock(&slots_lock);
+    memcpy(h->buckets, retired_histograms[op], sizeof(h->buckets));
+    for (struct fs_stats_slot *slot = slots; slot != NULL; slot = slot->next)
+    {
+        for (int b = 0; b < FS_HIST_BUCKETS; b++)
+        {
+            h->buckets[b] += atomic_load_explicit(&slot->histograms[op][b], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&slots_lock);
+    h->count = 0;
+    for (int b = 0; b < FS_HIST_BUCKETS; b++)
+    {
+        h->count += h->buckets[b];
+    }
+}
+
+uint64_t fs_histogram_quantile(const struct fs_histogram *h, double q)
+{
+    if (h->count == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * h->count);
+    rank += rank < q * h->count;
+    rank = rank < 1 ? 1 : rank > h->count ? h->count : rank;
+    uint64_t seen = 0;
+    for (int b = 0; b < FS_HIST_BUCKETS; b++)
+    {
+        seen += h->buckets[b];
+        if (seen >= rank)
+        {
+            return b + 1 < FS_HIST_BUCKETS ? fs_hist_bucket_start(b + 1) : UINT64_MAX;
+        }
+    }
+    return UINT64_MAX;
+}
+
+const char *fs_op_name(enum fs_op op)
+{
+    return op >= 0 && op < FS_NUM_OPS ? op_names[op] : NULL;
+}
+
+void fs_histograms_print(FILE *f)
+{
+    struct fs_histogram h;
+    for (int op = 0; op < FS_NUM_OPS; op++)
+    {
+        fs_histogram(op, &h);
+        if (h.count == 0)
+        {
+            continue;
+        }
+        fprintf(f, "%s calls %llu p50_us %.3f p90_us %.3f p99_us %.3f p999_us %.3f max_us %.3f\n",
+                op_names[op], (unsigned long long)h.count,
+                fs_histogram_quantile(&h, 0.5) / 1e3, fs_histogram_quantile(&h, 0.9) / 1e3,
+                fs_histogram_quantile(&h, 0.99) / 1e3, fs_histogram_quantile(&h, 0.999) / 1e3,
+                fs_histogram_quantile(&h, 1.0) / 1e3);
+    }
+}
+
+int fs_trace_start(size_t num_events)
+{
+    size_t size = 1;
+    while (size < num_events)
+    {
+        size *= 2;
+    }
+    pthread_mutex_lock(&slots_lock);
+    if (trace_ring != NULL)
+    {
+        pthread_mutex_unlock(&slots_lock);
+        return -1;
+    }
+    trace_ring = calloc(size, sizeof(struct fs_trace_event));
+    trace_mask = size - 1;
+    pthread_mutex_unlock(&slots_lock);
+    if (trace_ring == NULL)
+    {
+        return -1;
+    }
+    atomic_store(&tracing, 1);
+    return 0;
+}
+
+void fs_trace_stop(void)
+{
+    atomic_store(&tracing, 0);
+}
+
+int fs_trace_dump(const char *path)
+{
+    if (trace_ring == NULL)
+    {
+        return -1;
+    }
+    uint64_t next = atomic_load(&trace_next);
+    uint64_t first = next > trace_mask + 1 ? next - (trace_mask + 1) : 0;
+    struct fs_trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FS_TRACE_MAGIC, sizeof(header.magic));
+    header.version = 1;
+    header.num_events = next - first;
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Failed to open %s to write the trace\n", path);
+        return -1;
+    }
+    int retval = fwrite(&header, sizeof(header), 1, f) == 1 ? 0 : -1;
+    for (uint64_t n = first; retval == 0 && n < next; n++)
+    {
+        if (fwrite(&trace_ring[n & trace_mask], sizeof(struct fs_trace_event), 1, f) != 1)
+        {
+            retval = -1;
+        }
+    }
+    if (fclose(f) != 0 || retval != 0)
+    {
+        fprintf(stderr, "Failed to write the trace to %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static const char *dump_target = NULL;
+static const char *trace_target = NULL;
+
+static void dump_stats(void)
+{
+    struct fs_stats stats;
+    fs_stats(&stats);
+    if (strcmp(dump_target, "1") == 0 || strcmp(dump_target, "-") == 0)
+    {
+        fs_stats_print(stderr, &stats);
+        fs_histograms_print(stderr);
+        return;
+    }
+    FILE *f = fopen(dump_target, "a");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Failed to open %s to write the statistics\n", dump_target);
+        return;
+    }
+    fs_stats_print(f, &stats);
+    fs_histograms_print(f);
+    fclose(f);
+}
+
+static void dump_trace(void)
+{
+    fs_trace_stop();
+    fs_trace_dump(trace_target);
+}
+
+__attribute__((constructor)) static void register_dumps(void)
+{
+    const char *target = getenv("FS_STATS");
+    if (target != NULL && *target != '\0')
+    {
+        dump_target = target;
+        atexit(dump_stats);
+    }
+    target = getenv("FS_TRACE");
+    if (target != NULL && *target != '\0')
+    {
+        const char *events = getenv("FS_TRACE_EVENTS");
+        long num_events = events != NULL ? atol(events) : 0;
+        if (fs_trace_start(num_events > 0 ? (size_t)num_events : 1 << 20) == 0)
+        {
+            trace_target = target;
+            atexit(dump_trace);
+        }
+    }
+}
@@ -0,0 +1,207 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Counters for the hot paths of the file system. They are always on:
+ * every thread counts into its own slot with plain relaxed loads and
+ * stores, so counting costs no locked instruction and no shared cache
+ * line. fs_stats() adds up the slots of all threads.
+ *
+ * If the environment variable FS_STATS is set when a program starts,
+ * the counters and latency histograms are printed to stderr when it
+ * exits, or appended to the file FS_STATS names if it is neither "1"
+ * nor "-".
+ */
+enum fs_counter
+{
+	FS_BAT_READS,          // read_table() calls
+	FS_BAT_BYTES_READ,
+	FS_BAT_WRITES,         // write_table() calls
+	FS_BAT_BYTES_WRITTEN,
+	FS_BLOCKS_ALLOCATED,
+	FS_BLOCKS_FREED,
+	FS_FIND_CALLS,         // find_inode_by_name()
+	FS_NAME_COMPARES,      // strcmp() of a child's name while looking for one
+	FS_CHILDREN_REALLOCS,  // children arrays that were grown
+	FS_MFT_RECORDS_READ,   // decoded records
+	FS_MFT_BYTES_READ,
+	FS_MFT_RECORDS_WRITTEN, // encoded records
+	FS_MFT_BYTES_WRITTEN,
+	FS_LOADS,              // load_inodes*() calls
+	FS_LOAD_NS,            // wall-clock time spent in them
+	FS_SAVES,              // save_inodes*() calls
+	FS_SAVE_NS,
+	FS_DATA_READS,         // pread() calls of fs_read()
+	FS_DATA_BYTES_READ,
+	FS_DATA_WRITES,        // pwrite() calls of fs_write()
+	FS_DATA_BYTES_WRITTEN,
+	FS_NUM_COUNTERS
+};
+
+struct fs_stats
+{
+	uint64_t counters[FS_NUM_COUNTERS];
+};
+
+/* The public functions of inode.h, allocation.h and data.h whose
+ * latency is recorded. allocate_block covers allocate_block_near() as well.
+ */
+enum fs_op
+{
+	FS_OP_CREATE_FILE,
+	FS_OP_CREATE_DIR,
+	FS_OP_FIND_INODE_BY_NAME,
+	FS_OP_DELETE_FILE,
+	FS_OP_DELETE_DIR,
+	FS_OP_LOAD_INODES,
+	FS_OP_LOAD_INODES_PARALLEL,
+	FS_OP_LOAD_INODES_LAZY,
+	FS_OP_LOOKUP_INODE,
+	FS_OP_SAVE_INODES,
+	FS_OP_SAVE_INODES_INCREMENTAL,
+	FS_OP_SNAPSHOT,
+	FS_OP_CHECKPOINT,
+	FS_OP_SHUTDOWN,
+	FS_OP_ALLOCATE_BLOCK,
+	FS_OP_FREE_BLOCK,
+	FS_OP_FORMAT_DISK,
+	FS_OP_READ,
+	FS_OP_WRITE,
+	FS_NUM_OPS
+};
+
+/* Latencies in nanoseconds are counted in buckets whose width doubles
+ * every FS_HIST_SUB buckets, as in an HDR histogram with one
+ * significant octal digit: a value is off by at most 1/8 of itself.
+ * Values below FS_HIST_SUB get a bucket each.
+ */
+#define FS_HIST_SUB     8
+#define FS_HIST_BUCKETS (62 * FS_HIST_SUB)
+
+struct fs_histogram
+{
+	uint64_t count;
+	uint64_t buckets[FS_HIST_BUCKETS];
+};
+
+/* The counters and histograms of one thread. Only that thread writes
+ * them.
+ */
+struct fs_stats_slot
+{
+	_Atomic uint64_t counters[FS_NUM_COUNTERS];
+	_Atomic uint64_t histograms[FS_NUM_OPS][FS_HIST_BUCKETS];
+	int thread; // numbers the threads in the order they first counted
+	struct fs_stats_slot *next;
+};
+
+extern _Thread_local struct fs_stats_slot *fs_stats_mine;
+
+/* Gives the calling thread its slot. Returns NULL if there is no memory
+ * for it, in which case the thread does not count.
+ */
+struct fs_stats_slot *fs_stats_slot_new(void);
+
+/* Adds n to counter c of the calling thread. */
+static inline void fs_count(enum fs_counter c, uint64_t n)
+{
+	struct fs_stats_slot *slot = fs_stats_mine;
+	if (slot == NULL && (slot = fs_stats_slot_new()) == NULL)
+	{
+		return;
+	}
+	uint64_t value = atomic_load_explicit(&slot->counters[c], memory_order_relaxed);
+	atomic_store_explicit(&slot->counters[c], value + n, memory_order_relaxed);
+}
+
+/* Returns a monotonic clock in nanoseconds, for the *_NS counters. */
+uint64_t fs_now_ns(void);
+
+/* Fills in stats with the counters of all threads so far, including
+ * threads that have exited. Counts that other threads make at the same
+ * time may or may not be included.
+ */
+void fs_stats(struct fs_stats *stats);
+
+/* Returns the name of counter c, such as "bat_reads". */
+const char *fs_counter_name(enum fs_counter c);
+
+/* Prints stats as one "name value" line per counter. */
+void fs_stats_print(FILE *f, const struct fs_stats *stats);
+
+/* Records that op, which started at start (from fs_now_ns()), is done.
+ * id is the inode the call was about: the directory for creates and
+ * finds, the root for loads and saves, the block for block operations,
+ * the file for reads and writes, or -1. Also adds an event to the trace if one is running.
+ */
+void fs_op_done(enum fs_op op, uint64_t start, int id);
+
+/* Returns the bucket of a latency of ns nanoseconds, and the smallest
+ * latency in a bucket.
+ */
+int fs_hist_bucket(uint64_t ns);
+uint64_t fs_hist_bucket_start(int bucket);
+
+/* Fills in h with the latencies of op in all threads so far. */
+void fs_histogram(enum fs_op op, struct fs_histogram *h);
+
+/* Returns the latency below which the fraction q of the calls in h
+ * fell, as the end of its bucket, in nanoseconds. 0 without calls.
+ */
+uint64_t fs_histogram_quantile(const struct fs_histogram *h, double q);
+
+/* Returns the name of op, which is the name of its function. */
+const char *fs_op_name(enum fs_op op);
+
+/* Prints a line per op that was called, with the number of calls and
+ * the 50th, 90th, 99th and 99.9th percentile and the maximum latency in
+ * microseconds.
+ */
+void fs_histograms_print(FILE *f);
+
+/* The trace is a ring of the last events, one per recorded call. It
+ * costs an atomic add per call while it runs. If the environment
+ * variable FS_TRACE names a file when a program starts, a trace of
+ * FS_TRACE_EVENTS events (1048576 if not set) runs until the program
+ * exits and is then written to the file. trace_fs turns a trace file
+ * into JSON for chrome://tracing or Perfetto.
+ *
+ * A trace file is struct fs_trace_header followed by the events, the
+ * oldest first.
+ */
+#define FS_TRACE_MAGIC "FSTR"
+
+struct fs_trace_header
+{
+	char magic[4];
+	uint32_t version;
+	uint64_t num_events;
+};
+
+struct fs_trace_event
+{
+	uint64_t start_ns;
+	uint64_t duration_ns;
+	int32_t id;
+	uint16_t op;
+	uint16_t thread;
+};
+
+/* Starts tracing into a ring of at least num_events events. Returns 0
+ * on success and -1 if there is no memory or a trace already ran.
+ */
+int fs_trace_start(size_t num_events);
+
+/* Stops adding events. */
+void fs_trace_stop(void);
+
+/* Writes the events in the ring to path. Events of calls that finish
+ * while it runs may be missing or torn, so stop the trace or the
+ * operations first. Returns 0 on success and -1 on failure.
+ */
+int fs_trace_dump(const char *path);
+
+#endif
@@ -0,0 +1,81 @@
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 2 && argc != 3 )
+    {
+        fprintf( stderr, "This programs turns a trace that a program wrote because FS_TRACE\n"
+                         "was set into the JSON of the Chrome trace event format, which\n"
+                         "chrome://tracing and Perfetto show as a timeline: a bar per call,\n"
+                         "a row per thread. Times start at the first call.\n"
+                         "\n"
+                         "Usage: %s TRACE [JSON]\n"
+                         "       where\n"
+                         "       TRACE is the trace file\n"
+                         "       JSON is the file to write, standard output if not given\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    FILE* in = fopen( argv[1], "r" );
+    if( in == NULL )
+    {
+        fprintf( stderr, "Failed to open file %s for reading\n", argv[1] );
+        exit( -1 );
+    }
+    struct fs_trace_header header;
+    if( fread( &header, sizeof(header), 1, in ) != 1
+        || memcmp( header.magic, FS_TRACE_MAGIC, sizeof(header.magic) ) != 0 || header.version != 1 )
+    {
+        fprintf( stderr, "File %s is not a trace\n", argv[1] );
+        exit( -1 );
+    }
+
+    FILE* out = argc == 3 ? fopen( argv[2], "w" ) : stdout;
+    if( out == NULL )
+    {
+        fprintf( stderr, "Failed to open file %s for writing\n", argv[2] );
+        exit( -1 );
+    }
+
+    // the events are in the order the calls finished, so find the earliest start first
+    long data = ftell( in );
+    uint64_t first = UINT64_MAX;
+    struct fs_trace_event event;
+    uint64_t n;
+    for( n = 0; n < header.num_events && fread( &event, sizeof(event), 1, in ) == 1; n++ )
+    {
+        if( event.start_ns < first )
+            first = event.start_ns;
+    }
+    if( n != header.num_events )
+    {
+        fprintf( stderr, "Trace %s is cut short after %llu of %llu events\n",
+                 argv[1], (unsigned long long)n, (unsigned long long)header.num_events );
+    }
+    fseek( in, data, SEEK_SET );
+
+    fprintf( out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n" );
+    for( uint64_t i = 0; i < n && fread( &event, sizeof(event), 1, in ) == 1; i++ )
+    {
+        const char* name = fs_op_name( event.op );
+        fprintf( out, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                      "\"args\":{\"id\":%d}}%s\n",
+                 name != NULL ? name : "unknown", event.thread,
+                 ( event.start_ns - first ) / 1e3, event.duration_ns / 1e3, event.id,
+                 i + 1 < n ? "," : "" );
+    }
+    fprintf( out, "]}\n" );
+
+    fclose( in );
+    if( out != stdout && fclose( out ) != 0 )
+    {
+        fprintf( stderr, "Failed to write file %s\n", argv[2] );
+        exit( -1 );
+    }
+    return 0;
+}
@@ -0,0 +1,400 @@
+#include "wal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct wal
+{
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t synced_cond;
+    uint64_t written; // the end of the last record
+    uint64_t synced;  // everything before it is on disk
+    int syncing;      // a thread is in fdatasync
+    int failed;
+};
+
+char *wal_name(const char *master_file_table)
+{
+    size_t len = strlen(master_file_table);
+    char *name = malloc(len + sizeof(".wal"));
+    if (name != NULL)
+    {
+        memcpy(name, master_file_table, len);
+        memcpy(name + len, ".wal", sizeof(".wal"));
+    }
+    return name;
+}
+
+// Fills in the header of a log for master_file_table as it is now.
+static int wal_identify(const char *master_file_table, struct wal_header *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, WAL_MAGIC, sizeof(header->magic));
+    header->version = 1;
+    if (mft_log_identify(master_file_table, &header->base) != 0)
+    {
+        return -1;
+    }
+    if (mft_log_exists(master_file_table))
+    {
+        char *name = mft_log_name(master_file_table);
+        struct stat st;
+        if (name != NULL && stat(name, &st) == 0)
+        {
+            header->log_size = st.st_size;
+        }
+        free(name);
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const char *data, size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* Checks the record at pos of the len bytes at base. Returns its
+ * length, or 0 if it is cut short or its checksum does not match.
+ */
+static size_t check_record(const char *base, size_t len, size_t pos, struct wal_record *rec)
+{
+    if (len - pos < sizeof(*rec))
+    {
+        return 0;
+    }
+    memcpy(rec, base + pos, sizeof(*rec));
+    uint64_t size = sizeof(*rec) + (uint64_t)rec->name_len + (uint64_t)rec->num_blocks * sizeof(uint32_t);
+    if (size > len - pos)
+    {
+        return 0;
+    }
+    const size_t skip = sizeof(rec->checksum);
+    if ((uint32_t)mft_hash(base + pos + skip, size - skip, MFT_HASH_SEED) != rec->checksum)
+    {
+        return 0;
+    }
+    return size;
+}
+
+/* Maps the log of master_file_table if it belongs to the table as it is
+ * now. Returns the fd, or -1 if there is no such log; *addr is NULL if
+ * the log could not be mapped.
+ */
+static int map_log(const char *master_file_table, int flags, char **addr, size_t *len)
+{
+    *addr = NULL;
+    *len = 0;
+    struct wal_header want;
+    char *name = wal_name(master_file_table);
+    if (name == NULL || wal_identify(master_file_table, &want) != 0)
+    {
+        free(name);
+        return -1;
+    }
+    int fd = open(name, flags, 0644);
+    free(name);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(want))
+    {
+        char *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED && memcmp(p, &want, sizeof(want)) == 0)
+        {
+            *addr = p;
+            *len = st.st_size;
+        }
+        else if (p != MAP_FAILED)
+        {
+            munmap(p, st.st_size);
+        }
+    }
+    return fd;
+}
+
+struct wal *wal_open(const char *master_file_table)
+{
+    struct wal *wal = calloc(1, sizeof(struct wal));
+    if (wal == NULL)
+    {
+        return NULL;
+    }
+    char *addr;
+    size_t len;
+    wal->fd = map_log(master_file_table, O_RDWR | O_CREAT, &addr, &len);
+    if (wal->fd < 0)
+    {
+        free(wal);
+        return NULL;
+    }
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->synced_cond, NULL);
+
+    if (addr == NULL)
+    {
+        if (wal_reset(wal, master_file_table) != 0)
+        {
+            wal_close(wal);
+            return NULL;
+        }
+        return wal;
+    }
+
+    // keep the complete records, and write over whatever follows them
+    size_t pos = sizeof(struct wal_header);
+    struct wal_record rec;
+    size_t size;
+    while ((size = check_record(addr, len, pos, &rec)) > 0)
+    {
+        pos += size;
+    }
+    munmap(addr, len);
+    if (pos < len && (ftruncate(wal->fd, pos) != 0 || fdatasync(wal->fd) != 0))
+    {
+        wal_close(wal);
+        return NULL;
+    }
+    wal->written = pos;
+    wal->synced = pos;
+    return wal;
+}
+
+long wal_append(struct wal *wal, const struct wal_op *op)
+{
+    struct wal_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.op = op->op;
+    rec.id = op->id;
+    rec.parent_id = op->parent_id;
+    if (op->op != WAL_DELETE)
+    {
+        rec.name_len = strlen(op->name);
+        rec.filesize = op->filesize;
+        rec.num_blocks = op->num_blocks;
+    }
+
+    size_t size = sizeof(rec) + rec.name_len + (size_t)rec.num_blocks * sizeof(uint32_t);
+    char small[256];
+    char *data = size <= sizeof(small) ? small : malloc(size);
+    if (data == NULL)
+    {
+        return -1;
+    }
+    char *p = data + sizeof(rec);
+    memcpy(p, op->name, rec.name_len);
+    p += rec.name_len;
+    for (uint32_t i = 0; i < rec.num_blocks; i++)
+    {
+        uint32_t block = op->blocks[i];
+        memcpy(p, &block, sizeof(block));
+        p += sizeof(block);
+    }
+    memcpy(data, &rec, sizeof(rec));
+    const size_t skip = sizeof(rec.checksum);
+    rec.checksum = (uint32_t)mft_hash(data + skip, size - skip, MFT_HASH_SEED);
+    memcpy(data, &rec.checksum, skip);
+
+    pthread_mutex_lock(&wal->lock);
+    long lsn = -1;
+    if (!wal->failed && pwrite_all(wal->fd, data, size, wal->written) == 0)
+    {
+        wal->written += size;
+        lsn = wal->written;
+    }
+    else
+    {
+        // a partly written record would end the log for everything after it
+        wal->failed = 1;
+    }
+    pthread_mutex_unlock(&wal->lock);
+
+    if (data != small)
+    {
+        free(data);
+    }
+    return lsn;
+}
+
+int wal_sync(struct wal *wal, long lsn)
+{
+    pthread_mutex_lock(&wal->lock);
+    while (!wal->failed && wal->synced < (uint64_t)lsn)
+    {
+        if (wal->syncing)
+        {
+            pthread_cond_wait(&wal->synced_cond, &wal->lock);
+            continue;
+        }
+        // sync for every thread that has written so far
+        uint64_t target = wal->written;
+        wal->syncing = 1;
+        pthread_mutex_unlock(&wal->lock);
+        int retval = fdatasync(wal->fd);
+        pthread_mutex_lock(&wal->lock);
+        wal->syncing = 0;
+        if (retval != 0)
+        {
+            wal->failed = 1;
+        }
+        else if (target > wal->synced)
+        {
+            wal->synced = target;
+        }
+        pthread_cond_broadcast(&wal->synced_cond);
+    }
+    int failed = wal->failed;
+    pthread_mutex_unlock(&wal->lock);
+    return failed ? -1 : 0;
+}
+
+int wal_reset(struct wal *wal, const char *master_file_table)
+{
+    struct wal_header header;
+    if (wal_identify(master_file_table, &header) != 0)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    while (wal->syncing)
+    {
+        pthread_cond_wait(&wal->synced_cond, &wal->lock);
+    }
+    int retval = -1;
+    if (ftruncate(wal->fd, 0) == 0
+        && pwrite_all(wal->fd, (const char *)&header, sizeof(header), 0) == 0
+        && fdatasync(wal->fd) == 0)
+    {
+        wal->written = sizeof(header);
+        wal->synced = sizeof(header);
+        wal->failed = 0;
+        retval = 0;
+    }
+    else
+    {
+        wal->failed = 1;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return retval;
+}
+
+long wal_size(struct wal *wal)
+{
+    pthread_mutex_lock(&wal->lock);
+    long size = wal->written;
+    pthread_mutex_unlock(&wal->lock);
+    return size;
+}
+
+void wal_close(struct wal *wal)
+{
+    if (wal == NULL)
+    {
+        return;
+    }
+    wal_sync(wal, wal_size(wal));
+    close(wal->fd);
+    pthread_cond_destroy(&wal->synced_cond);
+    pthread_mutex_destroy(&wal->lock);
+    free(wal);
+}
+
+int wal_exists(const char *master_file_table)
+{
+    char *addr;
+    size_t len;
+    int fd = map_log(master_file_table, O_RDONLY, &addr, &len);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (addr == NULL)
+    {
+        return 0;
+    }
+    struct wal_record rec;
+    int exists = check_record(addr, len, sizeof(struct wal_header), &rec) > 0;
+    munmap(addr, len);
+    return exists;
+}
+
+long wal_replay(const char *master_file_table, int (*apply)(const struct wal_op *op, void *arg), void *arg)
+{
+    char *addr;
+    size_t len;
+    int fd = map_log(master_file_table, O_RDONLY, &addr, &len);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (addr == NULL)
+    {
+        return 0;
+    }
+
+    long num = 0;
+    char *name = NULL;
+    size_t *blocks = NULL;
+    size_t pos = sizeof(struct wal_header);
+    struct wal_record rec;
+    size_t size;
+    while ((size = check_record(addr, len, pos, &rec)) > 0)
+    {
+        const char *p = addr + pos + sizeof(rec);
+        char *new_name = realloc(name, (size_t)rec.name_len + 1);
+        size_t *new_blocks = realloc(blocks, ((size_t)rec.num_blocks + 1) * sizeof(size_t));
+        name = new_name != NULL ? new_name : name;
+        blocks = new_blocks != NULL ? new_blocks : blocks;
+        if (new_name == NULL || new_blocks == NULL || rec.num_blocks > INT32_MAX)
+        {
+            num = -1;
+            break;
+        }
+        memcpy(name, p, rec.name_len);
+        name[rec.name_len] = 0;
+        p += rec.name_len;
+        for (uint32_t i = 0; i < rec.num_blocks; i++)
+        {
+            uint32_t block;
+            memcpy(&block, p + i * sizeof(block), sizeof(block));
+            blocks[i] = block;
+        }
+
+        struct wal_op op = { rec.op, rec.id, rec.parent_id, name, rec.filesize, rec.num_blocks, blocks };
+        if (apply(&op, arg) != 0)
+        {
+            num = -1;
+            break;
+        }
+        num++;
+        pos += size;
+    }
+
+    free(name);
+    free(blocks);
+    munmap(addr, len);
+    return num;
+}
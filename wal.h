@@ -0,0 +1,120 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include "mft.h"
+
+#include <stdint.h>
+
+/* The write-ahead log of a master file table is the file <table>.wal.
+ * While a tree has one (see fs_wal_open() in inode.h), every create_*
+ * and delete_* appends a record of what it did, so the change is
+ * durable without saving the table. Loading the table replays the log
+ * over the table and its delta log; a checkpoint saves the tree and
+ * starts the log over.
+ *
+ * The log starts with struct wal_header, which names the table and
+ * the size of its delta log at the last save. The log only applies to
+ * exactly that state; any save makes it stale, and a stale log is
+ * ignored. Then come the records: struct wal_record, the name (without
+ * a 0) and a uint32 per block. The checksum covers everything after
+ * itself; a record whose checksum does not match, such as one cut
+ * short by a crash, ends the log.
+ *
+ * The block allocation table is a shared mapping that the kernel writes
+ * back when it likes, so the entries of a created file's blocks are
+ * synced to disk before its record is written, and the blocks of a
+ * deleted file are freed, and their entries synced, after its record is
+ * on disk. So replay never allocates or frees blocks, and a crash of
+ * the machine can at worst leave blocks allocated that no file uses.
+ */
+#define WAL_MAGIC "MFTW"
+
+struct wal_header
+{
+	char magic[4];
+	uint32_t version;
+	struct mft_log_header base;
+	uint64_t log_size; // 0 without a delta log
+};
+
+#define WAL_CREATE_FILE 1
+#define WAL_CREATE_DIR  2
+#define WAL_DELETE      3
+
+struct wal_record
+{
+	uint32_t checksum;
+	uint32_t op;
+	int32_t id;
+	int32_t parent_id;
+	int32_t filesize;
+	uint32_t num_blocks;
+	uint32_t name_len;
+};
+
+/* One operation. For WAL_DELETE only id and parent_id are used. */
+struct wal_op
+{
+	int op;
+	int id;
+	int parent_id;
+	const char *name; // 0-terminated
+	int filesize;
+	int num_blocks;
+	const size_t *blocks;
+};
+
+/* An open log that records are appended to. */
+struct wal;
+
+/* Returns the name of the write-ahead log of master_file_table in a new
+ * string.
+ */
+char *wal_name(const char *master_file_table);
+
+/* Opens the log of master_file_table for appending. A log that belongs
+ * to the table as it is now is kept, without anything a crash left
+ * after its last complete record; any other log is started over.
+ * Returns NULL on failure.
+ */
+struct wal *wal_open(const char *master_file_table);
+
+/* Appends op. Returns the position the log must be synced to for op to
+ * be durable, or -1 on failure. Records appear in the order of the
+ * calls.
+ */
+long wal_append(struct wal *wal, const struct wal_op *op);
+
+/* Returns once everything up to lsn is on disk. Callers that wait at
+ * the same time share a single fdatasync (group commit): one thread
+ * syncs everything written so far while the others wait for it.
+ * Returns 0 on success and -1 if the log could not be synced.
+ */
+int wal_sync(struct wal *wal, long lsn);
+
+/* Starts the log over for master_file_table as it is now. Called after
+ * the tree was saved, which the records in the log are part of.
+ * Returns 0 on success and -1 on failure.
+ */
+int wal_reset(struct wal *wal, const char *master_file_table);
+
+/* Returns the size of the log in bytes. */
+long wal_size(struct wal *wal);
+
+/* Syncs and closes the log. */
+void wal_close(struct wal *wal);
+
+/* Returns 1 if master_file_table has a log that belongs to it and holds
+ * at least one record.
+ */
+int wal_exists(const char *master_file_table);
+
+/* Calls apply for every record in the log of master_file_table, in the
+ * order they were written, until apply returns non-zero. The op points
+ * into memory that is only valid during the call.
+ * Returns the number of records, 0 if there is no log for the table as
+ * it is now, and -1 on failure.
+ */
+long wal_replay(const char *master_file_table, int (*apply)(const struct wal_op *op, void *arg), void *arg);
+
+#endif
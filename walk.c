@@ -0,0 +1,473 @@
+#include "walk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+/* Directories with more children than this are split into several
+ * tasks, so that one huge directory can be walked by all threads.
+ */
+#define WALK_GRAIN 256
+
+/* A directory that is being walked. pending counts the tasks over
+ * its children and the child directories that have not finished yet.
+ * When it drops to zero the subtree is complete and its totals are
+ * added to the parent.
+ */
+struct walk_frame
+{
+    struct inode *dir;
+    struct walk_frame *parent;
+    int depth;
+    atomic_long pending;
+    atomic_long files;
+    atomic_long dirs;
+    atomic_long bytes;
+    atomic_long blocks;
+};
+
+// The children lo..hi-1 of frame->dir.
+struct walk_task
+{
+    struct walk_frame *frame;
+    int lo;
+    int hi;
+};
+
+/* Every worker owns one deque. The owner pushes and pops at the tail,
+ * thieves take the oldest task at the head, which is usually the
+ * biggest piece of work.
+ */
+struct walk_deque
+{
+    pthread_mutex_t lock;
+    struct walk_task *tasks;
+    int head;
+    int tail;
+    int cap;
+};
+
+struct walk_pool
+{
+    int num_threads;
+    struct walk_deque *deques;
+    atomic_long outstanding; // tasks that are queued or running
+    atomic_int failed;
+    const struct walk_ops *ops;
+    struct fs_usage total;
+};
+
+struct walk_worker
+{
+    struct walk_pool *pool;
+    int index;
+};
+
+static int deque_push(struct walk_deque *dq, struct walk_task task)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->cap)
+    {
+        if (dq->head > 0)
+        {
+            memmove(dq->tasks, dq->tasks + dq->head, (dq->tail - dq->head) * sizeof(struct walk_task));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        }
+        else
+        {
+            int cap = dq->cap ? dq->cap * 2 : 64;
+            struct walk_task *tasks = realloc(dq->tasks, cap * sizeof(struct walk_task));
+            if (tasks == NULL)
+            {
+                pthread_mutex_unlock(&dq->lock);
+                return -1;
+            }
+            dq->tasks = tasks;
+            dq->cap = cap;
+        }
+    }
+    dq->tasks[dq->tail++] = task;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+static int deque_pop(struct walk_deque *dq, struct walk_task *task)
+{
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head)
+    {
+        *task = dq->tasks[--dq->tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static int deque_steal(struct walk_deque *dq, struct walk_task *task)
+{
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head)
+    {
+        *task = dq->tasks[dq->head++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static struct walk_frame *frame_new(struct inode *dir, struct walk_frame *parent, int depth)
+{
+    struct walk_frame *frame = malloc(sizeof(struct walk_frame));
+    if (frame == NULL)
+    {
+        return NULL;
+    }
+    frame->dir = dir;
+    frame->parent = parent;
+    frame->depth = depth;
+    atomic_init(&frame->pending, 1); // the task over all children
+    atomic_init(&frame->files, 0);
+    atomic_init(&frame->dirs, 0);
+    atomic_init(&frame->bytes, 0);
+    atomic_init(&frame->blocks, 0);
+    return frame;
+}
+
+static void frame_add(struct walk_frame *frame, const struct fs_usage *usage)
+{
+    atomic_fetch_add_explicit(&frame->files, usage->files, memory_order_relaxed);
+    atomic_fetch_add_explicit(&frame->dirs, usage->dirs, memory_order_relaxed);
+    atomic_fetch_add_explicit(&frame->bytes, usage->bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&frame->blocks, usage->blocks, memory_order_relaxed);
+}
+
+/* Drops one pending reference. The last one completes the directory
+ * and passes its totals up, which may complete the parent as well.
+ */
+static void frame_release(struct walk_pool *pool, struct walk_frame *frame)
+{
+    while (frame != NULL && atomic_fetch_sub(&frame->pending, 1) == 1)
+    {
+        struct fs_usage usage;
+        usage.files = atomic_load(&frame->files);
+        usage.dirs = atomic_load(&frame->dirs) + 1;
+        usage.bytes = atomic_load(&frame->bytes);
+        usage.blocks = atomic_load(&frame->blocks);
+
+        if (pool->ops && pool->ops->leave)
+        {
+            pool->ops->leave(frame->dir, frame, frame->depth, &usage, pool->ops->arg);
+        }
+
+        struct walk_frame *parent = frame->parent;
+        if (parent != NULL)
+        {
+            frame_add(parent, &usage);
+        }
+        else
+        {
+            pool->total = usage;
+        }
+        free(frame);
+        frame = parent;
+    }
+}
+
+static void push_task(struct walk_pool *pool, int index, struct walk_task task)
+{
+    atomic_fetch_add(&pool->outstanding, 1);
+    if (deque_push(&pool->deques[index], task) != 0)
+    {
+        // nowhere to queue it; leave out that part of the tree
+        atomic_store(&pool->failed, 1);
+        atomic_fetch_sub(&pool->outstanding, 1);
+        frame_release(pool, task.frame);
+    }
+}
+
+static void run_task(struct walk_pool *pool, int index, struct walk_task task)
+{
+    struct walk_frame *frame = task.frame;
+    struct inode *dir = frame->dir;
+    const struct walk_ops *ops = pool->ops;
+
+    // keep the first part and give the rest away
+    while (task.hi - task.lo > WALK_GRAIN)
+    {
+        struct walk_task rest = { frame, task.lo + (task.hi - task.lo) / 2, task.hi };
+        task.hi = rest.lo;
+        atomic_fetch_add(&frame->pending, 1);
+        push_task(pool, index, rest);
+    }
+
+    struct fs_usage local = { 0, 0, 0, 0 };
+    for (int i = task.lo; i < task.hi; i++)
+    {
+        struct inode *child = dir->children[i];
+        if (ops && ops->visit)
+        {
+            ops->visit(child, frame, frame->depth + 1, ops->arg);
+        }
+
+        if (child->is_directory)
+        {
+            struct walk_frame *sub = frame_new(child, frame, frame->depth + 1);
+            if (sub == NULL || fs_load_children(child) != 0)
+            {
+                atomic_store(&pool->failed, 1);
+                free(sub);
+                continue;
+            }
+            atomic_fetch_add(&frame->pending, 1);
+            struct walk_task subtask = { sub, 0, child->num_children };
+            push_task(pool, index, subtask);
+        }
+        else
+        {
+            local.files++;
+            local.bytes += child->filesize;
+            local.blocks += child->num_blocks;
+        }
+    }
+
+    frame_add(frame, &local);
+    frame_release(pool, frame);
+    atomic_fetch_sub(&pool->outstanding, 1);
+}
+
+static void *worker_main(void *arg)
+{
+    struct walk_worker *worker = arg;
+    struct walk_pool *pool = worker->pool;
+    struct walk_task task;
+
+    for (;;)
+    {
+        int found = deque_pop(&pool->deques[worker->index], &task);
+        for (int i = 1; !found && i < pool->num_threads; i++)
+        {
+            int victim = (worker->index + i) % pool->num_threads;
+            found = deque_steal(&pool->deques[victim], &task);
+        }
+
+        if (found)
+        {
+            run_task(pool, worker->index, task);
+        }
+        else if (atomic_load(&pool->outstanding) == 0)
+        {
+            break;
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+int walk_tree(struct inode *root, int num_threads, const struct walk_ops *ops, struct fs_usage *total)
+{
+    struct fs_usage empty = { 0, 0, 0, 0 };
+    if (total)
+    {
+        *total = empty;
+    }
+    if (root == NULL)
+    {
+        return 0;
+    }
+
+    if (ops && ops->visit)
+    {
+        ops->visit(root, NULL, 0, ops->arg);
+    }
+    if (root->is_directory && fs_load_children(root) != 0)
+    {
+        return -1;
+    }
+    if (!root->is_directory)
+    {
+        if (total)
+        {
+            total->files = 1;
+            total->bytes = root->filesize;
+            total->blocks = root->num_blocks;
+        }
+        return 0;
+    }
+
+    if (num_threads <= 0)
+    {
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_threads <= 0)
+            num_threads = 1;
+    }
+
+    struct walk_pool pool;
+    pool.num_threads = num_threads;
+    pool.ops = ops;
+    pool.total = empty;
+    atomic_init(&pool.outstanding, 0);
+    atomic_init(&pool.failed, 0);
+    pool.deques = calloc(num_threads, sizeof(struct walk_deque));
+    struct walk_worker *workers = calloc(num_threads, sizeof(struct walk_worker));
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+    struct walk_frame *frame = frame_new(root, NULL, 0);
+    if (pool.deques == NULL || workers == NULL || threads == NULL || frame == NULL)
+    {
+        free(pool.deques);
+        free(workers);
+        free(threads);
+        free(frame);
+        return -1;
+    }
+    for (int i = 0; i < num_threads; i++)
+    {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        workers[i].pool = &pool;
+        workers[i].index = i;
+    }
+
+    struct walk_task task = { frame, 0, root->num_children };
+    push_task(&pool, 0, task);
+
+    // the calling thread is worker 0
+    int started = 1;
+    for (; started < num_threads; started++)
+    {
+        if (pthread_create(&threads[started], NULL, worker_main, &workers[started]) != 0)
+        {
+            break;
+        }
+    }
+    worker_main(&workers[0]);
+    for (int i = 1; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].tasks);
+    }
+    free(pool.deques);
+    free(workers);
+    free(threads);
+
+    if (total)
+    {
+        *total = pool.total;
+    }
+    return atomic_load(&pool.failed) ? -1 : 0;
+}
+
+int walk_path(const struct walk_frame *parent, struct inode *node, char *buf, size_t len)
+{
+    if (parent != NULL && parent->dir == node)
+    {
+        parent = parent->parent;
+    }
+
+    // the root is printed by its own name, everything else starts below it
+    if (parent == NULL)
+    {
+        size_t n = strlen(node->name);
+        if (n + 1 > len)
+            return -1;
+        memcpy(buf, node->name, n + 1);
+        return n;
+    }
+
+    size_t need = 1 + strlen(node->name);
+    for (const struct walk_frame *f = parent; f->parent != NULL; f = f->parent)
+    {
+        need += 1 + strlen(f->dir->name);
+    }
+    if (need + 1 > len)
+        return -1;
+
+    // fill in the components from the end
+    size_t pos = need;
+    buf[pos] = '\0';
+    const char *name = node->name;
+    const struct walk_frame *f = parent;
+    for (;;)
+    {
+        size_t n = strlen(name);
+        pos -= n;
+        memcpy(buf + pos, name, n);
+        buf[--pos] = '/';
+        if (f->parent == NULL)
+            break;
+        name = f->dir->name;
+        f = f->parent;
+    }
+    return need;
+}
+
+struct du_arg
+{
+    void (*report)(const char *path, const struct fs_usage *usage, void *arg);
+    void *arg;
+};
+
+static void du_leave(struct inode *dir, struct walk_frame *frame, int depth, const struct fs_usage *usage, void *arg)
+{
+    (void)depth;
+    struct du_arg *du = arg;
+    char path[PATH_MAX];
+    if (walk_path(frame, dir, path, sizeof(path)) >= 0)
+    {
+        du->report(path, usage, du->arg);
+    }
+}
+
+int fs_du(struct inode *root, int num_threads,
+          void (*report)(const char *path, const struct fs_usage *usage, void *arg), void *arg,
+          struct fs_usage *total)
+{
+    struct du_arg du = { report, arg };
+    struct walk_ops ops = { NULL, report ? du_leave : NULL, &du };
+    return walk_tree(root, num_threads, &ops, total);
+}
+
+struct find_arg
+{
+    const char *pattern;
+    void (*found)(const char *path, struct inode *node, void *arg);
+    void *arg;
+};
+
+static void find_visit(struct inode *node, struct walk_frame *parent, int depth, void *arg)
+{
+    (void)depth;
+    struct find_arg *find = arg;
+    if (fnmatch(find->pattern, node->name, 0) != 0)
+    {
+        return;
+    }
+    char path[PATH_MAX];
+    if (walk_path(parent, node, path, sizeof(path)) >= 0)
+    {
+        find->found(path, node, find->arg);
+    }
+}
+
+int fs_find(struct inode *root, const char *pattern, int num_threads,
+            void (*found)(const char *path, struct inode *node, void *arg), void *arg)
+{
+    struct find_arg find = { pattern, found, arg };
+    struct walk_ops ops = { find_visit, NULL, &find };
+    return walk_tree(root, num_threads, &ops, NULL);
+}
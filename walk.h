@@ -0,0 +1,58 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include "inode.h"
+
+/* Per-directory state of a running walk. It is opaque, but it can be
+ * handed to walk_path() to get the path of an inode being visited.
+ */
+struct walk_frame;
+
+/* Callbacks for walk_tree. Both are optional and are called from the
+ * worker threads, so they must be thread-safe.
+ *
+ * visit is called once for every inode below root (and for root),
+ * with the frame of the directory that contains it (NULL for root).
+ *
+ * leave is called once for every directory when its whole subtree has
+ * been walked, with the totals for that subtree. Children always leave
+ * before their parent.
+ */
+struct walk_ops
+{
+	void (*visit)(struct inode *node, struct walk_frame *parent, int depth, void *arg);
+	void (*leave)(struct inode *dir, struct walk_frame *frame, int depth, const struct fs_usage *usage, void *arg);
+	void *arg;
+};
+
+/* Walk the tree below root with num_threads threads that steal
+ * work from each other. Large directories are split so that their
+ * children are spread over several threads. num_threads <= 0 means
+ * one thread per online CPU.
+ * The tree must not be changed while the walk is running.
+ * If total is not NULL it receives the totals for the whole tree.
+ * Returns 0 on success and -1 if the threads could not be started.
+ */
+int walk_tree(struct inode *root, int num_threads, const struct walk_ops *ops, struct fs_usage *total);
+
+/* Write the path of node to buf, where parent is the frame passed to
+ * the visit callback (or the frame passed to leave, with node being
+ * that directory). Returns the length of the path, or -1 if it does
+ * not fit into len bytes.
+ */
+int walk_path(const struct walk_frame *parent, struct inode *node, char *buf, size_t len);
+
+/* du-style aggregation: calls report for every directory with the
+ * totals for its subtree. Returns like walk_tree.
+ */
+int fs_du(struct inode *root, int num_threads,
+          void (*report)(const char *path, const struct fs_usage *usage, void *arg), void *arg,
+          struct fs_usage *total);
+
+/* Calls found for every inode whose name matches the shell wildcard
+ * pattern (see fnmatch(3)). Returns like walk_tree.
+ */
+int fs_find(struct inode *root, const char *pattern, int num_threads,
+            void (*found)(const char *path, struct inode *node, void *arg), void *arg);
+
+#endif
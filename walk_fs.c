@@ -0,0 +1,75 @@
+#include "inode.h"
+#include "walk.h"
+
+#include <stdio.h>
+
+static void print_usage( const char* path, const struct fs_usage* usage, void* arg )
+{
+    (void)arg;
+    printf( "%10ld %6ld %6ld %6ld  %s\n", usage->bytes, usage->blocks, usage->files, usage->dirs, path );
+}
+
+static void print_match( const char* path, struct inode* node, void* arg )
+{
+    (void)arg;
+    printf( "%s%s\n", path, node->is_directory ? "/" : "" );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 3 && argc != 4 )
+    {
+        fprintf( stderr, "This programs loads the master file table (MFT) of a simulated disk\n"
+                         "and walks it with several threads, which also parse the table.\n"
+                         "Without a pattern it prints the size in bytes and blocks and the number\n"
+                         "of files and directories below every directory, like du.\n"
+                         "With a pattern it prints every file or directory whose name matches it,\n"
+                         "like find -name.\n"
+                         "\n"
+                         "Usage: %s MFT THREADS [PATTERN]\n"
+                         "       where\n"
+                         "       MFT is the name of the master file table\n"
+                         "       THREADS is the number of threads, 0 for one per CPU\n"
+                         "       PATTERN is a shell wildcard pattern\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    int threads = atoi( argv[2] );
+    struct inode* root = load_inodes_parallel( argv[1], threads );
+    if( root == NULL )
+    {
+        exit( -1 );
+    }
+
+    int retval;
+    if( argc == 4 )
+    {
+        retval = fs_find( root, argv[3], threads, print_match, NULL );
+    }
+    else
+    {
+        struct fs_usage total;
+        printf( "     bytes blocks  files   dirs  path\n" );
+        retval = fs_du( root, threads, print_usage, NULL, &total );
+        printf( "total: %ld bytes in %ld blocks, %ld files, %ld directories\n",
+                total.bytes, total.blocks, total.files, total.dirs );
+
+        /* The root keeps the same totals without a walk. */
+        struct fs_usage cached;
+        fs_usage( root, &cached );
+        if( memcmp( &cached, &total, sizeof(cached) ) != 0 )
+        {
+            printf( "cached totals differ: %ld bytes in %ld blocks, %ld files, %ld directories\n",
+                    cached.bytes, cached.blocks, cached.files, cached.dirs );
+        }
+    }
+
+    fs_shutdown( root );
+
+    if( retval != 0 )
+    {
+        fprintf( stderr, "The walk ran out of memory, the output is incomplete\n" );
+        exit( -1 );
+    }
+}